@@ -41,12 +41,12 @@
 #define MIN_MSDU_LEN   20
 #define MAX_INSTANCES  5
 #define TX_PERIOD_US   (getRand(2000, 3000))
-#define TO_BACKOFF_US  10000
 #define WAIT_CONFIRM   0
 #define ONE_DIRECTION  0
 #define INSERT_SYNC    (getRand(0,0))
 #define INDIRECT       1
 #define INDIRECTJUNK   5
+#define MAX_OUTSTANDING (INDIRECTJUNK + 1)
 #define USELONGADDR    (getRand(0,0))
 #define ACKREQ         (getRand(1,1))
 #define NUMRETRIES     4
@@ -89,7 +89,7 @@ struct inst_priv
 
 	unsigned int mTx, mSourced, mRx, mAckRemote, mErr, mRestarts, mBadRx, mBadTx,
 	             mCAF, mNack, mRepeats, mMissed, mUnexpected, mMissedAcked, mAckLost,
-	             mTO, mBackoff, mConfirmLost, mConfirmDup;
+	             mTO, mConfirmLost, mConfirmDup;
 };
 
 int numInsts;
@@ -98,6 +98,12 @@ struct inst_priv insts[MAX_INSTANCES] = {};
 pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t rand_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+//Count of dongles plugged in, for waiting on devices to become available
+pthread_mutex_t arrival_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t arrival_cond = PTHREAD_COND_INITIALIZER;
+unsigned int arrivals = 0;
+int hotplugRunning = 0;
+
 void initInst(struct inst_priv *cur);
 
 static int getRand(int min, int max)
@@ -200,11 +206,8 @@ static int driverErrorCallback(int error_number, struct ca821x_dev *pDeviceRef)
 	pthread_cond_t *confirm_cond = &(priv->confirm_cond);
 
 	printf( COLOR_SET(RED,"DRIVER FAILED FOR %x WITH ERROR %d") "\n\r" , priv->mAddress, error_number);
-	printf( COLOR_SET(BLUE,"Attempting restart...") "\n\r");
-
-	initInst(priv);
-
-	printf( COLOR_SET(GREEN,"Restart successful!") "\n\r");
+	//The exchange replays the PIB configuration once this returns
+	printf( COLOR_SET(BLUE,"Restoring configuration...") "\n\r");
 
 	pthread_mutex_lock(&out_mutex);
 	priv->mRestarts++;
@@ -218,38 +221,84 @@ static int driverErrorCallback(int error_number, struct ca821x_dev *pDeviceRef)
 	return 0;
 }
 
-int handleUserCallback(const uint8_t *buf, size_t len,
-											 struct ca821x_dev *pDeviceRef)
+static void handleArrival(const char *path, const char *serial, void *context)
 {
-	struct inst_priv *other, *priv = pDeviceRef->context;
+	printf("Dongle %s (%s) plugged in\r\n", serial, path);
 
-	if (buf[0] == 0xA0)
-	{
-		if (strstr((char*)(buf+2), "Erroneous rx from ") != NULL) {
-			int from = strtol((char*)(buf+20), NULL, 16);
+	pthread_mutex_lock(&arrival_mutex);
+	arrivals++;
+	pthread_cond_broadcast(&arrival_cond);
+	pthread_mutex_unlock(&arrival_mutex);
+}
 
-			pthread_mutex_lock(&out_mutex);
-			priv->mBadRx++;
-			pthread_mutex_unlock(&out_mutex);
+//Initialise a device, waiting for a dongle to be plugged in if none are free
+static void initDevice(struct ca821x_dev *pDeviceRef)
+{
+	unsigned int seen;
 
-			if((other = getInstFromAddr(from)) != NULL)
-			{
-				pthread_mutex_lock(&out_mutex);
-				other->mBadTx++;
-				pthread_mutex_unlock(&out_mutex);
-			}
+	pthread_mutex_lock(&arrival_mutex);
+	seen = arrivals;
+	pthread_mutex_unlock(&arrival_mutex);
+
+	while(ca821x_util_init(pDeviceRef, &driverErrorCallback))
+	{
+		if(!hotplugRunning)
+		{
+			sleep(1); //Wait while there isn't a device available to connect
+			continue;
 		}
 
-		if(strstr((char*)(buf+2), "dispatching on SPI") != NULL)
+		pthread_mutex_lock(&arrival_mutex);
+		while(arrivals == seen)
 		{
-			//spam
-			return 1;
+			pthread_cond_wait(&arrival_cond, &arrival_mutex);
 		}
+		seen = arrivals;
+		pthread_mutex_unlock(&arrival_mutex);
+	}
+}
+
+void handleDebugString(const char *str, size_t len,
+                       struct ca821x_dev *pDeviceRef, void *context)
+{
+	struct inst_priv *other, *priv = pDeviceRef->context;
+	char line[256];
+
+	//Debug strings aren't terminated
+	if (len >= sizeof(line)) len = sizeof(line) - 1;
+	memcpy(line, str, len);
+	line[len] = '\0';
 
-		fprintf(stderr, "IN %04x: %.*s\n", priv->mAddress, (int)(len - 2), buf + 2);
-		return 1;
+	if (strstr(line, "Erroneous rx from ") != NULL) {
+		int from = strtol(line + 18, NULL, 16);
+
+		pthread_mutex_lock(&out_mutex);
+		priv->mBadRx++;
+		pthread_mutex_unlock(&out_mutex);
+
+		if((other = getInstFromAddr(from)) != NULL)
+		{
+			pthread_mutex_lock(&out_mutex);
+			other->mBadTx++;
+			pthread_mutex_unlock(&out_mutex);
+		}
 	}
-	else if(buf[0] == 0xA1)
+
+	if(strstr(line, "dispatching on SPI") != NULL)
+	{
+		//spam
+		return;
+	}
+
+	fprintf(stderr, "IN %04x: %s\n", priv->mAddress, line);
+}
+
+int handleUserCallback(const uint8_t *buf, size_t len,
+											 struct ca821x_dev *pDeviceRef)
+{
+	struct inst_priv *priv = pDeviceRef->context;
+
+	if(buf[0] == 0xA1)
 	{
 		pthread_mutex_lock(&out_mutex);
 		switch(buf[2])
@@ -388,7 +437,6 @@ static int handleDataConfirm(struct MCPS_DATA_confirm_pset *params, struct ca821
 	case MAC_TRANSACTION_OVERFLOW:
 		pthread_mutex_lock(&out_mutex);
 		priv->mTO++;
-		priv->mBackoff = 1;
 		priv->mErr++;
 		pthread_mutex_unlock(&out_mutex);
 		break;
@@ -522,15 +570,7 @@ static void *inst_worker(void *arg)
 		priv->mMsduHandles[priv->idIndex] = priv->lastHandle;
 		priv->prevExpectedId[priv->idIndex] = addExpected(&(insts[i]), priv, payload);
 		priv->idIndex = (priv->idIndex + 1) % MSDU_HISTORY;
-		if(priv->mBackoff){
-			priv->mBackoff = 0;
-			pthread_mutex_unlock(&out_mutex);
-			usleep(TO_BACKOFF_US);
-		}
-		else
-		{
-			pthread_mutex_unlock(&out_mutex);
-		}
+		pthread_mutex_unlock(&out_mutex);
 
 		//fire
 		PUTLE16(M_PANID, dest.PANId);
@@ -557,36 +597,52 @@ static void *inst_worker(void *arg)
 	return NULL;
 }
 
-void drawTableHeader()
+/*
+ * Live per-device traffic rates, queue depths and latencies are published by
+ * the library, and can be watched with the ca821x-top tool. This digest only
+ * covers the end-to-end checks that are specific to this test application.
+ */
+void drawDigest(unsigned int time)
 {
-	printf("|----|");
-	for(int i = 0; i < numInsts; i++)
-	{
-		printf("|----|----|----|----|---|---|---|---|");
-	}
-	printf("\n");
-	printf("Digest of statistics:\n");
+	printf("Digest of statistics at %ds:\n", time);
 	for(int i = 0; i < numInsts; i++)
 	{
+		uint8_t len = 0;
+		uint8_t leArr[2];
+		if(MLME_GET_request_sync(macShortAddress, 0, &len, leArr, &insts[i].pDeviceRef))
+		{
+			leArr[0] = 0xAD;
+			leArr[1] = 0xDE;
+		}
+
 		pthread_mutex_lock(&out_mutex);
-		printf("Node %d:\n\treceived %d repeated frames"\
+		printf(COLOR_SET(BOLDWHITE,"Node %d") " (ShAddr %04x):"\
+		       "\n\t" COLOR_SET(GREEN,"Tx %d, Sourced %d, Rx %d, AckRemote %d")\
+		       "\n\t" COLOR_SET(RED,"Err %d, eRx %d, eTx %d, Restarts %d")\
+		       "\n\treceived %d repeated frames"\
 		       "\n\tmissed %d packets (of which %d were acked!)"\
 		       "\n\treceived %d unknown payloads"\
 		       "\n\tencountered %d Channel Access Failures"\
 		       "\n\tsent %d packets that weren't acknowledged (but %d made it through anyway)"\
 		       "\n\tTriggered %d Transaction Overflows"\
 		       "\n\tLost %d Confirms, got %d duplicates\n",
-		       i, insts[i].mRepeats, insts[i].mMissed, insts[i].mMissedAcked,
+		       i, GETLE16(leArr),
+		       insts[i].mTx, insts[i].mSourced, insts[i].mRx, insts[i].mAckRemote,
+		       insts[i].mErr, insts[i].mBadRx, insts[i].mBadTx, insts[i].mRestarts,
+		       insts[i].mRepeats, insts[i].mMissed, insts[i].mMissedAcked,
 		       insts[i].mUnexpected, insts[i].mCAF, insts[i].mNack, insts[i].mAckLost,
 		       insts[i].mTO, insts[i].mConfirmLost, insts[i].mConfirmDup);
 		pthread_mutex_unlock(&out_mutex);
 	}
-	printf("|----|");
-	for(int i = 0; i < numInsts; i++)
-	{
-		printf("|----|----|----|----|---|---|---|---|");
-	}
-	printf("\n");
+}
+
+#if !CA821X_SHM_STATS
+/*
+ * Without ca821x-top to watch, the live traffic counts are also drawn as a
+ * table, one row per second.
+ */
+void drawTableHeader()
+{
 	printf("|----|");
 	for(int i = 0; i < numInsts; i++)
 	{
@@ -627,6 +683,7 @@ void drawTableRow(unsigned int time)
 	pthread_mutex_unlock(&out_mutex);
 	printf("\n");
 }
+#endif
 
 void initInst(struct inst_priv *cur)
 {
@@ -636,85 +693,39 @@ void initInst(struct inst_priv *cur)
 	MLME_RESET_request_sync(1, pDeviceRef);
 
 	uint8_t disable = 0; //Disable low LQI rejection @ MAC Layer
-	HWME_SET_request_sync(0x11, 1, &disable, pDeviceRef);
-
-	//Set up MAC pib attributes
 	uint8_t retries = 4;	//Retry transmission 3 times if not acknowledged
-	MLME_SET_request_sync(
-		macMaxFrameRetries,
-		0,
-		sizeof(retries),
-		&retries,
-		pDeviceRef);
-
-	retries = NUMRETRIES;	//max 4 CSMA backoffs
-	MLME_SET_request_sync(
-		macMaxCSMABackoffs,
-		0,
-		sizeof(retries),
-		&retries,
-		pDeviceRef);
-
+	uint8_t backoffs = NUMRETRIES;	//max 4 CSMA backoffs
 	uint8_t maxBE = 3;	//max BackoffExponent 4
-	MLME_SET_request_sync(
-		macMaxBE,
-		0,
-		sizeof(maxBE),
-		&maxBE,
-		pDeviceRef);
-
 	uint8_t minBE = 1;
-	MLME_SET_request_sync(
-		macMinBE,
-		0,
-		sizeof(minBE),
-		&minBE,
-		pDeviceRef);
-
-
 	uint8_t channel = CHANNEL;
-	MLME_SET_request_sync(
-		phyCurrentChannel,
-		0,
-		sizeof(channel),
-		&channel,
-		pDeviceRef);
-
+	uint8_t panid[2] = {LS0_BYTE(M_PANID), LS1_BYTE(M_PANID)};
 	uint8_t LEarray[8] = {0};
-	LEarray[0] = LS0_BYTE(M_PANID);
-	LEarray[1] = LS1_BYTE(M_PANID);
-	MLME_SET_request_sync(
-		macPANId,
-		0,
-		2,
-		LEarray,
-		pDeviceRef);
+	uint8_t rxOnWhenIdle = 1;
 
 	LEarray[0] = LS0_BYTE(cur->mAddress);
 	LEarray[1] = LS1_BYTE(cur->mAddress);
-
-	MLME_SET_request_sync(
-		nsIEEEAddress,
-		0,
-		8,
-		LEarray,
-		pDeviceRef);
-
-	MLME_SET_request_sync(
-		macShortAddress,
-		0,
-		sizeof(cur->mAddress),
-		LEarray,
-		pDeviceRef);
-
-	uint8_t rxOnWhenIdle = 1;
 	if(INDIRECT && (cur == insts)) rxOnWhenIdle = 0;
-	MLME_SET_request_sync( //enable Rx when Idle
-		macRxOnWhenIdle,
-		0,
-		sizeof(rxOnWhenIdle),
-		&rxOnWhenIdle,
-		pDeviceRef);
+
+	//Set up MAC pib attributes in one pipelined batch
+	struct ca821x_pib_setting profile[] = {
+		{ca821x_pib_hwme, 0x11, 0, sizeof(disable), &disable},
+		{ca821x_pib_mlme, macMaxFrameRetries, 0, sizeof(retries), &retries},
+		{ca821x_pib_mlme, macMaxCSMABackoffs, 0, sizeof(backoffs), &backoffs},
+		{ca821x_pib_mlme, macMaxBE, 0, sizeof(maxBE), &maxBE},
+		{ca821x_pib_mlme, macMinBE, 0, sizeof(minBE), &minBE},
+		{ca821x_pib_mlme, phyCurrentChannel, 0, sizeof(channel), &channel},
+		{ca821x_pib_mlme, macPANId, 0, sizeof(panid), panid},
+		{ca821x_pib_mlme, nsIEEEAddress, 0, 8, LEarray},
+		{ca821x_pib_mlme, macShortAddress, 0, sizeof(cur->mAddress), LEarray},
+		{ca821x_pib_mlme, macRxOnWhenIdle, 0, sizeof(rxOnWhenIdle), &rxOnWhenIdle},
+	};
+	int failures = exchange_apply_pib_profile(profile,
+	                                          sizeof(profile) / sizeof(profile[0]),
+	                                          pDeviceRef);
+	if(failures)
+	{
+		printf("Failed to apply %d PIB attributes\r\n", failures);
+	}
 }
 
 int main(int argc, char *argv[])
@@ -730,6 +741,8 @@ int main(int argc, char *argv[])
 		printf("Please increase MAX_INSTANCES in main.c");
 		return -1;
 	}
+	hotplugRunning = !ca821x_util_start_hotplug(&handleArrival, NULL, NULL);
+
 	for(int i = 0; i < numInsts; i++){
 		struct inst_priv *cur = &insts[i];
 		struct ca821x_dev *pDeviceRef = &(cur->pDeviceRef);
@@ -740,10 +753,7 @@ int main(int argc, char *argv[])
 		pthread_mutex_init(&(cur->confirm_mutex), NULL);
 		pthread_cond_init(&(cur->confirm_cond), NULL);
 
-		while(ca821x_util_init(pDeviceRef, &driverErrorCallback))
-		{
-			sleep(1); //Wait while there isn't a device available to connect
-		}
+		initDevice(pDeviceRef);
 		pDeviceRef->context = cur;
 
 		//Register callbacks for async messages
@@ -753,6 +763,16 @@ int main(int argc, char *argv[])
 		callbacks.generic_dispatch = &handleGenericDispatchFrame;
 		ca821x_register_callbacks(&callbacks, pDeviceRef);
 		exchange_register_user_callback(&handleUserCallback, pDeviceRef);
+		//Keep the firmware's debug output off the data path
+		exchange_set_debug_sink(&handleDebugString, NULL, pDeviceRef);
+		//The digest polls attributes that only this application changes
+		exchange_enable_pib_cache(1, pDeviceRef);
+		//Let the exchange restore the configuration after a device reset
+		exchange_enable_pib_replay(1, pDeviceRef);
+		//Hold back data requests rather than overflowing the transaction table
+		exchange_set_max_outstanding_data(MAX_OUTSTANDING, pDeviceRef);
+		//Keep indirect frames beyond the ca821x's own slots on the host
+		exchange_set_indirect_queue(MAX_OUTSTANDING, 0, pDeviceRef);
 
 		initInst(cur);
 		printf("Initialised. %d\r\n", i);
@@ -765,14 +785,22 @@ int main(int argc, char *argv[])
 
 	signal(SIGINT, quit);
 
-	//Draw the table onscreen every second
+#if CA821X_SHM_STATS
+	printf("Live statistics: ca821x-top %d\r\n", (int)getpid());
+#endif
+
+	//Print the digest every 20 seconds, and the table every second if there
+	//is no ca821x-top
 	unsigned int time = 0;
 	while(1)
 	{
+#if !CA821X_SHM_STATS
 		if((time % 20) == 0) drawTableHeader();
 		drawTableRow(time);
+#endif
 		sleep(1);
 		time++;
+		if((time % 20) == 0) drawDigest(time);
 	}
 
 	return 0;
@@ -1,6 +1,8 @@
 #ifndef CA821X_POSIX_H
 #define CA821X_POSIX_H 1
 
+#include <stdio.h>
+
 #include "ca821x_api.h"
 #include "ca821x-posix/ca821x-types.h"
 
@@ -39,9 +41,83 @@
 int ca821x_util_init(struct ca821x_dev *pDeviceRef,
                          ca821x_errorhandler errorHandler);
 
+/**
+ * Initialise several USB-connected ca821x devices at once. This is equivalent
+ * to calling ca821x_util_init for each device, but the dongles are enumerated
+ * only once and are then opened in parallel, which makes bringing up a large
+ * number of them much faster. Devices attached through the kernel driver are
+ * not included.
+ *
+ * Each entry of devs is bound to a dongle that matches the corresponding
+ * entry of selectors, so that a stable mapping can be kept by serial number
+ * or path. Entries that no dongle could be found for are left uninitialised,
+ * with a NULL exchange_context.
+ *
+ * @param[in]   devs         Array of count device references to be
+ *                           initialised. As for ca821x_util_init, they are
+ *                           cleared and initialised internally.
+ * @param[in]   selectors    Array of count selectors, or NULL to bind each
+ *                           device to any available dongle
+ * @param[in]   count        Number of entries in devs
+ * @param[in]   errorHandler Error handling function, as for ca821x_util_init
+ *
+ * @returns Number of devices initialised, or -1 for error
+ *
+ */
+int ca821x_util_init_bulk(struct ca821x_dev *devs,
+                          const struct ca821x_device_selector *selectors,
+                          size_t count,
+                          ca821x_errorhandler errorHandler);
+
+/**
+ * Start watching for ca821x USB dongles being plugged in and removed. Kernel
+ * uevents are used where available, otherwise the hotplug directory (see
+ * ca821x_util_set_hotplug_dir) is watched for device nodes coming and going.
+ * Either way, the bus is rescanned once a burst of events has settled and the
+ * callbacks are called for every dongle that has appeared or disappeared.
+ * Dongles that are already present when hotplug is started are reported as
+ * arrivals straight away.
+ *
+ * The callbacks are called from the hotplug thread, and may call
+ * ca821x_util_init, but must not stop hotplug.
+ *
+ * @param[in]   arrival      Called when a dongle appears, or NULL
+ * @param[in]   departure    Called when a dongle disappears, or NULL
+ * @param[in]   context      Passed to the callbacks
+ *
+ * @returns 0 for success, -1 for error (including if already started)
+ *
+ */
+int ca821x_util_start_hotplug(ca821x_hotplug_callback arrival,
+                              ca821x_hotplug_callback departure,
+                              void *context);
+
+/**
+ * Stop watching for dongles. No callbacks are running or will be called once
+ * this returns.
+ */
+void ca821x_util_stop_hotplug(void);
+
+/**
+ * Watch a directory for device nodes instead of listening to kernel uevents.
+ * Any file whose name starts with "hidraw" being created, removed or having
+ * its attributes changed in the directory triggers a rescan. The default,
+ * used only if uevents are unavailable, is /dev. Takes effect the next time
+ * hotplug is started.
+ *
+ * @param[in]   dir   Directory to watch, or NULL to use uevents again
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int ca821x_util_set_hotplug_dir(const char *dir);
+
 /**
  * Generic function to deinitialise an initialised ca821x device. This will
- * free any resources that were allocated by ca821x_util_init.
+ * free any resources that were allocated by ca821x_util_init. Messages from
+ * the device that are still queued for dispatch are dropped, and any that are
+ * being dispatched are waited for, so this must not be called from a callback
+ * for the same device.
  *
  * Calling on an uninitialised pDeviceRef produces undefined behaviour.
  *
@@ -84,11 +160,58 @@ int ca821x_util_reset(struct ca821x_dev *pDeviceRef);
 int ca821x_util_dispatch_poll(struct ca821x_dev *pDeviceRef);
 #endif
 
+/**
+ * Add a receive filter to a device. Asynchronous messages read from the device
+ * are checked against its filters in the io thread, before they are queued for
+ * dispatch. The first filter that a message matches decides whether it is
+ * dropped or dispatched as usual, and messages that match no filter are
+ * dispatched. Synchronous responses are never filtered.
+ *
+ * A filter can test the command ID against a bitmap, the source of an
+ * MCPS_DATA_indication against a table of PANs and addresses, and the message
+ * against a predicate made of ca821x_filter_insn instructions. The predicate
+ * is checked when the filter is added, and rejected if it could misuse the
+ * stack. The filter is copied, so needn't be kept.
+ *
+ * @param[in]   filter       The filter, added after any existing ones
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns ID of the new filter, or -1 for error
+ *
+ */
+int exchange_add_rx_filter(const struct ca821x_filter *filter,
+                           struct ca821x_dev *pDeviceRef);
+
+/**
+ * Remove a receive filter from a device.
+ *
+ * @param[in]   id           ID returned by exchange_add_rx_filter
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_remove_rx_filter(int id, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Read the number of messages that a receive filter has decided on.
+ *
+ * @param[in]   id           ID returned by exchange_add_rx_filter
+ * @param[out]  hits_out     Number of messages that have matched the filter
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_rx_filter_hits(int id, uint64_t *hits_out,
+                                struct ca821x_dev *pDeviceRef);
+
 /**
  * Registers the callback to call for any non-ca821x commands that are sent over
  * the interface. Commands are still limited to the ca821x format, and must
  * use a command ID that is not currently used by the ca821x-spi protocol.
- * Currently, 0xA8 is used for openthread commands.
+ * Currently, 0xA8 is used for openthread commands. Commands that have
+ * subscribers (see exchange_subscribe_command) are routed to them instead.
  *
  * @param[in]  callback   Function pointer to an user-command-handling callback
  *
@@ -98,4 +221,597 @@ int ca821x_util_dispatch_poll(struct ca821x_dev *pDeviceRef);
 int exchange_register_user_callback(exchange_user_callback callback,
                                     struct ca821x_dev *pDeviceRef);
 
+/**
+ * Subscribe a callback to every asynchronous message with a command ID. A
+ * command can have up to CA821X_ROUTE_MAX_SUBSCRIBERS subscribers, which are
+ * called in the order they subscribed. Messages that have subscribers are
+ * routed straight to them rather than through the ca821x API parser and the
+ * user callback, or the bulk callback if one is registered.
+ *
+ * Subscribers that ask for ca821x_route_io are called from the device's io
+ * thread as soon as the message has been read, so must return quickly. If a
+ * command only has subscribers of that kind, its messages are not queued for
+ * the dispatch thread at all.
+ *
+ * @param[in]   cmd_id       Command ID to subscribe to, such as 0xA0
+ * @param[in]   callback     Function to call with each message
+ * @param[in]   thread       Which thread to call it from
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns ID of the subscription, or -1 for error
+ *
+ */
+int exchange_subscribe_command(uint8_t cmd_id, exchange_user_callback callback,
+                               enum ca821x_route_thread thread,
+                               struct ca821x_dev *pDeviceRef);
+
+/**
+ * Remove a subscription made with exchange_subscribe_command. The callback may
+ * still be running in another thread when this returns.
+ *
+ * @param[in]   id           ID returned by exchange_subscribe_command
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_unsubscribe_command(int id, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Set the sink for a device's firmware debug strings (command ID 0xA0). Once a
+ * device has a sink, its debug strings are taken out of the dispatch path in
+ * the io thread, and passed to the sink from a low-priority thread of their
+ * own. At most CA821X_DEBUG_RATE strings are passed on per second (with bursts
+ * of up to CA821X_DEBUG_BURST), and at most CA821X_DEBUG_QUEUE_CAPACITY wait
+ * for the sink; any more are dropped and counted in debug_dropped.
+ *
+ * @param[in]   sink         Function to pass debug strings to, or NULL to
+ *                           dispatch them as usual again
+ * @param[in]   context      Passed to the sink with each string
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_debug_sink(exchange_debug_sink sink, void *context,
+                            struct ca821x_dev *pDeviceRef);
+
+/**
+ * Set the most detailed level of message that the library logs. By default,
+ * errors and warnings are logged. Messages are formatted where they are
+ * logged, rate limited per call site, and written by a thread of their own,
+ * so logging never blocks on the output.
+ *
+ * @param[in]   level   Most detailed level to log
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_log_level(enum ca821x_log_level level);
+
+/**
+ * Set where the library's log messages are written.
+ *
+ * @param[in]   sink   Function to pass each message to, or NULL for stderr
+ *
+ */
+void exchange_set_log_sink(exchange_log_sink sink);
+
+/**
+ * Read the counters of the library's log.
+ *
+ * @param[out]  stats_out   Structure to fill with the current counters
+ *
+ */
+void exchange_get_log_stats(struct ca821x_log_stats *stats_out);
+
+/**
+ * Read the traffic counters that the exchange keeps for a device.
+ *
+ * @param[out]  counters_out   Structure to fill with the current counters
+ * @param[in]   pDeviceRef     Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_counters(struct ca821x_exchange_counters *counters_out,
+                          struct ca821x_dev *pDeviceRef);
+
+/**
+ * Read the metrics of one priority class of a device's out queue. Messages are
+ * sent highest class first (synchronous commands, then management requests,
+ * then data requests, then anything else), and in order within a class. A
+ * message that has been passed over CA821X_OUT_STARVATION_LIMIT times in
+ * favour of higher classes is sent ahead of them, which is counted as a
+ * promotion.
+ *
+ * @param[in]   out_class    Which class to retrieve
+ * @param[out]  stats_out    Structure to fill with the metrics
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_out_queue_stats(enum ca821x_out_class out_class,
+                                 struct ca821x_out_class_stats *stats_out,
+                                 struct ca821x_dev *pDeviceRef);
+
+/**
+ * Limit the number of messages each class of a device's out queue can hold.
+ * When a class is full, sending an asynchronous command waits up to
+ * timeout_ms for the device to make space, and then fails with -1. This is
+ * counted in the 'rejected' metric of the class. Synchronous commands are
+ * never limited. Data requests that the host is holding back, for the
+ * transaction limit or the host indirect queue, still count against the data
+ * class. By default the out queue is unbounded.
+ *
+ * @param[in]   capacity     Messages per class, or 0 for no limit
+ * @param[in]   timeout_ms   How long a sender may wait for space, or 0 to fail
+ *                           immediately
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_out_queue_limit(size_t capacity, int timeout_ms,
+                                 struct ca821x_dev *pDeviceRef);
+
+/**
+ * Limit the number of synchronous responses a device can hold for collection.
+ * Responses only build up here if nobody waits for them, so once the queue is
+ * full the oldest is dropped. Drops are counted in rx_dropped. By default the
+ * in queue is unbounded.
+ *
+ * @param[in]   capacity     Messages, or 0 for no limit
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_in_queue_limit(size_t capacity, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Limit the number of messages the downstream dispatch queue, which is shared
+ * by all devices, can hold. If messages arrive faster than the callbacks
+ * consume them, the policy decides whether the oldest queued message or the
+ * new one is dropped. Drops are counted in the rx_dropped counter of the
+ * device that read the new message. By default the queue is unbounded.
+ *
+ * @param[in]   capacity   Messages, or 0 for no limit
+ * @param[in]   policy     Which message to drop when the queue is full
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_downstream_queue_limit(size_t capacity,
+                                        enum ca821x_drop_policy policy);
+
+/**
+ * Register a callback to take asynchronous messages in batches, for all
+ * devices. While one is registered, each time the downstream dispatch runs it
+ * takes up to max_batch queued messages at once and passes them all to the
+ * bulk callback, which then replaces the ca821x API callbacks, device group
+ * callbacks and user callbacks. Device groups still see the data confirms
+ * they use to balance their members, and commands that have subscribers (see
+ * exchange_subscribe_command) are still routed to them, ahead of the batch
+ * they were taken in, rather than passed to the bulk callback. Messages that
+ * the application doesn't handle itself can still be passed to
+ * ca821x_downstream_dispatch from the bulk callback.
+ *
+ * @param[in]   callback    Bulk callback, or NULL to return to dispatching
+ *                          one message at a time
+ * @param[in]   max_batch   Most messages in a batch, up to
+ *                          CA821X_BULK_MAX_BATCH
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_register_bulk_callback(exchange_bulk_callback callback,
+                                    size_t max_batch);
+
+/**
+ * Limit the number of MCPS_DATA_requests a device has in progress at once. The
+ * exchange tracks each request by its MSDU handle from the time it is written
+ * until its MCPS_DATA_confirm (or a successful MCPS_PURGE) is read. Requests
+ * beyond the limit are held by the host, in order, and written as confirms
+ * free up room, so that the ca821x's transaction table is kept full without
+ * overflowing. A request whose confirm is lost stops counting after
+ * CA821X_TXN_TIMEOUT_MS. Held requests are treated like the rest of the out
+ * queue if the device fails.
+ *
+ * @param[in]   max_outstanding   Requests in progress at once, or 0 for no limit
+ * @param[in]   pDeviceRef        Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_max_outstanding_data(unsigned int max_outstanding,
+                                      struct ca821x_dev *pDeviceRef);
+
+/**
+ * Read the state of a device's data request admission control.
+ *
+ * @param[out]  stats_out    Structure to fill with the current state
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_txn_stats(struct ca821x_txn_stats *stats_out,
+                           struct ca821x_dev *pDeviceRef);
+
+/**
+ * Let the host hold indirect data requests beyond what the ca821x can store,
+ * so that a coordinator can serve more sleepy children than the ca821x has
+ * transaction slots for. Up to chip_slots indirect frames are passed on to
+ * the ca821x, and the rest are kept by the host, per destination address. As
+ * the ca821x confirms frames (eg. when a child has polled for its data), the
+ * freed slots go to held frames, serving destinations with nothing on the
+ * ca821x first, in turn. A frame that the host holds for longer than the
+ * persistence time is dropped, and the usual MCPS_DATA_confirm is dispatched
+ * for it with a status of MAC_TRANSACTION_EXPIRED.
+ *
+ * @param[in]   chip_slots       Indirect frames to pass on to the ca821x, or 0 to
+ *                               disable the host queue
+ * @param[in]   persistence_ms   How long the host holds a frame, or 0 for
+ *                               CA821X_INDIRECT_PERSISTENCE_MS
+ * @param[in]   pDeviceRef       Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_indirect_queue(unsigned int chip_slots,
+                                unsigned int persistence_ms,
+                                struct ca821x_dev *pDeviceRef);
+
+/**
+ * Read the state of a device's host indirect queue.
+ *
+ * @param[out]  stats_out    Structure to fill with the current state
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_indirect_stats(struct ca821x_indirect_stats *stats_out,
+                                struct ca821x_dev *pDeviceRef);
+
+/**
+ * Pair a device with a hot standby: a second initialised device that is kept
+ * configured like the first, so that it can take over the moment the first
+ * fails. Pairing resets the standby and copies the device's recorded PIB onto
+ * it (see exchange_enable_pib_replay, which is enabled for both devices).
+ * From then on every MLME_SET, HWME_SET, MLME_RESET and PIB profile that the
+ * device confirms is repeated on the standby, except that the standby's
+ * macRxOnWhenIdle is held at 0 so that it stays quiet.
+ *
+ * When the device fails, the standby's receiver is restored to the device's
+ * setting, the messages that the device hadn't sent are passed to the standby,
+ * and commands sent to the device go through the standby until the device has
+ * been recovered, instead of waiting for it. Messages received by the standby
+ * are always dispatched as if they came from the device, so callbacks only
+ * need registering on the device.
+ *
+ * The device should be configured after pairing, or with PIB replay already
+ * enabled, as only recorded state can be copied. Both devices must be unpaired
+ * before either is closed.
+ *
+ * @param[in]   standby      The standby device, or NULL to unpair
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_standby(struct ca821x_dev *standby,
+                         struct ca821x_dev *pDeviceRef);
+
+/**
+ * Read the state of a device's hot standby pairing.
+ *
+ * @param[out]  stats_out    Structure to fill with the current state
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_standby_stats(struct ca821x_standby_stats *stats_out,
+                               struct ca821x_dev *pDeviceRef);
+
+/**
+ * Create a group for balancing traffic across several devices. Data requests
+ * sent through the group's device (see exchange_group_device) go out through
+ * whichever member their destination is mapped to, or otherwise through the
+ * member with the fewest data requests awaiting confirmation. If a member
+ * fails, the data requests it hadn't yet sent are passed on to the others
+ * while it recovers.
+ *
+ * @param[in]   callback   Function called with every message received from
+ *                         any member, before that member's own callbacks.
+ *                         Return 0 if the message was handled, or negative
+ *                         to pass it on. May be NULL.
+ * @param[in]   context    Passed to the callback
+ *
+ * @returns The new group, or NULL for error
+ *
+ */
+struct ca821x_group *exchange_group_create(exchange_group_callback callback,
+                                           void *context);
+
+/**
+ * Remove all members from a group and free it. Must not be called while
+ * anything is being sent through the group's device, or from a group
+ * callback. Like exchange_group_remove, it waits for any dispatch or recovery
+ * that is using the group to finish.
+ *
+ * @param[in]   group   The group to destroy
+ *
+ */
+void exchange_group_destroy(struct ca821x_group *group);
+
+/**
+ * Add an initialised device to a group. A device can only be in one group.
+ *
+ * @param[in]   group        The group
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_group_add(struct ca821x_group *group, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Remove a device from a group. This must be done before the device is
+ * deinitialised. Messages received and recoveries started after this returns
+ * no longer involve the group. Any that are already using it are waited for,
+ * so this must not be called from a group callback.
+ *
+ * @param[in]   group        The group
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 if the device was not a member
+ *
+ */
+int exchange_group_remove(struct ca821x_group *group,
+                          struct ca821x_dev *pDeviceRef);
+
+/**
+ * Send all data requests for a destination through one member of a group,
+ * while that member is not recovering.
+ *
+ * @param[in]   group        The group
+ * @param[in]   dest         Destination address (short or extended)
+ * @param[in]   pDeviceRef   The member to use, or NULL to remove the mapping
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_group_map(struct ca821x_group *group, const struct FullAddr *dest,
+                       struct ca821x_dev *pDeviceRef);
+
+/**
+ * Get the device through which traffic is sent to a group. Only
+ * MCPS_DATA_request and MCPS_PURGE_request can be sent through it, and MSDU
+ * handles must be unique across the whole group.
+ *
+ * @param[in]   group   The group
+ *
+ * @returns The group's device
+ *
+ */
+struct ca821x_dev *exchange_group_device(struct ca821x_group *group);
+
+/**
+ * Create a merge, which puts the asynchronous messages read by several devices
+ * (eg. dongles sniffing different channels) into a single stream ordered by
+ * the host time at which each message was read. Each message is held for up
+ * to the reorder window, in case a message read earlier by another device has
+ * yet to arrive, but is delivered sooner once every device in the merge has
+ * something newer held. The callback is called from the merge's own thread.
+ *
+ * @param[in]   callback    Function called with each message in order.
+ *                          Return 0 if the message was handled, or negative
+ *                          to pass it on to the device's own callbacks. May be
+ *                          NULL.
+ * @param[in]   window_us   Reorder window in microseconds, or 0 for
+ *                          CA821X_MERGE_WINDOW_US
+ * @param[in]   context     Passed to the callback
+ *
+ * @returns The new merge, or NULL for error
+ *
+ */
+struct ca821x_merge *exchange_merge_create(exchange_merge_callback callback,
+                                           unsigned int window_us,
+                                           void *context);
+
+/**
+ * Remove all devices from a merge, deliver whatever it still holds, and free
+ * it.
+ *
+ * @param[in]   merge   The merge to destroy
+ *
+ */
+void exchange_merge_destroy(struct ca821x_merge *merge);
+
+/**
+ * Feed an initialised device's messages into a merge. A device can only feed
+ * one merge.
+ *
+ * @param[in]   merge        The merge
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_merge_add(struct ca821x_merge *merge, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Stop feeding a device's messages into a merge. Messages already held are
+ * still delivered, without waiting out the reorder window. This must be done
+ * before the device is deinitialised.
+ *
+ * @param[in]   merge        The merge
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 if the device was not feeding the merge
+ *
+ */
+int exchange_merge_remove(struct ca821x_merge *merge,
+                          struct ca821x_dev *pDeviceRef);
+
+/**
+ * Read the counters of a merge.
+ *
+ * @param[in]   merge       The merge
+ * @param[out]  stats_out   Structure to fill with the current state
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_merge_stats(struct ca821x_merge *merge,
+                             struct ca821x_merge_stats *stats_out);
+
+/**
+ * Take a snapshot of one of the latency histograms that the exchange keeps for
+ * a device. Recording continues while the snapshot is taken, so the snapshot
+ * may include a few samples more or less than were recorded at the time of
+ * the call, but its count always matches the sum of its buckets.
+ *
+ * @param[in]   type         Which latency to retrieve
+ * @param[out]  hist_out     Histogram to fill with the snapshot
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_latency_histogram(enum ca821x_latency_type type,
+                                   struct ca821x_histogram *hist_out,
+                                   struct ca821x_dev *pDeviceRef);
+
+/**
+ * Clear all of the latency histograms that the exchange keeps for a device.
+ *
+ * @param[in]   pDeviceRef   Device reference
+ *
+ */
+void exchange_reset_latency_histograms(struct ca821x_dev *pDeviceRef);
+
+/**
+ * Extract a percentile from a latency histogram snapshot.
+ *
+ * @param[in]   hist         Histogram snapshot
+ * @param[in]   percentile   Percentile to extract, from 0 to 100 (eg. 99.9)
+ *
+ * @returns The latency in microseconds at or below which the requested
+ *          percentage of samples fall, or 0 if the histogram is empty.
+ *
+ */
+uint32_t ca821x_histogram_percentile(const struct ca821x_histogram *hist,
+                                     double percentile);
+
+/**
+ * Enable or disable the host-side PIB cache for a device. While enabled, the
+ * exchange remembers attribute values from successful MLME_SET and MLME_GET
+ * exchanges, and answers repeated MLME_GET requests without a round trip to
+ * the device. The cache is invalidated by MLME_RESET and by any command that
+ * lets the ca821x change its own PIB (eg. START, SCAN, ASSOCIATE), as well as
+ * on recovery. Attributes that the device updates by itself, such as macDSN,
+ * are never cached.
+ *
+ * @param[in]   enable       Nonzero to enable, zero to disable (and empty)
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_enable_pib_cache(int enable, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Read the hit/miss counters of a device's PIB cache.
+ *
+ * @param[out]  stats_out    Structure to fill with the counters
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_get_pib_cache_stats(struct ca821x_pib_cache_stats *stats_out,
+                                 struct ca821x_dev *pDeviceRef);
+
+/**
+ * Apply a list of MLME/HWME attributes to a device as one pipelined batch.
+ * Rather than waiting for each SET confirm before sending the next request,
+ * up to CA821X_PIB_PIPELINE_DEPTH requests are kept in flight at once, which
+ * cuts the bring-up time of a device to a fraction of the equivalent sequence
+ * of synchronous SETs. Settings are applied in order, and the confirm status
+ * of each one is written to its status field. The batch holds the device's
+ * synchronous lock throughout, and if the device is recovered part way through,
+ * the unconfirmed settings are resent once it has been restored.
+ *
+ * @param[in,out]  settings     Array of settings to apply
+ * @param[in]      count        Number of entries in settings
+ * @param[in]      pDeviceRef   Device reference
+ *
+ * @returns Number of settings that were not confirmed with MAC_SUCCESS, or -1
+ *          for error
+ *
+ */
+int exchange_apply_pib_profile(struct ca821x_pib_setting *settings,
+                               size_t count,
+                               struct ca821x_dev *pDeviceRef);
+
+/**
+ * Enable or disable automatic PIB replay for a device. While enabled, the
+ * exchange keeps a shadow of every MLME_SET and HWME_SET that the device
+ * confirmed successfully, holding only the latest value of each attribute, and
+ * forgets it whenever the PIB is reset to its defaults. When the device is
+ * recovered after an error, the exchange reads back one recorded attribute to
+ * check whether the device lost its PIB. If it did, the exchange resets it and
+ * re-applies the shadow with exchange_apply_pib_profile, so the error callback
+ * no longer has to re-run the application's initialisation, and is no longer
+ * required.
+ *
+ * Replay should be enabled before the device is configured. Only SETs are
+ * replayed, so state that the device builds up itself (eg. with MLME_START)
+ * must still be restored by the application, from the error callback. The
+ * replay happens before the error callback is called, and queued traffic is
+ * only released after the callback returns, so the callback runs against a
+ * configured device and nothing it does is reset again.
+ *
+ * @param[in]   enable       Nonzero to enable, zero to disable (and empty)
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_enable_pib_replay(int enable, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Write the contents of a device's flight recorder to a stream. The flight
+ * recorder always holds the last CA821X_FR_DEPTH messages read from and written
+ * to the device, with their timestamps and first CA821X_FR_BYTES bytes, along
+ * with any errors reported by the exchange.
+ *
+ * @param[in]   stream       Stream to write the human-readable dump to
+ * @param[in]   pDeviceRef   Device reference
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_dump_flight_recorder(FILE *stream, struct ca821x_dev *pDeviceRef);
+
+/**
+ * Set the directory that flight recorders are automatically dumped into when a
+ * device enters recovery. The recorder is copied as recovery starts, and
+ * written once the device has recovered. Files are named
+ * ca821x-flight-<pid>-<device>-<unix time>.txt, and are created readable only
+ * by the owner. An existing file or link of the same name is never
+ * overwritten. Dumps are disabled by default.
+ *
+ * @param[in]   dir   Directory to dump into, or NULL to disable dumps
+ *
+ * @returns 0 for success, -1 for error
+ *
+ */
+int exchange_set_flight_recorder_dir(const char *dir);
+
 #endif //CA821X_POSIX_H
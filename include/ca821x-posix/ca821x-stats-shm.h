@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Layout of the live statistics segment published by ca821x-posix when built
+ * with CA821X_SHM_STATS. The segment is named after the publishing process
+ * (see CA821X_SHM_NAME_FMT) and can be mapped read-only by any number of
+ * monitors, such as ca821x-top, running as the same user.
+ *
+ * Each device slot is protected by a seqlock: the publisher makes 'seq' odd
+ * while it updates the slot and even again once it is done. Readers should use
+ * ca821x_shm_read_device to obtain a consistent copy.
+ */
+
+#ifndef CA821X_STATS_SHM_H
+#define CA821X_STATS_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CA821X_SHM_NAME_FMT "/ca821x-posix.%d"
+#define CA821X_SHM_NAME_PREFIX "ca821x-posix."
+#define CA821X_SHM_MAGIC 0xCA821505
+#define CA821X_SHM_VERSION 1
+
+#define CA821X_SHM_MAX_DEVICES 32
+#define CA821X_SHM_MAX_LATENCIES 8
+
+/** Summary of one latency histogram, all values in microseconds */
+struct ca821x_shm_latency {
+	uint64_t count;
+	uint32_t p50_us;
+	uint32_t p90_us;
+	uint32_t p99_us;
+	uint32_t p999_us;
+	uint32_t max_us;
+	uint32_t reserved;
+};
+
+/** Published statistics for a single device */
+struct ca821x_shm_device {
+	uint32_t seq; //!< Seqlock sequence number, odd during an update
+	uint32_t in_use; //!< Nonzero if the slot describes a device
+	uint32_t exchange_type; //!< enum ca821x_exchange_type of the device
+	uint32_t reserved;
+	uint64_t timestamp_ns; //!< CLOCK_MONOTONIC time of the last update
+	uint64_t tx_msgs;
+	uint64_t tx_bytes;
+	uint64_t rx_msgs;
+	uint64_t rx_bytes;
+	uint64_t errors;
+	uint32_t in_queue_depth;
+	uint32_t out_queue_depth;
+	uint32_t restore_queue_depth;
+	uint32_t num_latencies; //!< Valid entries in latency[]
+	struct ca821x_shm_latency latency[CA821X_SHM_MAX_LATENCIES]; //!< Indexed by enum ca821x_latency_type
+};
+
+/** Header of the statistics segment */
+struct ca821x_shm_stats {
+	uint32_t magic; //!< CA821X_SHM_MAGIC
+	uint32_t version; //!< CA821X_SHM_VERSION
+	int32_t pid; //!< Publishing process
+	uint32_t interval_ms; //!< Publish period
+	uint32_t max_devices; //!< Entries in devices[]
+	uint32_t downstream_queue_depth; //!< Shared downstream dispatch queue
+	struct ca821x_shm_device devices[CA821X_SHM_MAX_DEVICES];
+};
+
+/**
+ * Take a consistent copy of a device slot from a mapped statistics segment.
+ *
+ * @param[in]   slot   Slot in the mapped segment
+ * @param[out]  out    Copy of the slot
+ *
+ * @returns 0 for success, -1 if no consistent copy could be taken
+ *
+ */
+static inline int ca821x_shm_read_device(const struct ca821x_shm_device *slot,
+                                         struct ca821x_shm_device *out)
+{
+	for (int tries = 0; tries < 1000; tries++)
+	{
+		uint32_t seq1, seq2;
+
+		seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq1 & 1) continue;
+
+		memcpy(out, (const void *)slot, sizeof(*out));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if (seq1 == seq2) return 0;
+	}
+	return -1;
+}
+
+#endif //CA821X_STATS_SHM_H
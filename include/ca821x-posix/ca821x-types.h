@@ -15,6 +15,16 @@
 #include "ca821x-posix/ca821x-posix-config.h"
 
 struct ca821x_dev;
+struct pib_cache;
+struct pib_shadow;
+struct txn_state;
+struct indirect_state;
+struct ca821x_group;
+struct standby_state;
+struct ca821x_merge;
+struct filter_set;
+struct route_table;
+struct debug_lane;
 
 /**
  * \brief Error callback
@@ -39,6 +49,92 @@ typedef int (*exchange_user_callback)(
 	const uint8_t *buf, size_t len, struct ca821x_dev *pDeviceRef
 );
 
+/**
+ * \brief Debug sink
+ *
+ * Optional callback for the firmware's debug strings (command ID 0xA0), which
+ * is called from a low-priority thread of its own rather than the dispatch
+ * thread. The string is not null-terminated.
+ */
+typedef void (*exchange_debug_sink)(
+	const char *str, size_t len, struct ca821x_dev *pDeviceRef, void *context
+);
+
+/** One message of a batch passed to a bulk callback */
+struct ca821x_bulk_msg {
+	const uint8_t *buf; //!< The message
+	size_t len; //!< Length of the message
+	struct ca821x_dev *pDeviceRef; //!< The device that received the message
+	uint64_t timestamp_ns; //!< Host time at which it was queued for dispatch
+};
+
+/**
+ * \brief Bulk callback
+ *
+ * Called from the downstream dispatch thread with a batch of asynchronous
+ * messages, in the order they were queued. The messages are only valid until
+ * the callback returns.
+ *
+ * \param msgs the messages
+ * \param count number of messages in the batch
+ */
+typedef void (*exchange_bulk_callback)(
+	const struct ca821x_bulk_msg *msgs, size_t count
+);
+
+/**
+ * \brief Device group callback
+ *
+ * Called from the downstream dispatch thread with every asynchronous message
+ * received by a member of a device group, before the member's own callbacks.
+ *
+ * \param buf the message
+ * \param len length of the message
+ * \param pDeviceRef the member that received the message
+ * \param context the context pointer passed when the group was created
+ *
+ * \returns 0 if the message was handled, or negative to pass it on to the
+ *          member's own callbacks
+ */
+typedef int (*exchange_group_callback)(
+	const uint8_t *buf, size_t len, struct ca821x_dev *pDeviceRef, void *context
+);
+
+/**
+ * \brief Merged stream callback
+ *
+ * Called from the merge thread with every asynchronous message received by the
+ * devices feeding a merge, in order of the host time at which they were read.
+ *
+ * \param buf the message
+ * \param len length of the message
+ * \param timestamp_ns host time at which the message was read, in nanoseconds
+ *                     of CLOCK_MONOTONIC
+ * \param pDeviceRef the device that received the message
+ * \param context the context pointer passed when the merge was created
+ *
+ * \returns 0 if the message was handled, or negative to pass it on to the
+ *          device's own callbacks
+ */
+typedef int (*exchange_merge_callback)(
+	const uint8_t *buf, size_t len, uint64_t timestamp_ns,
+	struct ca821x_dev *pDeviceRef, void *context
+);
+
+/**
+ * \brief Hotplug callback
+ *
+ * Called from the hotplug thread when a ca821x USB dongle is plugged in or
+ * removed.
+ *
+ * \param path hidapi path of the dongle
+ * \param serial USB serial number of the dongle (may be empty)
+ * \param context the context pointer passed when hotplug was started
+ */
+typedef void (*ca821x_hotplug_callback)(
+	const char *path, const char *serial, void *context
+);
+
 /* \brief Exchange write function
  *
  * Function for the exchange to implement. The implementation should
@@ -100,12 +196,355 @@ typedef void (*exchange_flush_unread)(
 	struct ca821x_dev *pDeviceRef
 );
 
+/* \brief Exchange function to wait for the device to become available
+ *
+ * Optional function for the exchange to implement. The implementation should
+ * block until the device can be communicated with again, for example until a
+ * disconnected dongle has been found again.
+ *
+ * This function will be called by the recovery thread before the error
+ * callback.
+ *
+ * \param pDeviceRef a Pointer to the relevant pDeviceRef struct
+ *
+ * \returns 0 once the device is ready, nonzero if it is being closed instead
+ *
+ */
+typedef int (*exchange_wait_ready)(
+	struct ca821x_dev *pDeviceRef
+);
+
 /** Enumeration for identifying the underlying exchange interface type */
 enum ca821x_exchange_type {
 	ca821x_exchange_kernel = 1, //!< kernel driver's debugfs node
 	ca821x_exchange_usb //!< USB HID device
 };
 
+/** Number of linear sub-buckets per power of two in a latency histogram */
+#define CA821X_HIST_SUB_BITS 4
+#define CA821X_HIST_SUB_COUNT (1 << CA821X_HIST_SUB_BITS)
+/** Number of buckets needed to cover 0us to 2^32us */
+#define CA821X_HIST_BUCKETS ((32 - CA821X_HIST_SUB_BITS + 1) * CA821X_HIST_SUB_COUNT)
+
+/** Enumeration of the latencies measured by the exchange for each device */
+enum ca821x_latency_type {
+	ca821x_latency_sync = 0, //!< Sync command round trip in ca8210_exchange_commands
+	ca821x_latency_tx_queue, //!< Time spent in the out queue before write_func
+	ca821x_latency_rx_dispatch, //!< Time from read_func to downstream callback
+	ca821x_latency_callback, //!< Execution time of the downstream callbacks
+	ca821x_latency_recovery_reseat, //!< Time to set the queues aside after an error
+	ca821x_latency_recovery_callback, //!< Time for the device to return, plus the error callback
+	ca821x_latency_recovery_restore, //!< Time to replay the PIB, restore the queues and release waiters
+	ca821x_latency_count
+};
+
+/**
+ * \brief Log-linear latency histogram
+ *
+ * Bucket i covers a range of values whose width is at most 1/16th of the
+ * value, so percentiles extracted with ca821x_histogram_percentile are
+ * accurate to within ~6%. All values are in microseconds.
+ */
+struct ca821x_histogram {
+	uint64_t count; //!< Number of samples recorded
+	uint64_t sum_us; //!< Sum of all samples
+	uint32_t max_us; //!< Largest sample recorded
+	uint32_t buckets[CA821X_HIST_BUCKETS]; //!< Sample count per bucket
+};
+
+/** Number of messages held by each device's flight recorder (power of two) */
+#ifndef CA821X_FR_DEPTH
+#define CA821X_FR_DEPTH 256
+#endif
+/** Number of leading bytes of each message kept by the flight recorder */
+#define CA821X_FR_BYTES 16
+
+/** Direction of a message logged by the flight recorder */
+enum ca821x_fr_direction {
+	ca821x_fr_rx = 0, //!< Read from the device
+	ca821x_fr_tx, //!< Written to the device
+	ca821x_fr_error //!< Error passed to exchange_handle_error
+};
+
+/** Single flight recorder record */
+struct ca821x_fr_entry {
+	uint32_t seq; //!< Per-entry seqlock, 2*(index+1) when valid
+	uint8_t direction; //!< enum ca821x_fr_direction
+	uint8_t reserved[3];
+	int32_t len; //!< Full message length, or error code for errors
+	uint64_t timestamp; //!< CLOCK_MONOTONIC time in ns
+	uint8_t data[CA821X_FR_BYTES]; //!< First bytes of the message
+};
+
+/**
+ * \brief Ring of the most recent messages exchanged with a device
+ *
+ * Written lock-free by the exchange, and read when dumped.
+ */
+struct ca821x_flight_recorder {
+	uint64_t head; //!< Total number of records ever written
+	struct ca821x_fr_entry entries[CA821X_FR_DEPTH];
+};
+
+/** Per-device traffic counters maintained by the exchange */
+struct ca821x_exchange_counters {
+	uint64_t tx_msgs; //!< Messages written to the device
+	uint64_t tx_bytes; //!< Bytes written to the device
+	uint64_t rx_msgs; //!< Messages read from the device
+	uint64_t rx_bytes; //!< Bytes read from the device
+	uint64_t errors; //!< Errors passed to exchange_handle_error
+	uint64_t rx_dropped; //!< Messages read from the device but dropped by a full queue
+	uint64_t rx_filtered; //!< Messages read from the device but dropped by a filter
+	uint64_t rx_routed; //!< Messages consumed by subscribers in the io thread
+	uint64_t debug_logged; //!< Firmware debug strings queued for the debug sink
+	uint64_t debug_dropped; //!< Firmware debug strings over the rate limit or queue capacity
+	uint64_t restore_replayed; //!< Messages set aside by an error and sent after recovery
+	uint64_t restore_dropped; //!< Stale sync responses and requests discarded by recovery
+};
+
+/**
+ * Number of times a queued message can be passed over in favour of higher
+ * priority classes before it is sent ahead of them
+ */
+#ifndef CA821X_OUT_STARVATION_LIMIT
+#define CA821X_OUT_STARVATION_LIMIT 16
+#endif
+
+/** Priority classes of the out queue, highest priority first */
+enum ca821x_out_class {
+	ca821x_out_sync = 0, //!< Synchronous commands, with a caller waiting
+	ca821x_out_mgmt, //!< Asynchronous MLME/HWME/TDME requests
+	ca821x_out_data, //!< MCPS requests
+	ca821x_out_user, //!< Anything else, such as user or bulk commands
+	ca821x_out_class_count
+};
+
+/** Metrics for one priority class of a device's out queue */
+struct ca821x_out_class_stats {
+	uint64_t depth; //!< Messages currently queued
+	uint64_t max_depth; //!< Most messages that have been queued at once
+	uint64_t total; //!< Messages ever queued
+	uint64_t promoted; //!< Messages sent early to keep them from starving
+	uint64_t rejected; //!< Messages refused because the class was full
+};
+
+/** What to discard when a message arrives for a full receive queue */
+enum ca821x_drop_policy {
+	ca821x_drop_oldest = 0, //!< Drop the message that has been queued longest
+	ca821x_drop_newest //!< Drop the message that has just arrived
+};
+
+/** State of a device's data request admission control */
+struct ca821x_txn_stats {
+	uint64_t outstanding; //!< Data requests sent and awaiting their confirm
+	uint64_t held; //!< Data requests currently held back by the host
+	uint64_t max_held; //!< Most data requests that have been held at once
+	uint64_t total_held; //!< Data requests ever held back
+};
+
+/**
+ * Default time that the host holds an indirect frame for its destination
+ * before giving up, in milliseconds (macTransactionPersistenceTime in a
+ * nonbeacon network)
+ */
+#ifndef CA821X_INDIRECT_PERSISTENCE_MS
+#define CA821X_INDIRECT_PERSISTENCE_MS 7680
+#endif
+
+/** State of a device's host indirect queue */
+struct ca821x_indirect_stats {
+	uint64_t on_chip; //!< Indirect frames held by the ca821x
+	uint64_t queued; //!< Indirect frames held by the host
+	uint64_t destinations; //!< Destinations with frames held anywhere
+	uint64_t expired; //!< Frames that expired while held by the host
+};
+
+/** State of a device's hot standby, see exchange_set_standby */
+struct ca821x_standby_stats {
+	uint64_t active; //!< Nonzero while traffic is going to the standby
+	uint64_t mirrored; //!< SETs and resets repeated on the standby
+	uint64_t mirror_failures; //!< Mirrored requests the standby didn't confirm
+	uint64_t failovers; //!< Times the standby has taken over
+	uint64_t redirected; //!< Queued messages passed to the standby on failover
+};
+
+/** Largest batch that can be passed to a bulk callback */
+#ifndef CA821X_BULK_MAX_BATCH
+#define CA821X_BULK_MAX_BATCH 64
+#endif
+
+/**
+ * Default reorder window of a merge: how long a message is held for messages
+ * read earlier by other devices to catch up, in microseconds
+ */
+#ifndef CA821X_MERGE_WINDOW_US
+#define CA821X_MERGE_WINDOW_US 2000
+#endif
+
+/** State of a time-ordered merge, see exchange_merge_create */
+struct ca821x_merge_stats {
+	uint64_t merged; //!< Messages delivered to the merge callback
+	uint64_t late; //!< Of those, how many arrived too late to be in order
+	uint64_t held; //!< Messages currently held in the reorder window
+	uint64_t max_held; //!< Most messages that have been held at once
+};
+
+/** Longest filter predicate, in instructions */
+#ifndef CA821X_FILTER_MAX_INSNS
+#define CA821X_FILTER_MAX_INSNS 32
+#endif
+
+/** Deepest stack that a filter predicate can use */
+#define CA821X_FILTER_STACK_DEPTH 8
+
+/** What to do with a message that matches a receive filter */
+enum ca821x_filter_action {
+	ca821x_filter_pass = 0, //!< Dispatch it as usual
+	ca821x_filter_drop //!< Discard it in the io thread
+};
+
+/**
+ * Instructions of a filter predicate. The predicate runs on a stack of
+ * unsigned values and matches if it leaves a nonzero value on top.
+ */
+enum ca821x_filter_opcode {
+	ca821x_filter_op_byte = 0, //!< Push the byte at offset arg (0 if beyond the end)
+	ca821x_filter_op_half, //!< Push the little-endian 16-bit value at offset arg
+	ca821x_filter_op_len, //!< Push the length of the message
+	ca821x_filter_op_const, //!< Push arg
+	ca821x_filter_op_mask, //!< Replace the top value with top & arg
+	ca821x_filter_op_eq, //!< Pop b and a, push a == b
+	ca821x_filter_op_ne, //!< Pop b and a, push a != b
+	ca821x_filter_op_lt, //!< Pop b and a, push a < b
+	ca821x_filter_op_gt, //!< Pop b and a, push a > b
+	ca821x_filter_op_and, //!< Pop b and a, push a && b
+	ca821x_filter_op_or, //!< Pop b and a, push a || b
+	ca821x_filter_op_not, //!< Replace the top value with !top
+	ca821x_filter_op_count
+};
+
+/** One instruction of a filter predicate */
+struct ca821x_filter_insn {
+	enum ca821x_filter_opcode op;
+	uint16_t arg;
+};
+
+/**
+ * A receive filter, see exchange_add_rx_filter. A message matches if it
+ * passes every test that is given.
+ */
+struct ca821x_filter {
+	enum ca821x_filter_action action;
+	uint8_t any_cmd; //!< Nonzero to match every command ID
+	uint8_t cmd_mask[256 / 8]; //!< Bitmap of matching command IDs, unless any_cmd
+	/**
+	 * If not empty, only MCPS_DATA_indications from one of these sources
+	 * match. An entry with an AddressMode of 0 matches its whole PAN.
+	 */
+	const struct FullAddr *sources;
+	size_t source_count;
+	const struct ca821x_filter_insn *predicate; //!< If not empty, must match
+	size_t predicate_len;
+};
+
+/** Most firmware debug strings passed to a debug sink per second */
+#ifndef CA821X_DEBUG_RATE
+#define CA821X_DEBUG_RATE 50
+#endif
+
+/** Most firmware debug strings passed to a debug sink at once */
+#ifndef CA821X_DEBUG_BURST
+#define CA821X_DEBUG_BURST 20
+#endif
+
+/** Most firmware debug strings waiting for a debug sink */
+#ifndef CA821X_DEBUG_QUEUE_CAPACITY
+#define CA821X_DEBUG_QUEUE_CAPACITY 64
+#endif
+
+/** Severity of a message logged by the library */
+enum ca821x_log_level {
+	ca821x_log_error = 0, //!< Something has failed
+	ca821x_log_warning, //!< Something has gone wrong, but is being handled
+	ca821x_log_info, //!< Normal but significant events
+	ca821x_log_debug //!< Detail for debugging the library
+};
+
+/**
+ * \brief Log sink
+ *
+ * Optional callback to write the library's log messages somewhere other than
+ * stderr. It is called from the log writer thread, never from the thread that
+ * logged the message.
+ */
+typedef void (*exchange_log_sink)(enum ca821x_log_level level, const char *msg);
+
+/** Counters of the library's log */
+struct ca821x_log_stats {
+	uint64_t logged; //!< Messages queued for the log writer
+	uint64_t suppressed; //!< Messages over the rate limit of their call site
+	uint64_t dropped; //!< Messages lost to a full log ring
+};
+
+/** Most messages logged per second from each call site */
+#ifndef CA821X_LOG_RATE
+#define CA821X_LOG_RATE 5
+#endif
+
+/** Most messages logged at once from each call site */
+#ifndef CA821X_LOG_BURST
+#define CA821X_LOG_BURST 20
+#endif
+
+/** Number of messages the log ring holds, a power of two */
+#ifndef CA821X_LOG_RING_SIZE
+#define CA821X_LOG_RING_SIZE 256
+#endif
+
+/** Longest log message, including the terminator */
+#ifndef CA821X_LOG_LINE_LEN
+#define CA821X_LOG_LINE_LEN 128
+#endif
+
+/** Most subscribers that a single command ID can have */
+#ifndef CA821X_ROUTE_MAX_SUBSCRIBERS
+#define CA821X_ROUTE_MAX_SUBSCRIBERS 8
+#endif
+
+/** Thread that a command subscriber is called from */
+enum ca821x_route_thread {
+	ca821x_route_dispatch = 0, //!< The downstream dispatch thread
+	ca821x_route_io //!< The device's io thread, as soon as the message is read
+};
+
+/** Counters for the host-side PIB cache */
+struct ca821x_pib_cache_stats {
+	uint64_t hits; //!< MLME_GET requests answered from the cache
+	uint64_t misses; //!< MLME_GET requests sent to the device
+	uint64_t invalidations; //!< Times the whole cache was dropped
+};
+
+/** Maximum number of SET requests a PIB profile keeps in flight at once */
+#ifndef CA821X_PIB_PIPELINE_DEPTH
+#define CA821X_PIB_PIPELINE_DEPTH 4
+#endif
+
+/** Which SET primitive a PIB profile entry is applied with */
+enum ca821x_pib_type {
+	ca821x_pib_mlme = 0, //!< MLME_SET_request
+	ca821x_pib_hwme //!< HWME_SET_request
+};
+
+/** One attribute of a PIB configuration profile */
+struct ca821x_pib_setting {
+	enum ca821x_pib_type type;
+	uint8_t attribute; //!< PIB or HWME attribute ID
+	uint8_t index; //!< Attribute index (MLME only)
+	uint8_t length; //!< Length of value in bytes
+	const void *value;
+	uint8_t status; //!< Confirm status, filled in when the profile is applied
+};
+
 /** Base structure for exchange private data collections */
 struct ca821x_exchange_base {
 	enum ca821x_exchange_type exchange_type;
@@ -116,6 +555,7 @@ struct ca821x_exchange_base {
 	exchange_signal_read signal_func;
 	exchange_read read_func;
 	exchange_flush_unread flush_func;
+	exchange_wait_ready ready_func;
 
 	//Synchronous queue
 	pthread_t io_thread;
@@ -126,14 +566,69 @@ struct ca821x_exchange_base {
 	//In queue = Device to host(us)
 	//Out queue = Host(us) to device
 	pthread_mutex_t in_queue_mutex, out_queue_mutex;
-	struct buffer_queue *in_buffer_queue, *out_buffer_queue;
+	struct buffer_queue *in_buffer_queue;
+	struct buffer_queue *out_buffer_queue[ca821x_out_class_count];
+	unsigned int out_passed[ca821x_out_class_count]; //!< Times each class was passed over
+	struct ca821x_out_class_stats out_stats[ca821x_out_class_count];
+	size_t out_capacity; //!< Limit of each out queue class, 0 for none
+	uint64_t out_held; //!< Data requests popped but held back by the host
+	int out_timeout_ms; //!< How long a producer may wait for space
+	pthread_cond_t out_space_cond;
+	size_t in_capacity; //!< Limit of the in queue, 0 for none
 
 	//Error handling
 	int error;
 	int restoreflag;
 	pthread_t rescue_thread;
+	pthread_cond_t rescue_cond; //!< Wakes the recovery thread
+	int rescue_runflag;
+	int rescue_pending; //!< An error is waiting for the recovery thread
 	pthread_cond_t restore_cond;
 	struct buffer_queue *restore_in_buffer_queue, *restore_out_buffer_queue;
+
+	//Statistics
+	struct ca821x_exchange_counters counters;
+	struct ca821x_histogram latency[ca821x_latency_count];
+	struct ca821x_flight_recorder flight_recorder;
+
+	//PIB shadowing
+	struct pib_cache *pib_cache;
+	struct pib_shadow *pib_shadow;
+
+	//Admission control of data requests
+	struct txn_state *txn;
+	struct indirect_state *indirect;
+
+	//Device group that the device is a member of, if any
+	struct ca821x_group *group;
+
+	//Hot standby pairing
+	struct standby_state *standby; //!< Set on the primary device
+	struct ca821x_dev *standby_for; //!< Set on the standby device
+
+	//Time-ordered merge that the device's messages are fed into, if any
+	struct ca821x_merge *merge;
+
+	//Receive filters applied in the io thread
+	struct filter_set *filters;
+
+	//Subscribers to received messages by command ID
+	struct route_table *routes;
+
+	//Lane for firmware debug strings, if they have a sink
+	struct debug_lane *debug_lane;
+
+	//Dispatches under way for the device's messages
+	unsigned int dispatching;
+};
+
+/**
+ * Chooses which USB dongle a device reference is bound to during a bulk
+ * initialisation. Any field left NULL matches every dongle.
+ */
+struct ca821x_device_selector {
+	const char *serial; //!< USB serial number of the dongle
+	const char *path; //!< hidapi path of the dongle
 };
 
 /** Single index in a singly-linked list of data buffers */
@@ -142,6 +637,7 @@ struct buffer_queue
 	size_t len; //!< Length of buffer
 	uint8_t * buf; //!< Buffer pointer
 	struct ca821x_dev *pDeviceRef; //!< Data's target/originating device
+	uint64_t timestamp; //!< Monotonic time (ns) at which buffer was queued
 	struct buffer_queue * next; //!< Next queue item
 };
 
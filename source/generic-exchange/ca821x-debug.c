@@ -0,0 +1,174 @@
+/**
+ * @file ca821x-debug.c
+ * @brief Low-priority lane for firmware debug strings
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-debug.h"
+#include "ca821x-generic-exchange.h"
+#include "ca821x-msg.h"
+#include "ca821x-queue.h"
+#include "ca821x-stats.h"
+#include "ca821x_api.h"
+
+static void *debug_lane_worker(void *arg)
+{
+	struct debug_lane *lane = arg;
+	struct ca821x_dev *pDeviceRef;
+	uint8_t buffer[MAX_BUF_SIZE];
+	exchange_debug_sink sink;
+	void *context;
+	size_t len;
+	int running;
+
+	do
+	{
+		wait_on_queue(&lane->queue, &lane->mutex, &lane->cond);
+		len = pop_from_queue(&lane->queue, &lane->mutex, buffer, MAX_BUF_SIZE,
+		                     &pDeviceRef);
+
+		pthread_mutex_lock(&lane->mutex);
+		running = lane->running;
+		sink = lane->sink;
+		context = lane->context;
+		pthread_mutex_unlock(&lane->mutex);
+
+		//Strings aren't terminated, so the sink is given their length
+		if (len > MSG_HEADER_LEN && sink)
+		{
+			sink((const char *)buffer + MSG_HEADER_LEN, len - MSG_HEADER_LEN,
+			     pDeviceRef, context);
+		}
+	} while (running || len);
+
+	return NULL;
+}
+
+int debug_lane_set_sink(struct ca821x_exchange_base *priv,
+                        exchange_debug_sink sink, void *context)
+{
+	struct debug_lane *lane;
+	int error = 0;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	lane = priv->debug_lane;
+	if (!lane && sink)
+	{
+		lane = calloc(1, sizeof(struct debug_lane));
+		if (!lane)
+		{
+			error = -1;
+			goto exit;
+		}
+
+		pthread_mutex_init(&lane->mutex, NULL);
+		pthread_cond_init(&lane->cond, NULL);
+		ratelimit_init(&lane->limit, CA821X_DEBUG_RATE, CA821X_DEBUG_BURST);
+		lane->running = 1;
+		lane->sink = sink;
+		lane->context = context;
+
+		if (pthread_create(&lane->thread, NULL, &debug_lane_worker, lane))
+		{
+			pthread_cond_destroy(&lane->cond);
+			pthread_mutex_destroy(&lane->mutex);
+			free(lane);
+			error = -1;
+			goto exit;
+		}
+		__atomic_store_n(&priv->debug_lane, lane, __ATOMIC_RELEASE);
+	}
+	else if (lane)
+	{
+		pthread_mutex_lock(&lane->mutex);
+		__atomic_store_n(&lane->sink, sink, __ATOMIC_RELAXED);
+		lane->context = context;
+		pthread_mutex_unlock(&lane->mutex);
+	}
+
+exit:
+	pthread_mutex_unlock(&priv->flag_mutex);
+	return error;
+}
+
+void debug_lane_destroy(struct ca821x_exchange_base *priv)
+{
+	struct debug_lane *lane = priv->debug_lane;
+
+	if (!lane) return;
+
+	pthread_mutex_lock(&lane->mutex);
+	lane->running = 0;
+	pthread_mutex_unlock(&lane->mutex);
+
+	//Wake the lane up so that it dies cleanly once it has caught up
+	add_to_waiting_queue(&lane->queue, &lane->mutex, &lane->cond, NULL, 0, NULL);
+	pthread_join(lane->thread, NULL);
+
+	flush_queue(&lane->queue, &lane->mutex);
+	pthread_cond_destroy(&lane->cond);
+	pthread_mutex_destroy(&lane->mutex);
+	free(lane);
+	priv->debug_lane = NULL;
+}
+
+int debug_lane_offer(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                     size_t len, struct ca821x_dev *pDeviceRef)
+{
+	struct debug_lane *lane;
+	int dropped;
+
+	if (buf[MSG_CMD] != MSG_DEBUG_STRING) return 0;
+
+	lane = __atomic_load_n(&priv->debug_lane, __ATOMIC_ACQUIRE);
+	if (!lane || !__atomic_load_n(&lane->sink, __ATOMIC_RELAXED)) return 0;
+
+	//Past the rate limit or the lane's capacity, new strings are dropped and
+	//the ones already queued are kept
+	dropped = !ratelimit_allow(&lane->limit, get_time_ns());
+	if (!dropped)
+	{
+		dropped = add_to_bounded_queue(&lane->queue, &lane->mutex, &lane->cond,
+		                               buf, len, pDeviceRef,
+		                               CA821X_DEBUG_QUEUE_CAPACITY, 1);
+	}
+
+	if (dropped)
+		__atomic_fetch_add(&priv->counters.debug_dropped, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&priv->counters.debug_logged, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_DEBUG_H
+#define CA821X_DEBUG_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+#include "ca821x-ratelimit.h"
+
+//Lane that carries a device's firmware debug strings to its sink, on a thread
+//of its own so that they never hold up the dispatch of real traffic
+struct debug_lane
+{
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct buffer_queue *queue;
+	int running;
+	exchange_debug_sink sink;
+	void *context;
+	struct ratelimit limit;
+};
+
+//Set the sink of a device's debug lane, starting the lane if need be. A NULL
+//sink lets debug strings take the normal dispatch path again.
+int debug_lane_set_sink(struct ca821x_exchange_base *priv,
+                        exchange_debug_sink sink, void *context);
+
+//Stop a device's debug lane, after passing anything queued to the sink
+void debug_lane_destroy(struct ca821x_exchange_base *priv);
+
+//Offer a message read by a device to its debug lane. Returns 1 if the lane
+//took it (even if it was then dropped by the rate limit or a full queue), or
+//0 if it should be dispatched as normal.
+int debug_lane_offer(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                     size_t len, struct ca821x_dev *pDeviceRef);
+
+#endif
@@ -0,0 +1,311 @@
+/**
+ * @file ca821x-filter.c
+ * @brief Receive filters applied in the io thread
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ca821x-filter.h"
+#include "ca821x-msg.h"
+#include "ca821x_api.h"
+
+//Change in stack depth made by each opcode, and the depth it needs first
+static const struct
+{
+	int8_t needs;
+	int8_t change;
+} s_op_stack[ca821x_filter_op_count] = {
+	[ca821x_filter_op_byte] = {0, 1},
+	[ca821x_filter_op_half] = {0, 1},
+	[ca821x_filter_op_len] = {0, 1},
+	[ca821x_filter_op_const] = {0, 1},
+	[ca821x_filter_op_mask] = {1, 0},
+	[ca821x_filter_op_eq] = {2, -1},
+	[ca821x_filter_op_ne] = {2, -1},
+	[ca821x_filter_op_lt] = {2, -1},
+	[ca821x_filter_op_gt] = {2, -1},
+	[ca821x_filter_op_and] = {2, -1},
+	[ca821x_filter_op_or] = {2, -1},
+	[ca821x_filter_op_not] = {1, 0},
+};
+
+static uint32_t load_byte(const uint8_t *buf, size_t len, size_t offset)
+{
+	return offset < len ? buf[offset] : 0;
+}
+
+static int run_predicate(const struct ca821x_filter_insn *predicate,
+                         size_t predicate_len,
+                         const uint8_t *buf,
+                         size_t len)
+{
+	uint32_t stack[CA821X_FILTER_STACK_DEPTH];
+	uint32_t a, b;
+	size_t sp = 0;
+
+	//The predicate was compiled when it was added, so can't misuse the stack
+	for (size_t i = 0; i < predicate_len; i++)
+	{
+		const struct ca821x_filter_insn *insn = &predicate[i];
+
+		switch (insn->op)
+		{
+		case ca821x_filter_op_byte:
+			stack[sp++] = load_byte(buf, len, insn->arg);
+			continue;
+		case ca821x_filter_op_half:
+			stack[sp++] = load_byte(buf, len, insn->arg) |
+			              (load_byte(buf, len, insn->arg + 1) << 8);
+			continue;
+		case ca821x_filter_op_len:
+			stack[sp++] = len;
+			continue;
+		case ca821x_filter_op_const:
+			stack[sp++] = insn->arg;
+			continue;
+		case ca821x_filter_op_mask:
+			stack[sp - 1] &= insn->arg;
+			continue;
+		case ca821x_filter_op_not:
+			stack[sp - 1] = !stack[sp - 1];
+			continue;
+		default:
+			break;
+		}
+
+		b = stack[--sp];
+		a = stack[sp - 1];
+		switch (insn->op)
+		{
+		case ca821x_filter_op_eq: a = (a == b); break;
+		case ca821x_filter_op_ne: a = (a != b); break;
+		case ca821x_filter_op_lt: a = (a < b); break;
+		case ca821x_filter_op_gt: a = (a > b); break;
+		case ca821x_filter_op_and: a = (a && b); break;
+		case ca821x_filter_op_or: a = (a || b); break;
+		default: break;
+		}
+		stack[sp - 1] = a;
+	}
+
+	return stack[0] != 0;
+}
+
+static int source_matches(const struct filter_entry *entry, const uint8_t *buf,
+                          size_t len)
+{
+	const struct FullAddr *src;
+
+	if (buf[MSG_CMD] != SPI_MCPS_DATA_INDICATION || len < DATA_IND_SRCADDR)
+		return 0;
+
+	for (size_t i = 0; i < entry->source_count; i++)
+	{
+		src = &entry->sources[i];
+		if (memcmp(src->PANId, &buf[DATA_IND_SRCPANID], 2)) continue;
+		if (!src->AddressMode) return 1;
+		if (src->AddressMode != buf[DATA_IND_SRCADDRMODE]) continue;
+		if (len < DATA_IND_SRCADDR + MSG_ADDR_LEN(src->AddressMode)) continue;
+		if (!memcmp(src->Address, &buf[DATA_IND_SRCADDR],
+		            MSG_ADDR_LEN(src->AddressMode)))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int entry_matches(const struct filter_entry *entry, const uint8_t *buf,
+                         size_t len)
+{
+	uint8_t cmd = buf[MSG_CMD];
+
+	if (!entry->any_cmd && !(entry->cmd_mask[cmd / 8] & (1 << (cmd % 8))))
+		return 0;
+	if (entry->source_count && !source_matches(entry, buf, len))
+		return 0;
+	if (entry->predicate_len &&
+	    !run_predicate(entry->predicate, entry->predicate_len, buf, len))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+static void free_entry(struct filter_entry *entry)
+{
+	free(entry->sources);
+	free(entry->predicate);
+}
+
+struct filter_set *filter_set_create(void)
+{
+	struct filter_set *set = calloc(1, sizeof(struct filter_set));
+
+	if (set) pthread_rwlock_init(&set->lock, NULL);
+	return set;
+}
+
+void filter_set_destroy(struct filter_set *set)
+{
+	if (!set) return;
+
+	for (size_t i = 0; i < set->count; i++)
+	{
+		free_entry(&set->entries[i]);
+	}
+	pthread_rwlock_destroy(&set->lock);
+	free(set->entries);
+	free(set);
+}
+
+int filter_compile(const struct ca821x_filter_insn *predicate, size_t len)
+{
+	int depth = 0;
+
+	if (len > CA821X_FILTER_MAX_INSNS) return -1;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if ((unsigned int)predicate[i].op >= ca821x_filter_op_count) return -1;
+		if (depth < s_op_stack[predicate[i].op].needs) return -1;
+
+		depth += s_op_stack[predicate[i].op].change;
+		if (depth > CA821X_FILTER_STACK_DEPTH) return -1;
+	}
+
+	return (len && depth != 1) ? -1 : 0;
+}
+
+int filter_set_add(struct filter_set *set, const struct ca821x_filter *filter)
+{
+	struct filter_entry entry, *entries;
+	size_t size;
+	int id = -1;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.action = filter->action;
+	entry.any_cmd = filter->any_cmd;
+	memcpy(entry.cmd_mask, filter->cmd_mask, sizeof(entry.cmd_mask));
+
+	if (filter->source_count)
+	{
+		size = filter->source_count * sizeof(*entry.sources);
+		entry.sources = malloc(size);
+		if (!entry.sources) goto exit;
+		memcpy(entry.sources, filter->sources, size);
+		entry.source_count = filter->source_count;
+	}
+
+	if (filter->predicate_len)
+	{
+		size = filter->predicate_len * sizeof(*entry.predicate);
+		entry.predicate = malloc(size);
+		if (!entry.predicate) goto exit;
+		memcpy(entry.predicate, filter->predicate, size);
+		entry.predicate_len = filter->predicate_len;
+	}
+
+	pthread_rwlock_wrlock(&set->lock);
+	entries = realloc(set->entries, (set->count + 1) * sizeof(*entries));
+	if (entries)
+	{
+		set->entries = entries;
+		entry.id = id = set->next_id++;
+		set->entries[set->count++] = entry;
+	}
+	pthread_rwlock_unlock(&set->lock);
+
+exit:
+	if (id < 0) free_entry(&entry);
+	return id;
+}
+
+int filter_set_remove(struct filter_set *set, int id)
+{
+	int error = -1;
+
+	pthread_rwlock_wrlock(&set->lock);
+	for (size_t i = 0; i < set->count; i++)
+	{
+		if (set->entries[i].id != id) continue;
+
+		free_entry(&set->entries[i]);
+		set->count--;
+		memmove(&set->entries[i], &set->entries[i + 1],
+		        (set->count - i) * sizeof(*set->entries));
+		error = 0;
+		break;
+	}
+	pthread_rwlock_unlock(&set->lock);
+
+	return error;
+}
+
+int filter_set_hits(struct filter_set *set, int id, uint64_t *hits_out)
+{
+	int error = -1;
+
+	pthread_rwlock_rdlock(&set->lock);
+	for (size_t i = 0; i < set->count; i++)
+	{
+		if (set->entries[i].id != id) continue;
+
+		*hits_out = __atomic_load_n(&set->entries[i].hits, __ATOMIC_RELAXED);
+		error = 0;
+		break;
+	}
+	pthread_rwlock_unlock(&set->lock);
+
+	return error;
+}
+
+int filter_set_drops(struct filter_set *set, const uint8_t *buf, size_t len)
+{
+	int drop = 0;
+
+	pthread_rwlock_rdlock(&set->lock);
+	for (size_t i = 0; i < set->count; i++)
+	{
+		if (!entry_matches(&set->entries[i], buf, len)) continue;
+
+		__atomic_fetch_add(&set->entries[i].hits, 1, __ATOMIC_RELAXED);
+		drop = (set->entries[i].action == ca821x_filter_drop);
+		break;
+	}
+	pthread_rwlock_unlock(&set->lock);
+
+	return drop;
+}
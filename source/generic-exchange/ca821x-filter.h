@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_FILTER_H
+#define CA821X_FILTER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+#include "ca821x_api.h"
+
+struct filter_entry
+{
+	int id;
+	enum ca821x_filter_action action;
+	uint8_t any_cmd;
+	uint8_t cmd_mask[256 / 8];
+	struct FullAddr *sources;
+	size_t source_count;
+	struct ca821x_filter_insn *predicate;
+	size_t predicate_len;
+	uint64_t hits;
+};
+
+//Receive filters of a device, in the order they are tried. The io thread only
+//takes the lock for reading, so filters can be changed while it runs.
+struct filter_set
+{
+	pthread_rwlock_t lock;
+	struct filter_entry *entries;
+	size_t count;
+	int next_id;
+};
+
+struct filter_set *filter_set_create(void);
+
+void filter_set_destroy(struct filter_set *set);
+
+//Check that a predicate can run to completion on the filter stack, leaving a
+//single result. Returns 0 if so, otherwise -1.
+int filter_compile(const struct ca821x_filter_insn *predicate, size_t len);
+
+//Add a copy of a filter to the end of a set, returning its ID or -1
+int filter_set_add(struct filter_set *set, const struct ca821x_filter *filter);
+
+int filter_set_remove(struct filter_set *set, int id);
+
+int filter_set_hits(struct filter_set *set, int id, uint64_t *hits_out);
+
+//Decide whether a message read from a device should be dropped: the first
+//filter that matches it decides, and if none do it is kept. Returns 1 to drop.
+int filter_set_drops(struct filter_set *set, const uint8_t *buf, size_t len);
+
+#endif
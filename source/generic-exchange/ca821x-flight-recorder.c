@@ -0,0 +1,252 @@
+/**
+ * @file ca821x-flight-recorder.c
+ * @brief Per-device ring of recent traffic for post-mortem analysis
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-flight-recorder.h"
+#include "ca821x-stats.h"
+
+//Records copied out of a device's flight recorder, to be written later
+struct fr_snapshot
+{
+	uint64_t time;
+	char path[PATH_MAX];
+	struct ca821x_flight_recorder fr;
+};
+
+static char *s_dump_dir = NULL; //!< NULL while dumps are disabled
+static pthread_mutex_t s_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *direction_names[] = {
+	[ca821x_fr_rx] = "RX ",
+	[ca821x_fr_tx] = "TX ",
+	[ca821x_fr_error] = "ERR",
+};
+
+void flight_recorder_log(struct ca821x_flight_recorder *fr,
+                         enum ca821x_fr_direction direction,
+                         const uint8_t *buf,
+                         ssize_t len)
+{
+	uint64_t index = __atomic_fetch_add(&fr->head, 1, __ATOMIC_RELAXED);
+	struct ca821x_fr_entry *entry = &fr->entries[index & (CA821X_FR_DEPTH - 1)];
+	size_t copylen = 0;
+
+	//Odd sequence marks the entry as being written
+	__atomic_store_n(&entry->seq, (uint32_t)(2 * index + 1), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->direction = direction;
+	entry->len = len;
+	entry->timestamp = get_time_ns();
+	if (direction != ca821x_fr_error && len > 0)
+	{
+		copylen = (len > CA821X_FR_BYTES) ? CA821X_FR_BYTES : len;
+		memcpy(entry->data, buf, copylen);
+	}
+
+	__atomic_store_n(&entry->seq, (uint32_t)(2 * index + 2), __ATOMIC_RELEASE);
+}
+
+//Copy an entry, returning 0 if it is a consistent copy of record 'index'
+static int read_entry(const struct ca821x_flight_recorder *fr, uint64_t index,
+                      struct ca821x_fr_entry *out)
+{
+	const struct ca821x_fr_entry *entry = &fr->entries[index & (CA821X_FR_DEPTH - 1)];
+	uint32_t expected = (uint32_t)(2 * index + 2);
+
+	if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != expected) return -1;
+	memcpy(out, entry, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != expected) return -1;
+
+	return 0;
+}
+
+int flight_recorder_last(const struct ca821x_flight_recorder *fr,
+                         enum ca821x_fr_direction direction,
+                         struct ca821x_fr_entry *out)
+{
+	uint64_t head, first;
+
+	head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+	first = (head > CA821X_FR_DEPTH) ? head - CA821X_FR_DEPTH : 0;
+
+	while (head-- > first)
+	{
+		if (read_entry(fr, head, out) == 0 && out->direction == direction)
+			return 0;
+	}
+
+	return -1;
+}
+
+//Write the records of a flight recorder, with their ages at time 'now'
+static int write_records(FILE *stream, const struct ca821x_flight_recorder *fr,
+                         struct ca821x_dev *pDeviceRef, uint64_t now)
+{
+	struct ca821x_fr_entry entry;
+	uint64_t head, first;
+
+	head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+	first = (head > CA821X_FR_DEPTH) ? head - CA821X_FR_DEPTH : 0;
+
+	fprintf(stream, "# ca821x flight recorder, device %p, %llu records logged\n",
+	        (void *)pDeviceRef, (unsigned long long)head);
+	fprintf(stream, "# age(us) dir len data\n");
+
+	for (uint64_t i = first; i < head; i++)
+	{
+		//Entries overwritten while dumping are skipped
+		if (read_entry(fr, i, &entry)) continue;
+
+		fprintf(stream, "%10llu %s ",
+		        (unsigned long long)((now - entry.timestamp) / 1000),
+		        direction_names[entry.direction]);
+
+		if (entry.direction == ca821x_fr_error)
+		{
+			fprintf(stream, "error %d\n", entry.len);
+			continue;
+		}
+
+		fprintf(stream, "%3d", entry.len);
+		for (int b = 0; b < entry.len && b < CA821X_FR_BYTES; b++)
+		{
+			fprintf(stream, " %02x", entry.data[b]);
+		}
+		fprintf(stream, "%s\n", entry.len > CA821X_FR_BYTES ? " ..." : "");
+	}
+
+	return fflush(stream) ? -1 : 0;
+}
+
+int exchange_dump_flight_recorder(FILE *stream, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+
+	if (!priv || !stream) return -1;
+
+	return write_records(stream, &priv->flight_recorder, pDeviceRef,
+	                     get_time_ns());
+}
+
+int exchange_set_flight_recorder_dir(const char *dir)
+{
+	char *copy = NULL;
+
+	if (dir && !(copy = strdup(dir))) return -1;
+
+	pthread_mutex_lock(&s_dump_mutex);
+	free(s_dump_dir);
+	s_dump_dir = copy;
+	pthread_mutex_unlock(&s_dump_mutex);
+
+	return 0;
+}
+
+struct fr_snapshot *flight_recorder_snapshot(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	const struct ca821x_flight_recorder *fr = &priv->flight_recorder;
+	struct ca821x_fr_entry *entry;
+	struct fr_snapshot *snapshot;
+	uint64_t head, first;
+	int len = -1;
+
+	snapshot = malloc(sizeof(struct fr_snapshot));
+	if (!snapshot) return NULL;
+
+	pthread_mutex_lock(&s_dump_mutex);
+	if (s_dump_dir)
+	{
+		len = snprintf(snapshot->path, sizeof(snapshot->path),
+		               "%s/ca821x-flight-%d-%p-%ld.txt", s_dump_dir,
+		               (int)getpid(), (void *)pDeviceRef, (long)time(NULL));
+	}
+	pthread_mutex_unlock(&s_dump_mutex);
+
+	if (len < 0 || len >= (int)sizeof(snapshot->path))
+	{
+		free(snapshot);
+		return NULL;
+	}
+
+	snapshot->time = get_time_ns();
+	head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+	first = (head > CA821X_FR_DEPTH) ? head - CA821X_FR_DEPTH : 0;
+	snapshot->fr.head = head;
+	memset(snapshot->fr.entries, 0, sizeof(snapshot->fr.entries));
+	for (uint64_t i = first; i < head; i++)
+	{
+		//A record torn by the writer is marked as still being written
+		entry = &snapshot->fr.entries[i & (CA821X_FR_DEPTH - 1)];
+		if (read_entry(fr, i, entry)) entry->seq = 1;
+	}
+
+	return snapshot;
+}
+
+void flight_recorder_write(struct fr_snapshot *snapshot,
+                           struct ca821x_dev *pDeviceRef)
+{
+	FILE *file = NULL;
+	int fd;
+
+	if (!snapshot) return;
+
+	//Never follow or reuse a file that is already there, since the directory
+	//may be shared
+	fd = open(snapshot->path, O_CREAT | O_EXCL | O_NOFOLLOW | O_WRONLY | O_CLOEXEC,
+	          0600);
+	if (fd >= 0) file = fdopen(fd, "w");
+	if (file)
+	{
+		write_records(file, &snapshot->fr, pDeviceRef, snapshot->time);
+		fclose(file);
+	}
+	else if (fd >= 0)
+	{
+		close(fd);
+	}
+
+	free(snapshot);
+}
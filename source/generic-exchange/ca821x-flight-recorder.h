@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_FLIGHT_RECORDER_H
+#define CA821X_FLIGHT_RECORDER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+//Log a message (or an error code if direction is ca821x_fr_error). Lock free.
+void flight_recorder_log(struct ca821x_flight_recorder *fr,
+                         enum ca821x_fr_direction direction,
+                         const uint8_t *buf,
+                         ssize_t len);
+
+//Copy the most recent record in a direction, returning 0 if there was one
+int flight_recorder_last(const struct ca821x_flight_recorder *fr,
+                         enum ca821x_fr_direction direction,
+                         struct ca821x_fr_entry *out);
+
+struct fr_snapshot;
+
+//Copy the device's flight recorder, if dumps are enabled, so that it can be
+//written once the device has recovered. Returns NULL if there is nothing to
+//write.
+struct fr_snapshot *flight_recorder_snapshot(struct ca821x_dev *pDeviceRef);
+
+//Write a snapshot to a new file in the dump directory, and free it
+void flight_recorder_write(struct fr_snapshot *snapshot,
+                           struct ca821x_dev *pDeviceRef);
+
+#endif
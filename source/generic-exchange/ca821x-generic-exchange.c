@@ -31,14 +31,37 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
 
+#include "ca821x-posix/ca821x-posix.h"
 #include "ca821x-generic-exchange.h"
+#include "ca821x-debug.h"
+#include "ca821x-filter.h"
+#include "ca821x-flight-recorder.h"
+#include "ca821x-group.h"
+#include "ca821x-indirect.h"
+#include "ca821x-log.h"
+#include "ca821x-merge.h"
+#include "ca821x-msg.h"
+#include "ca821x-out-queue.h"
+#include "ca821x-pib.h"
 #include "ca821x-queue.h"
+#include "ca821x-route.h"
+#include "ca821x-standby.h"
+#include "ca821x-stats.h"
+#include "ca821x-trace.h"
+#include "ca821x-txn.h"
 #include "ca821x_api.h"
 
+#if CA821X_SHM_STATS
+#include "ca821x-shm-stats.h"
+#endif
+
 static int s_worker_run_flag = 0;
 static int s_generic_initialised = 0;
 
@@ -48,34 +71,194 @@ static struct buffer_queue *downstream_dispatch_queue = NULL;
 static pthread_mutex_t downstream_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t dd_thread;
 static pthread_cond_t dd_cond = PTHREAD_COND_INITIALIZER;
+static size_t s_downstream_capacity = 0;
+static enum ca821x_drop_policy s_downstream_policy = ca821x_drop_oldest;
+static exchange_bulk_callback s_bulk_callback = NULL;
+static size_t s_bulk_max_batch = 1;
+static pthread_mutex_t s_dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_dispatch_cond = PTHREAD_COND_INITIALIZER;
 
 void (*wake_hw_worker)(void);
 
 static int init_generic_statics(void);
+static void *ca821x_recovery_worker(void *arg);
+static void stop_recovery_worker(struct ca821x_exchange_base *priv);
 static int deinit_generic_statics(void);
 
+//Keep a message's device, and the primary it is delivered as if it is a
+//standby, from being deinitialised until dispatch_release. Returns the device
+//to deliver the message as. Called with s_dispatch_mutex held.
+static struct ca821x_dev *dispatch_hold(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_dev *primary;
+
+	priv->dispatching++;
+	primary = __atomic_load_n(&priv->standby_for, __ATOMIC_ACQUIRE);
+	if (!primary) return pDeviceRef;
+
+	priv = primary->exchange_context;
+	priv->dispatching++;
+	return primary;
+}
+
+static void dispatch_put(struct ca821x_exchange_base *priv)
+{
+	if (--priv->dispatching == 0) pthread_cond_broadcast(&s_dispatch_cond);
+}
+
+static void dispatch_release(struct ca821x_dev *pDeviceRef,
+                             struct ca821x_dev *delivered_as)
+{
+	pthread_mutex_lock(&s_dispatch_mutex);
+	dispatch_put(pDeviceRef->exchange_context);
+	if (delivered_as != pDeviceRef) dispatch_put(delivered_as->exchange_context);
+	pthread_mutex_unlock(&s_dispatch_mutex);
+}
+
+//Dispatch a batch of messages to the bulk callback, returning their total
+//length
+static int run_bulk_dispatch(exchange_bulk_callback callback)
+{
+	struct ca821x_bulk_msg msgs[CA821X_BULK_MAX_BATCH];
+	struct ca821x_exchange_base *privs[CA821X_BULK_MAX_BATCH];
+	struct ca821x_dev *delivered_as[CA821X_BULK_MAX_BATCH];
+	struct buffer_queue *batch, *item;
+	struct ca821x_exchange_base *priv;
+	struct route_table *routes;
+	uint64_t start_time = get_time_ns();
+	size_t count = 0, devices = 0, i, n;
+	int len = 0;
+
+	pthread_mutex_lock(&s_dispatch_mutex);
+	pop_batch_from_queue(&downstream_dispatch_queue, &downstream_queue_mutex,
+	                     &batch,
+	                     __atomic_load_n(&s_bulk_max_batch, __ATOMIC_RELAXED));
+	for (item = batch, n = 0; item != NULL; item = item->next, n++)
+	{
+		if (item->len) delivered_as[n] = dispatch_hold(item->pDeviceRef);
+	}
+	pthread_mutex_unlock(&s_dispatch_mutex);
+
+	for (item = batch, n = 0; item != NULL; item = item->next, n++)
+	{
+		if (!item->len) continue;
+
+		msgs[count].buf = item->buf;
+		msgs[count].len = item->len;
+		msgs[count].pDeviceRef = delivered_as[n];
+		msgs[count].timestamp_ns = item->timestamp;
+		priv = delivered_as[n]->exchange_context;
+
+		histogram_record(&priv->latency[ca821x_latency_rx_dispatch],
+		                 (start_time - item->timestamp) / 1000);
+
+		//The group still has to see confirms to keep its members' counts
+		group_observe(item->buf, item->len, msgs[count].pDeviceRef);
+		len += item->len;
+
+		//Subscribers still take their commands out of the batch
+		routes = __atomic_load_n(&priv->routes, __ATOMIC_ACQUIRE);
+		if (routes && route_dispatch(routes, item->buf, item->len,
+		                             msgs[count].pDeviceRef) > 0)
+		{
+			continue;
+		}
+
+		for (i = 0; i < devices && privs[i] != priv; i++)
+			;
+		if (i == devices) privs[devices++] = priv;
+
+		count++;
+	}
+
+	if (count)
+	{
+		start_time = get_time_ns();
+		for (i = 0; i < count; i++)
+		{
+			CA821X_TRACE3(dispatch_start, msgs[i].pDeviceRef, msgs[i].buf[0],
+			              msgs[i].len);
+		}
+		callback(msgs, count);
+		for (i = 0; i < count; i++)
+		{
+			CA821X_TRACE3(dispatch_end, msgs[i].pDeviceRef, msgs[i].buf[0],
+			              msgs[i].len);
+		}
+
+		//Each device in the batch waited for the whole callback
+		for (i = 0; i < devices; i++)
+		{
+			histogram_record_since(&privs[i]->latency[ca821x_latency_callback],
+			                       start_time);
+		}
+	}
+
+	for (item = batch, n = 0; item != NULL; item = item->next, n++)
+	{
+		if (item->len) dispatch_release(item->pDeviceRef, delivered_as[n]);
+	}
+	free_batch(batch);
+
+	return len;
+}
+
 int ca821x_run_downstream_dispatch()
 {
+	struct ca821x_dev *queued_by;
 	struct ca821x_dev *pDeviceRef;
 	struct ca821x_exchange_base *priv;
+	struct route_table *routes;
 	uint8_t buffer[MAX_BUF_SIZE];
+	exchange_bulk_callback bulk;
+	uint64_t rx_time, start_time;
 	int rval;
 	int len;
 
-	len = pop_from_queue(&downstream_dispatch_queue,
-	                     &downstream_queue_mutex,
-	                     buffer,
-	                     MAX_BUF_SIZE, &pDeviceRef);
+	bulk = __atomic_load_n(&s_bulk_callback, __ATOMIC_ACQUIRE);
+	if (bulk) return run_bulk_dispatch(bulk);
+
+	//A standby's messages are delivered as coming from its primary
+	pthread_mutex_lock(&s_dispatch_mutex);
+	len = pop_from_queue_timed(&downstream_dispatch_queue,
+	                           &downstream_queue_mutex,
+	                           buffer,
+	                           MAX_BUF_SIZE, &queued_by, &rx_time);
+	if (len > 0) pDeviceRef = dispatch_hold(queued_by);
+	pthread_mutex_unlock(&s_dispatch_mutex);
 
 	if (len > 0)
 	{
 		priv = pDeviceRef->exchange_context;
-		rval = ca821x_downstream_dispatch(buffer, len, pDeviceRef);
+		start_time = get_time_ns();
+		histogram_record(&priv->latency[ca821x_latency_rx_dispatch],
+		                 (start_time - rx_time) / 1000);
+		CA821X_TRACE3(dispatch_start, pDeviceRef, buffer[0], len);
+
+		rval = group_dispatch(buffer, len, pDeviceRef);
+
+		//Subscribers to a command ID take it instead of the API parser
+		routes = __atomic_load_n(&priv->routes, __ATOMIC_ACQUIRE);
+		if (rval < 0 && routes &&
+		    route_dispatch(routes, buffer, len, pDeviceRef) > 0)
+		{
+			rval = 0;
+		}
+
+		if (rval < 0)
+			rval = ca821x_downstream_dispatch(buffer, len, pDeviceRef);
 
 		if (rval < 0 && priv->user_callback)
 		{
 			priv->user_callback(buffer, len, pDeviceRef);
 		}
+
+		CA821X_TRACE3(dispatch_end, pDeviceRef, buffer[0], len);
+
+		histogram_record_since(&priv->latency[ca821x_latency_callback],
+		                       start_time);
+		dispatch_release(queued_by, pDeviceRef);
 	}
 
 	return len;
@@ -104,6 +287,7 @@ int init_generic(struct ca821x_dev *pDeviceRef)
 {
 	int error = 0;
 	struct ca821x_exchange_base *base = pDeviceRef->exchange_context;
+	pthread_condattr_t condattr;
 
 	error = init_generic_statics();
 	if(error) goto exit;
@@ -116,16 +300,37 @@ int init_generic(struct ca821x_dev *pDeviceRef)
 	pthread_mutex_init(&(base->out_queue_mutex), NULL);
 	pthread_cond_init(&(base->sync_cond), NULL);
 	pthread_cond_init(&(base->restore_cond), NULL);
-
+	pthread_cond_init(&(base->rescue_cond), NULL);
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(base->out_space_cond), &condattr);
+	pthread_condattr_destroy(&condattr);
 
 	pthread_mutex_lock(&base->flag_mutex);
 	base->io_thread_runflag = 1;
+	base->rescue_runflag = 1;
 	pthread_mutex_unlock(&base->flag_mutex);
 
+	error = pthread_create(&(base->rescue_thread),
+	                       NULL,
+	                       &ca821x_recovery_worker,
+	                       pDeviceRef);
+	if(error) goto exit;
+
 	error = pthread_create(&(base->io_thread),
 	                       PTHREAD_CREATE_JOINABLE,
 	                       &ca8210_io_worker,
 	                       pDeviceRef);
+	if(error)
+	{
+		stop_recovery_worker(base);
+		goto exit;
+	}
+
+#if CA821X_SHM_STATS
+	//Statistics are best-effort, so failing to publish isn't an init error
+	if (!error) shm_stats_add_device(pDeviceRef);
+#endif
 
 exit:
 	return error;
@@ -136,23 +341,59 @@ int deinit_generic(struct ca821x_dev *pDeviceRef)
 	int error = 0;
 	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
 
+#if CA821X_SHM_STATS
+	shm_stats_remove_device(pDeviceRef);
+#endif
+
+	//A recovery under way needs the io thread to finish, so stop it first
+	stop_recovery_worker(priv);
+
 	pthread_mutex_lock(&priv->flag_mutex);
 	priv->io_thread_runflag = 0;
 	pthread_mutex_unlock(&priv->flag_mutex);
 
 	pthread_join(priv->io_thread, NULL);
 
+	//The dispatch thread is shared, so take the device out of its reach and
+	//wait for anything it is already dispatching before tearing down
+	remove_device_from_queue(&downstream_dispatch_queue,
+	                         &downstream_queue_mutex, pDeviceRef);
+	standby_destroy(priv);
+	pthread_mutex_lock(&s_dispatch_mutex);
+	while (priv->dispatching)
+	{
+		pthread_cond_wait(&s_dispatch_cond, &s_dispatch_mutex);
+	}
+	pthread_mutex_unlock(&s_dispatch_mutex);
+
 	flush_queue(&priv->in_buffer_queue, &priv->in_queue_mutex);
-	flush_queue(&priv->out_buffer_queue, &priv->out_queue_mutex);
+	out_queue_flush(priv);
+	flush_queue(&priv->restore_in_buffer_queue, &priv->in_queue_mutex);
+	flush_queue(&priv->restore_out_buffer_queue, &priv->out_queue_mutex);
+	txn_destroy(priv);
+	indirect_destroy(priv);
+	filter_set_destroy(priv->filters);
+	priv->filters = NULL;
+	route_table_destroy(priv->routes);
+	priv->routes = NULL;
+	debug_lane_destroy(priv);
 
 	pthread_mutex_destroy(&(priv->flag_mutex));
 	pthread_mutex_destroy(&(priv->sync_mutex));
 	pthread_mutex_destroy(&(priv->in_queue_mutex));
 	pthread_mutex_destroy(&(priv->out_queue_mutex));
 	pthread_cond_destroy(&(priv->sync_cond));
+	pthread_cond_destroy(&(priv->restore_cond));
+	pthread_cond_destroy(&(priv->rescue_cond));
+	pthread_cond_destroy(&(priv->out_space_cond));
 
 	priv->error_callback = NULL;
 
+	pib_cache_destroy(priv->pib_cache);
+	priv->pib_cache = NULL;
+	pib_shadow_destroy(priv->pib_shadow);
+	priv->pib_shadow = NULL;
+
 	deinit_generic_statics();
 
 	return error;
@@ -164,31 +405,35 @@ static int init_generic_statics()
 
 	if (s_generic_initialised++) goto exit;
 
+#if CA821X_SHM_STATS
+	shm_stats_init();
+#endif
+
 #if CA821X_ASYNC_CALLBACK
 	s_worker_run_flag = 1;
 	rval = pthread_create(&dd_thread, PTHREAD_CREATE_JOINABLE,
 	                      &ca821x_downstream_dispatch_worker, NULL);
 #endif
 
+	//Unwind only what was set up here, since there is no thread to join
 	if (rval != 0)
 	{
 		error = -1;
-		goto exit;
+		s_worker_run_flag = 0;
+#if CA821X_SHM_STATS
+		shm_stats_deinit();
+#endif
+		s_generic_initialised--;
 	}
 
 exit:
-	if(error)
-	{
-		deinit_generic_statics();
-	}
 	return error;
 }
 
 static int deinit_generic_statics()
 {
-	if (!(--s_generic_initialised)) goto exit;
+	if (--s_generic_initialised) goto exit;
 
-	s_generic_initialised = 0;
 	pthread_mutex_lock(&s_flag_mutex);
 	s_worker_run_flag = 0;
 	pthread_mutex_unlock(&s_flag_mutex);
@@ -202,10 +447,348 @@ static int deinit_generic_statics()
 
 	flush_queue(&downstream_dispatch_queue, &downstream_queue_mutex);
 
+#if CA821X_SHM_STATS
+	shm_stats_deinit();
+#endif
+
 exit:
 	return 0;
 }
 
+size_t exchange_downstream_queue_depth(void)
+{
+	return queue_depth(&downstream_dispatch_queue, &downstream_queue_mutex);
+}
+
+int exchange_get_counters(struct ca821x_exchange_counters *counters_out,
+                          struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_exchange_counters *counters;
+
+	if (!priv) return -1;
+
+	counters = &priv->counters;
+	counters_out->tx_msgs = __atomic_load_n(&counters->tx_msgs, __ATOMIC_RELAXED);
+	counters_out->tx_bytes = __atomic_load_n(&counters->tx_bytes, __ATOMIC_RELAXED);
+	counters_out->rx_msgs = __atomic_load_n(&counters->rx_msgs, __ATOMIC_RELAXED);
+	counters_out->rx_bytes = __atomic_load_n(&counters->rx_bytes, __ATOMIC_RELAXED);
+	counters_out->errors = __atomic_load_n(&counters->errors, __ATOMIC_RELAXED);
+	counters_out->rx_dropped = __atomic_load_n(&counters->rx_dropped,
+	                                           __ATOMIC_RELAXED);
+	counters_out->rx_filtered = __atomic_load_n(&counters->rx_filtered,
+	                                            __ATOMIC_RELAXED);
+	counters_out->rx_routed = __atomic_load_n(&counters->rx_routed,
+	                                          __ATOMIC_RELAXED);
+	counters_out->debug_logged = __atomic_load_n(&counters->debug_logged,
+	                                             __ATOMIC_RELAXED);
+	counters_out->debug_dropped = __atomic_load_n(&counters->debug_dropped,
+	                                              __ATOMIC_RELAXED);
+	counters_out->restore_replayed = __atomic_load_n(&counters->restore_replayed,
+	                                                 __ATOMIC_RELAXED);
+	counters_out->restore_dropped = __atomic_load_n(&counters->restore_dropped,
+	                                                __ATOMIC_RELAXED);
+	return 0;
+}
+
+int exchange_get_out_queue_stats(enum ca821x_out_class out_class,
+                                 struct ca821x_out_class_stats *stats_out,
+                                 struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_out_class_stats *stats;
+
+	if (!priv || out_class >= ca821x_out_class_count) return -1;
+
+	stats = &priv->out_stats[out_class];
+	stats_out->depth = __atomic_load_n(&stats->depth, __ATOMIC_RELAXED);
+	stats_out->max_depth = __atomic_load_n(&stats->max_depth, __ATOMIC_RELAXED);
+	stats_out->total = __atomic_load_n(&stats->total, __ATOMIC_RELAXED);
+	stats_out->promoted = __atomic_load_n(&stats->promoted, __ATOMIC_RELAXED);
+	stats_out->rejected = __atomic_load_n(&stats->rejected, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int exchange_set_out_queue_limit(size_t capacity, int timeout_ms,
+                                 struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+
+	if (!priv || timeout_ms < 0) return -1;
+
+	__atomic_store_n(&priv->out_timeout_ms, timeout_ms, __ATOMIC_RELAXED);
+	__atomic_store_n(&priv->out_capacity, capacity, __ATOMIC_RELAXED);
+
+	//Producers waiting for space may now have some
+	pthread_mutex_lock(&priv->out_queue_mutex);
+	pthread_cond_broadcast(&priv->out_space_cond);
+	pthread_mutex_unlock(&priv->out_queue_mutex);
+	return 0;
+}
+
+int exchange_set_in_queue_limit(size_t capacity, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+
+	if (!priv) return -1;
+
+	__atomic_store_n(&priv->in_capacity, capacity, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int exchange_set_downstream_queue_limit(size_t capacity,
+                                        enum ca821x_drop_policy policy)
+{
+	if (policy != ca821x_drop_oldest && policy != ca821x_drop_newest)
+		return -1;
+
+	__atomic_store_n(&s_downstream_policy, policy, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_downstream_capacity, capacity, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int exchange_register_bulk_callback(exchange_bulk_callback callback,
+                                    size_t max_batch)
+{
+	if (callback && (max_batch == 0 || max_batch > CA821X_BULK_MAX_BATCH))
+		return -1;
+
+	if (callback)
+		__atomic_store_n(&s_bulk_max_batch, max_batch, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_bulk_callback, callback, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int exchange_set_max_outstanding_data(unsigned int max_outstanding,
+                                      struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct txn_state *txn;
+
+	if (!priv) return -1;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	if (!priv->txn && max_outstanding)
+		__atomic_store_n(&priv->txn, txn_create(), __ATOMIC_RELEASE);
+	txn = priv->txn;
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	if (!txn) return max_outstanding ? -1 : 0;
+
+	//Any held requests are released by the io thread once there is room
+	__atomic_store_n(&txn->max_outstanding, max_outstanding, __ATOMIC_RELAXED);
+	if (priv->signal_func) priv->signal_func(pDeviceRef);
+	return 0;
+}
+
+int exchange_get_txn_stats(struct ca821x_txn_stats *stats_out,
+                           struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct txn_state *txn;
+
+	if (!priv) return -1;
+
+	memset(stats_out, 0, sizeof(*stats_out));
+	txn = __atomic_load_n(&priv->txn, __ATOMIC_ACQUIRE);
+	if (!txn) return 0;
+
+	stats_out->outstanding = __atomic_load_n(&txn->stats.outstanding,
+	                                         __ATOMIC_RELAXED);
+	stats_out->held = __atomic_load_n(&txn->stats.held, __ATOMIC_RELAXED);
+	stats_out->max_held = __atomic_load_n(&txn->stats.max_held, __ATOMIC_RELAXED);
+	stats_out->total_held = __atomic_load_n(&txn->stats.total_held,
+	                                        __ATOMIC_RELAXED);
+	return 0;
+}
+
+int exchange_set_indirect_queue(unsigned int chip_slots,
+                                unsigned int persistence_ms,
+                                struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct indirect_state *state;
+
+	if (!priv) return -1;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	if (!priv->indirect && chip_slots)
+		__atomic_store_n(&priv->indirect, indirect_create(), __ATOMIC_RELEASE);
+	state = priv->indirect;
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	if (!state) return chip_slots ? -1 : 0;
+
+	if (!persistence_ms) persistence_ms = CA821X_INDIRECT_PERSISTENCE_MS;
+	__atomic_store_n(&state->persistence_ms, persistence_ms, __ATOMIC_RELAXED);
+	//Any frames held beyond the new limit are released by the io thread
+	__atomic_store_n(&state->chip_slots, chip_slots, __ATOMIC_RELAXED);
+	if (priv->signal_func) priv->signal_func(pDeviceRef);
+	return 0;
+}
+
+int exchange_get_indirect_stats(struct ca821x_indirect_stats *stats_out,
+                                struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct indirect_state *state;
+
+	if (!priv) return -1;
+
+	memset(stats_out, 0, sizeof(*stats_out));
+	state = __atomic_load_n(&priv->indirect, __ATOMIC_ACQUIRE);
+	if (!state) return 0;
+
+	stats_out->on_chip = __atomic_load_n(&state->stats.on_chip, __ATOMIC_RELAXED);
+	stats_out->queued = __atomic_load_n(&state->stats.queued, __ATOMIC_RELAXED);
+	stats_out->destinations = __atomic_load_n(&state->stats.destinations,
+	                                          __ATOMIC_RELAXED);
+	stats_out->expired = __atomic_load_n(&state->stats.expired, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int exchange_set_standby(struct ca821x_dev *standby,
+                         struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct standby_state *state;
+
+	if (!priv) return -1;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	if (!priv->standby && standby)
+		__atomic_store_n(&priv->standby, standby_create(), __ATOMIC_RELEASE);
+	state = priv->standby;
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	if (!state) return standby ? -1 : 0;
+
+	return standby_pair(pDeviceRef, standby);
+}
+
+int exchange_get_standby_stats(struct ca821x_standby_stats *stats_out,
+                               struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct standby_state *state;
+
+	if (!priv) return -1;
+
+	memset(stats_out, 0, sizeof(*stats_out));
+	state = __atomic_load_n(&priv->standby, __ATOMIC_ACQUIRE);
+	if (!state) return 0;
+
+	stats_out->active = __atomic_load_n(&state->active, __ATOMIC_RELAXED);
+	stats_out->mirrored = __atomic_load_n(&state->stats.mirrored,
+	                                      __ATOMIC_RELAXED);
+	stats_out->mirror_failures = __atomic_load_n(&state->stats.mirror_failures,
+	                                             __ATOMIC_RELAXED);
+	stats_out->failovers = __atomic_load_n(&state->stats.failovers,
+	                                       __ATOMIC_RELAXED);
+	stats_out->redirected = __atomic_load_n(&state->stats.redirected,
+	                                        __ATOMIC_RELAXED);
+	return 0;
+}
+
+int exchange_add_rx_filter(const struct ca821x_filter *filter,
+                           struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct filter_set *set;
+
+	if (!priv || !filter) return -1;
+	if (filter->action != ca821x_filter_pass &&
+	    filter->action != ca821x_filter_drop)
+	{
+		return -1;
+	}
+	if (filter->source_count && !filter->sources) return -1;
+	if (filter->predicate_len && !filter->predicate) return -1;
+	if (filter_compile(filter->predicate, filter->predicate_len)) return -1;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	if (!priv->filters)
+		__atomic_store_n(&priv->filters, filter_set_create(), __ATOMIC_RELEASE);
+	set = priv->filters;
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	if (!set) return -1;
+
+	return filter_set_add(set, filter);
+}
+
+int exchange_remove_rx_filter(int id, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct filter_set *set;
+
+	if (!priv) return -1;
+
+	set = __atomic_load_n(&priv->filters, __ATOMIC_ACQUIRE);
+	if (!set) return -1;
+
+	return filter_set_remove(set, id);
+}
+
+int exchange_get_rx_filter_hits(int id, uint64_t *hits_out,
+                                struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct filter_set *set;
+
+	if (!priv) return -1;
+
+	set = __atomic_load_n(&priv->filters, __ATOMIC_ACQUIRE);
+	if (!set) return -1;
+
+	return filter_set_hits(set, id, hits_out);
+}
+
+int exchange_subscribe_command(uint8_t cmd_id, exchange_user_callback callback,
+                               enum ca821x_route_thread thread,
+                               struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct route_table *routes;
+
+	if (!priv || !callback) return -1;
+	if (thread != ca821x_route_dispatch && thread != ca821x_route_io)
+		return -1;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	if (!priv->routes)
+		__atomic_store_n(&priv->routes, route_table_create(), __ATOMIC_RELEASE);
+	routes = priv->routes;
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	if (!routes) return -1;
+
+	return route_subscribe(routes, cmd_id, callback, thread);
+}
+
+int exchange_unsubscribe_command(int id, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct route_table *routes;
+
+	if (!priv) return -1;
+
+	routes = __atomic_load_n(&priv->routes, __ATOMIC_ACQUIRE);
+	if (!routes) return -1;
+
+	return route_unsubscribe(routes, id);
+}
+
+int exchange_set_debug_sink(exchange_debug_sink sink, void *context,
+                            struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+
+	if (!priv) return -1;
+
+	return debug_lane_set_sink(priv, sink, context);
+}
+
 int exchange_register_user_callback(exchange_user_callback callback,
                                     struct ca821x_dev *pDeviceRef)
 {
@@ -218,61 +801,350 @@ int exchange_register_user_callback(exchange_user_callback callback,
 	return 0;
 }
 
-static void *ca821x_recovery_worker(void *arg)
+int exchange_get_latency_histogram(enum ca821x_latency_type type,
+                                   struct ca821x_histogram *hist_out,
+                                   struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+
+	if (!priv || type >= ca821x_latency_count) return -1;
+
+	histogram_snapshot(&priv->latency[type], hist_out);
+	return 0;
+}
+
+void exchange_reset_latency_histograms(struct ca821x_dev *pDeviceRef)
 {
-	struct ca821x_dev *pDeviceRef = arg;
 	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
 
+	if (!priv) return;
+
+	for (int i = 0; i < ca821x_latency_count; i++)
+	{
+		histogram_reset(&priv->latency[i]);
+	}
+}
+
+int exchange_enable_pib_cache(int enable, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct pib_cache *cache;
+
+	if (!priv) return -1;
+
+	//The cache is never freed while the device is open, so that it can be
+	//used without holding any lock other than its own. The other optional
+	//per-device state is created on first use in the same way.
 	pthread_mutex_lock(&priv->flag_mutex);
-	priv->rescue_thread = pthread_self();
+	if (!priv->pib_cache)
+		__atomic_store_n(&priv->pib_cache, pib_cache_create(), __ATOMIC_RELEASE);
+	cache = priv->pib_cache;
 	pthread_mutex_unlock(&priv->flag_mutex);
 
-	if (priv->error_callback)
+	if (!cache) return -1;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->enabled = enable;
+	pthread_mutex_unlock(&cache->mutex);
+	//Values learnt before the cache was disabled may since have gone stale
+	if (!enable) pib_cache_invalidate(cache);
+
+	return 0;
+}
+
+int exchange_get_pib_cache_stats(struct ca821x_pib_cache_stats *stats_out,
+                                 struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct pib_cache *cache;
+
+	if (!priv) return -1;
+
+	cache = __atomic_load_n(&priv->pib_cache, __ATOMIC_ACQUIRE);
+	if (!cache)
 	{
-		priv->error_callback(priv->error, pDeviceRef);
+		memset(stats_out, 0, sizeof(*stats_out));
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	*stats_out = cache->stats;
+	pthread_mutex_unlock(&cache->mutex);
+	return 0;
+}
+
+int exchange_enable_pib_replay(int enable, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct pib_shadow *shadow;
+
+	if (!priv) return -1;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	if (!priv->pib_shadow)
+		__atomic_store_n(&priv->pib_shadow, pib_shadow_create(), __ATOMIC_RELEASE);
+	shadow = priv->pib_shadow;
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	if (!shadow) return -1;
+
+	pthread_mutex_lock(&shadow->mutex);
+	shadow->enabled = enable;
+	pthread_mutex_unlock(&shadow->mutex);
+	if (!enable) pib_shadow_clear(shadow);
+
+	return 0;
+}
+
+static int pib_replay_enabled(struct ca821x_exchange_base *priv)
+{
+	struct pib_shadow *shadow = __atomic_load_n(&priv->pib_shadow, __ATOMIC_ACQUIRE);
+	int enabled;
+
+	if (!shadow) return 0;
+
+	pthread_mutex_lock(&shadow->mutex);
+	enabled = shadow->enabled;
+	pthread_mutex_unlock(&shadow->mutex);
+	return enabled;
+}
+
+//Check whether a recovered device has lost its PIB, by reading back the first
+//recorded MLME attribute. Without one to read, the PIB is assumed lost.
+static int pib_lost(const struct ca821x_pib_setting *settings, size_t count,
+                    struct ca821x_dev *pDeviceRef)
+{
+	uint8_t get[] = {SPI_MLME_GET_REQUEST, 2, 0, 0};
+	uint8_t response[sizeof(struct MAC_Message)];
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (settings[i].type != ca821x_pib_mlme) continue;
+
+		get[GET_REQ_ATTR] = settings[i].attribute;
+		get[GET_REQ_INDEX] = settings[i].index;
+		if (ca8210_exchange_commands(get, sizeof(get), response, pDeviceRef))
+			return 1;
+
+		return response[GET_CNF_STATUS] != MAC_SUCCESS ||
+		       response[GET_CNF_ATTRLEN] != settings[i].length ||
+		       memcmp(&response[GET_CNF_VALUE], settings[i].value,
+		              settings[i].length);
+	}
+
+	return 1;
+}
+
+//Return a recovered device to the PIB state it had before the error. Called
+//from the recovery thread, before the error callback, so that the callback can
+//rebuild the state that isn't replayed (such as MLME_START) on a configured
+//device. A device that kept its PIB through the error is left alone.
+static void replay_pib(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_pib_setting *settings;
+	const uint8_t reset[] = {SPI_MLME_RESET_REQUEST, 1, 1};
+	uint8_t response[sizeof(struct MAC_Message)];
+	size_t count;
+
+	if (!pib_replay_enabled(priv)) return;
+
+	//Take the snapshot first, as the reset empties the shadow. Applying the
+	//snapshot then records the same values again.
+	settings = pib_shadow_snapshot(priv->pib_shadow, &count);
+	if (count && pib_lost(settings, count, pDeviceRef))
+	{
+		ca8210_exchange_commands(reset, sizeof(reset), response, pDeviceRef);
+		exchange_apply_pib_profile(settings, count, pDeviceRef);
 	}
-	else
+	free(settings);
+}
+
+//Put the traffic that exchange_handle_error set aside back into service,
+//before the waiters are released
+static void restore_queues(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	size_t replayed, dropped;
+
+	//Drop anything left over from recovery itself, so that the commands the
+	//waiters resend are not flushed with it. Taking the sync lock first makes
+	//sure that an interrupted sync waiter has already collected the fake
+	//response that woke it.
+	pthread_mutex_lock(&priv->sync_mutex);
+	out_queue_flush(priv);
+
+	dropped = flush_queue(&priv->in_buffer_queue, &priv->in_queue_mutex);
+
+	//Responses from before the error answer requests that will be resent
+	dropped += flush_queue(&priv->restore_in_buffer_queue,
+	                       &priv->in_queue_mutex);
+
+	//Everything else goes out in its original order. The waiters are still
+	//held, so it is all queued ahead of any new traffic.
+	replayed = out_queue_restore(priv, &priv->restore_out_buffer_queue,
+	                             &dropped);
+	pthread_mutex_unlock(&priv->sync_mutex);
+
+	if (replayed && priv->signal_func) priv->signal_func(pDeviceRef);
+
+	__atomic_fetch_add(&priv->counters.restore_replayed, replayed,
+	                   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&priv->counters.restore_dropped, dropped,
+	                   __ATOMIC_RELAXED);
+	CA821X_LOG(ca821x_log_info, "device %p replayed %zu messages, dropped %zu",
+	           (void *)pDeviceRef, replayed, dropped);
+}
+
+//Bring a device back after exchange_handle_error has set its queues aside
+static void recover_device(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct fr_snapshot *snapshot;
+	uint64_t start_time = get_time_ns();
+	uint64_t phase_time, callback_start, callback_time;
+	struct ca821x_fr_entry failed = {0};
+
+	//Probes name the recovery after the last message written before the error
+	flight_recorder_last(&priv->flight_recorder, ca821x_fr_tx, &failed);
+	CA821X_TRACE4(recovery_start, pDeviceRef, failed.data[0], failed.len,
+	              priv->error);
+	CA821X_LOG(ca821x_log_warning, "device %p failed with error %d, recovering",
+	           (void *)pDeviceRef, priv->error);
+	snapshot = flight_recorder_snapshot(pDeviceRef);
+
+	//Let the rest of the group take over the traffic while this recovers
+	group_member_recovering(pDeviceRef);
+	standby_failover(pDeviceRef);
+
+	//Nothing can be restored until the device is back, and if it is being
+	//closed instead, the waiters just need releasing
+	phase_time = get_time_ns();
+	if (priv->ready_func && priv->ready_func(pDeviceRef))
 	{
-		abort();
+		CA821X_LOG(ca821x_log_info, "device %p closed before it was recovered",
+		           (void *)pDeviceRef);
+		phase_time = get_time_ns();
+		standby_failback(pDeviceRef);
+		goto release;
 	}
+	callback_time = get_time_ns() - phase_time;
+	phase_time = get_time_ns();
+
+	if (!priv->error_callback && !pib_replay_enabled(priv)) abort();
+
+	//Take the traffic back before replaying, so that anything set through the
+	//standby meanwhile is replayed too. The replay comes before the error
+	//callback, so that whatever the callback rebuilds isn't reset again.
+	standby_failback(pDeviceRef);
+	replay_pib(pDeviceRef);
+
+	if (priv->error_callback)
+	{
+		callback_start = get_time_ns();
+		priv->error_callback(priv->error, pDeviceRef);
+
+		//The callback is its own phase, so leave it out of the restore
+		callback_start = get_time_ns() - callback_start;
+		callback_time += callback_start;
+		phase_time += callback_start;
+	}
+	histogram_record(&priv->latency[ca821x_latency_recovery_callback],
+	                 callback_time / 1000);
+
+	CA821X_LOG(ca821x_log_info, "device %p recovered in %llu ms",
+	           (void *)pDeviceRef,
+	           (unsigned long long)((get_time_ns() - start_time) / 1000000));
+
+release:
+
+	restore_queues(pDeviceRef);
 
 	pthread_mutex_lock(&priv->flag_mutex);
 	priv->restoreflag = 0;
 	pthread_cond_broadcast(&priv->restore_cond);
 	pthread_mutex_unlock(&priv->flag_mutex);
 
-	//Swap contents restore buffers back into queues:
-	flush_queue(&priv->out_buffer_queue,
-	             &priv->out_queue_mutex);
-
-	flush_queue(&priv->in_buffer_queue,
-	             &priv->in_queue_mutex);
-
 	//Signal the sync queue just in case there is something waiting
 	pthread_mutex_lock(&(priv->in_queue_mutex));
 	pthread_cond_signal(&priv->sync_cond);
 	pthread_mutex_unlock(&(priv->in_queue_mutex));
 
+	group_member_recovered(pDeviceRef);
+
+	histogram_record_since(&priv->latency[ca821x_latency_recovery_restore],
+	                       phase_time);
+	CA821X_TRACE4(recovery_end, pDeviceRef, failed.data[0], failed.len,
+	              priv->error);
+
+	//Only touch the filesystem once the traffic is flowing again
+	flight_recorder_write(snapshot, pDeviceRef);
+}
+
+//Each device has a recovery thread from the start, parked until there is an
+//error, so that recovering never depends on creating a thread
+static void *ca821x_recovery_worker(void *arg)
+{
+	struct ca821x_dev *pDeviceRef = arg;
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	while (priv->rescue_runflag)
+	{
+		if (!priv->rescue_pending)
+		{
+			pthread_cond_wait(&priv->rescue_cond, &priv->flag_mutex);
+			continue;
+		}
+
+		priv->rescue_pending = 0;
+		pthread_mutex_unlock(&priv->flag_mutex);
+
+		recover_device(pDeviceRef);
+
+		pthread_mutex_lock(&priv->flag_mutex);
+	}
+	pthread_mutex_unlock(&priv->flag_mutex);
+
 	return NULL;
 }
 
+//Stop a device's recovery thread, letting it finish any recovery under way
+static void stop_recovery_worker(struct ca821x_exchange_base *priv)
+{
+	pthread_mutex_lock(&priv->flag_mutex);
+	priv->rescue_runflag = 0;
+	pthread_cond_signal(&priv->rescue_cond);
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	pthread_join(priv->rescue_thread, NULL);
+}
+
 int exchange_handle_error(int error, struct ca821x_dev *pDeviceRef)
 {
 	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	uint64_t start_time;
 	int rval = 0;
 
 	priv->error = error;
+	__atomic_fetch_add(&priv->counters.errors, 1, __ATOMIC_RELAXED);
+	flight_recorder_log(&priv->flight_recorder, ca821x_fr_error, NULL, error);
+
+	//The ca821x has probably been reset, so nothing cached can be trusted
+	if (priv->pib_cache) pib_cache_invalidate(priv->pib_cache);
 
 	//Swap contents of queues into restore buffers:
-	reseat_queue(&priv->out_buffer_queue,
-	             &priv->restore_out_buffer_queue,
-	             &priv->out_queue_mutex,
-	             &priv->out_queue_mutex);
+	start_time = get_time_ns();
+	txn_reset(priv);
+	indirect_reset(priv);
+	out_queue_reseat(priv, &priv->restore_out_buffer_queue);
 
 	reseat_queue(&priv->in_buffer_queue,
 	             &priv->restore_in_buffer_queue,
 	             &priv->in_queue_mutex,
 	             &priv->in_queue_mutex);
+	histogram_record_since(&priv->latency[ca821x_latency_recovery_reseat],
+	                       start_time);
 
 	pthread_mutex_lock(&priv->flag_mutex);
 	if(priv->restoreflag) abort(); //Failed during recovery - give up
@@ -294,19 +1166,64 @@ int exchange_handle_error(int error, struct ca821x_dev *pDeviceRef)
 		                     buffer, 0, pDeviceRef);
 	}
 
-	pthread_create(&priv->rescue_thread,
-	               NULL,
-	               &ca821x_recovery_worker,
-	               pDeviceRef);
+	//Hand over to the recovery thread
+	pthread_mutex_lock(&priv->flag_mutex);
+	priv->rescue_pending = 1;
+	pthread_cond_signal(&priv->rescue_cond);
+	pthread_mutex_unlock(&priv->flag_mutex);
 	return 0;
 }
 
+int exchange_queue_downstream(const uint8_t *buf, size_t len,
+                              struct ca821x_dev *pDeviceRef)
+{
+	size_t capacity;
+	int drop_newest;
+
+	capacity = __atomic_load_n(&s_downstream_capacity, __ATOMIC_RELAXED);
+	drop_newest = __atomic_load_n(&s_downstream_policy, __ATOMIC_RELAXED) ==
+	              ca821x_drop_newest;
+	return add_to_bounded_queue(&downstream_dispatch_queue,
+	                            &downstream_queue_mutex,
+	                            &dd_cond,
+	                            buf, len, pDeviceRef,
+	                            capacity, drop_newest);
+}
+
+//Offer a message to the subscribers that want it in the io thread, returning
+//1 if it still has to be dispatched. Like dispatch, a standby's messages go to
+//its primary's subscribers.
+static int route_in_io_thread(const uint8_t *buf, size_t len,
+                              struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_dev *primary;
+	struct route_table *routes;
+
+	primary = __atomic_load_n(&priv->standby_for, __ATOMIC_ACQUIRE);
+	if (primary)
+	{
+		pDeviceRef = primary;
+		priv = primary->exchange_context;
+	}
+
+	routes = __atomic_load_n(&priv->routes, __ATOMIC_ACQUIRE);
+	if (!routes) return 1;
+
+	return route_io(routes, buf, len, pDeviceRef);
+}
+
 void *ca8210_io_worker(void *arg)
 {
 	struct ca821x_dev *pDeviceRef = arg;
 	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_merge *merge;
+	struct filter_set *filters;
 	uint8_t buffer[MAX_BUF_SIZE];
+	uint64_t queued_time, rx_time;
 	ssize_t len;
+	size_t capacity;
+	int dropped;
 	int error = 0;
 
 	priv->flush_func(pDeviceRef);
@@ -317,24 +1234,63 @@ void *ca8210_io_worker(void *arg)
 		pthread_mutex_unlock(&priv->flag_mutex);
 
 		len = priv->read_func(pDeviceRef, buffer);
+		rx_time = get_time_ns();
+		CA821X_TRACE3(read_return, pDeviceRef, len > 0 ? buffer[0] : 0, len);
 		assert(len < MAX_BUF_SIZE);
 		if (len > 0)
 		{
+			flight_recorder_log(&priv->flight_recorder, ca821x_fr_rx, buffer, len);
+			__atomic_fetch_add(&priv->counters.rx_msgs, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&priv->counters.rx_bytes, len, __ATOMIC_RELAXED);
+			txn_observe(priv, buffer, len);
+			indirect_observe(priv, buffer, len);
 			if (buffer[0] & SPI_SYN)
 			{
-				//Add to queue for synchronous processing
-				add_to_waiting_queue(&(priv->in_buffer_queue),
-				                     &(priv->in_queue_mutex),
-				                     &(priv->sync_cond),
-				                     buffer, len, pDeviceRef);
+				//Add to queue for synchronous processing. A response nobody
+				//waited for is stale, so the oldest is the one to drop.
+				capacity = __atomic_load_n(&priv->in_capacity, __ATOMIC_RELAXED);
+				dropped = add_to_bounded_queue(&(priv->in_buffer_queue),
+				                               &(priv->in_queue_mutex),
+				                               &(priv->sync_cond),
+				                               buffer, len, pDeviceRef,
+				                               capacity, 0);
 			}
 			else
 			{
-				//Add to queue for dispatching downstream
-				add_to_waiting_queue(&downstream_dispatch_queue,
-				                     &downstream_queue_mutex,
-				                     &dd_cond,
-				                     buffer, len, pDeviceRef);
+				if (priv->pib_cache)
+					pib_cache_observe_async(priv->pib_cache, buffer);
+
+				//Discard anything the application has filtered out before it
+				//costs a copy. Otherwise add to queue for dispatching
+				//downstream, by way of the merge that puts it in order with
+				//other devices' messages if there is one.
+				filters = __atomic_load_n(&priv->filters, __ATOMIC_ACQUIRE);
+				merge = __atomic_load_n(&priv->merge, __ATOMIC_ACQUIRE);
+				dropped = 0;
+				if (filters && filter_set_drops(filters, buffer, len))
+				{
+					__atomic_fetch_add(&priv->counters.rx_filtered, 1,
+					                   __ATOMIC_RELAXED);
+				}
+				else if (debug_lane_offer(priv, buffer, len, pDeviceRef))
+				{
+					//Debug strings with a sink don't take the dispatch path
+				}
+				else if (!route_in_io_thread(buffer, len, pDeviceRef))
+				{
+					__atomic_fetch_add(&priv->counters.rx_routed, 1,
+					                   __ATOMIC_RELAXED);
+				}
+				else if (!merge || merge_add(merge, buffer, len, pDeviceRef,
+				                             rx_time))
+				{
+					dropped = exchange_queue_downstream(buffer, len, pDeviceRef);
+				}
+			}
+			if (dropped)
+			{
+				__atomic_fetch_add(&priv->counters.rx_dropped, 1,
+				                   __ATOMIC_RELAXED);
 			}
 		}
 		else if (len < 0)
@@ -342,19 +1298,49 @@ void *ca8210_io_worker(void *arg)
 			exchange_handle_error(len, pDeviceRef);
 		}
 
-		//Send any queued messages
-		len = pop_from_queue(&(priv->out_buffer_queue),
-		                     &(priv->out_queue_mutex),
-		                     buffer,
-		                     MAX_BUF_SIZE, &pDeviceRef);
+		//Confirm any indirect frames that expired before reaching the ca821x
+		while ((len = indirect_expire(priv, buffer, &pDeviceRef)) > 0)
+		{
+			if (exchange_queue_downstream(buffer, len, pDeviceRef))
+			{
+				__atomic_fetch_add(&priv->counters.rx_dropped, 1,
+				                   __ATOMIC_RELAXED);
+			}
+		}
+
+		//Send any queued messages, starting with data requests that were held
+		//back until the device had room for them
+		len = txn_release(priv, buffer, MAX_BUF_SIZE, &pDeviceRef, &queued_time);
+		if (len == 0)
+		{
+			len = indirect_release(priv, buffer, MAX_BUF_SIZE, &pDeviceRef,
+			                       &queued_time);
+			if (len == 0)
+			{
+				len = out_queue_pop(priv, buffer, MAX_BUF_SIZE, &pDeviceRef,
+				                    &queued_time);
+				if (len > 0 && !indirect_admit(priv, buffer, len, pDeviceRef))
+					len = 0;
+			}
+			if (len > 0 && !txn_admit(priv, buffer, len, pDeviceRef)) len = 0;
+		}
 
 		if (len > 0)
 		{
+			histogram_record_since(&priv->latency[ca821x_latency_tx_queue],
+			                       queued_time);
+			flight_recorder_log(&priv->flight_recorder, ca821x_fr_tx, buffer, len);
 			error = priv->write_func(buffer, len, pDeviceRef);
+			CA821X_TRACE4(write_return, pDeviceRef, buffer[0], len, error);
 			if (error < 0)
 			{
 				exchange_handle_error(error, pDeviceRef);
 			}
+			else
+			{
+				__atomic_fetch_add(&priv->counters.tx_msgs, 1, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&priv->counters.tx_bytes, len, __ATOMIC_RELAXED);
+			}
 		}
 
 		pthread_mutex_lock(&priv->flag_mutex);
@@ -364,6 +1350,59 @@ void *ca8210_io_worker(void *arg)
 	return 0;
 }
 
+//Let the PIB cache and shadow learn from a completed synchronous exchange
+static void observe_sync(struct ca821x_exchange_base *priv, const uint8_t *req,
+                         const uint8_t *response)
+{
+	if (priv->pib_cache) pib_cache_observe_sync(priv->pib_cache, req, response);
+	if (priv->pib_shadow) pib_shadow_observe_sync(priv->pib_shadow, req, response);
+}
+
+//Block while the device is being recovered, unless called from the recovery
+//thread itself or the device's standby has taken over. Returns 1 if the caller
+//is the recovery thread.
+static int wait_for_restore(struct ca821x_exchange_base *priv)
+{
+	int is_rescuer = 0;
+
+	pthread_mutex_lock(&priv->flag_mutex);
+	if(priv->restoreflag && pthread_equal(priv->rescue_thread, pthread_self()))
+	{
+		is_rescuer = 1;
+	}
+	while(priv->restoreflag && !is_rescuer && !standby_active(priv))
+	{
+		pthread_cond_wait(&priv->restore_cond, &priv->flag_mutex);
+	}
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	return is_rescuer;
+}
+
+//Wait out a recovery that interrupted a synchronous exchange. The sync lock is
+//released meanwhile, so that the recovery thread can take it to reconfigure
+//the device without its responses being collected by this waiter.
+static void sync_wait_for_restore(struct ca821x_exchange_base *priv)
+{
+	pthread_mutex_unlock(&(priv->sync_mutex));
+	wait_for_restore(priv);
+	pthread_mutex_lock(&(priv->sync_mutex));
+}
+
+//Send a command through the standby that has taken over from a device. The
+//device still learns from it, so that it is restored to the latest state.
+static int forward_to_standby(struct ca821x_exchange_base *priv,
+                              const uint8_t *buf,
+                              size_t len,
+                              uint8_t *response,
+                              struct ca821x_dev *standby)
+{
+	int rval = ca8210_exchange_commands(buf, len, response, standby);
+
+	if (!rval && (buf[0] & SPI_SYN) && response) observe_sync(priv, buf, response);
+	return rval;
+}
+
 int ca8210_exchange_commands(
                              const uint8_t *buf,
                              size_t len,
@@ -372,63 +1411,227 @@ int ca8210_exchange_commands(
 {
 	const uint8_t isSynchronous = ((buf[0] & SPI_SYN) && response);
 	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
-	struct ca821x_dev *ref_out;
+	struct ca821x_dev *ref_out, *standby;
 	size_t success = 0;
-	uint8_t is_rescuer = 0;
+	uint64_t start_time = 0;
+	int is_rescuer;
 
 	if (!s_generic_initialised) return -1;
+
+	//Answer repeated GETs without a round trip if possible
+	if (isSynchronous && priv->pib_cache &&
+	    pib_cache_lookup(priv->pib_cache, buf, response))
+	{
+		return 0;
+	}
+
 	//Synchronous must execute synchronously
 	//Get sync responses from the in queue
 	//Send messages by adding them to the out queue
 
-	//If in error state, wait until restored
-	pthread_mutex_lock(&priv->flag_mutex);
-	if(priv->restoreflag && pthread_equal(priv->rescue_thread, pthread_self()))
-	{
-		is_rescuer = 1;
-	}
-	while(priv->restoreflag && !is_rescuer)
+	//If in error state, wait until restored or taken over by the standby
+	is_rescuer = wait_for_restore(priv);
+	if (!is_rescuer && (standby = standby_active(priv)))
+		return forward_to_standby(priv, buf, len, response, standby);
+
+	if (isSynchronous)
 	{
-		pthread_cond_wait(&priv->restore_cond, &priv->flag_mutex);
+		pthread_mutex_lock(&(priv->sync_mutex));
+		start_time = get_time_ns();
 	}
-	pthread_mutex_unlock(&priv->flag_mutex);
-
-	if (isSynchronous && !is_rescuer) pthread_mutex_lock(&(priv->sync_mutex));
 
 	while(success == 0) //Retry loop
 	{
-		//If in error state, wait until restored
-		pthread_mutex_lock(&priv->flag_mutex);
-		while(priv->restoreflag && !is_rescuer)
+		//Only asynchronous commands can be refused, so the sync lock isn't held
+		if (out_queue_add(priv, out_queue_classify(buf, isSynchronous),
+		                  buf, len, pDeviceRef))
 		{
-			pthread_cond_wait(&priv->restore_cond, &priv->flag_mutex);
+			return -1;
 		}
-		pthread_mutex_unlock(&priv->flag_mutex);
-
-		add_to_queue(&(priv->out_buffer_queue),
-					 &(priv->out_queue_mutex),
-					 buf,
-					 len,
-					 pDeviceRef);
 
 		if (priv->signal_func)
 			priv->signal_func(pDeviceRef);
 
-		if (!isSynchronous) return 0;
+		if (!isSynchronous)
+		{
+			if (priv->pib_cache) pib_cache_observe_async(priv->pib_cache, buf);
+			return 0;
+		}
 
 		//A rval of zero here is an error packet notifying of a driver error during
 		//sync command. The original command will be resent after recovery so sync
 		//behaviour should be upheld.
+		CA821X_TRACE3(sync_wait_start, pDeviceRef, buf[0], len);
 		success = wait_on_queue(&(priv->in_buffer_queue), &(priv->in_queue_mutex),
 		                        &(priv->sync_cond));
+		CA821X_TRACE4(sync_wait_end, pDeviceRef, buf[0], len, success);
 
 		pop_from_queue(&(priv->in_buffer_queue), &(priv->in_queue_mutex), response,
 		               sizeof(struct MAC_Message),
 		               &ref_out);
+
+		if (success == 0)
+		{
+			sync_wait_for_restore(priv);
+			if (!is_rescuer && (standby = standby_active(priv)))
+			{
+				pthread_mutex_unlock(&(priv->sync_mutex));
+				return forward_to_standby(priv, buf, len, response, standby);
+			}
+		}
 	}
 
 	assert(ref_out == pDeviceRef);
-	if(!is_rescuer) pthread_mutex_unlock(&(priv->sync_mutex));
+	histogram_record_since(&priv->latency[ca821x_latency_sync], start_time);
+	observe_sync(priv, buf, response);
+	if (!is_rescuer) standby_mirror(priv, buf, response);
+	pthread_mutex_unlock(&(priv->sync_mutex));
 
 	return 0;
 }
+
+//Build the SET request for one entry of a PIB profile, returning its length
+static size_t build_pib_set(const struct ca821x_pib_setting *setting,
+                            uint8_t *buf)
+{
+	if (setting->type == ca821x_pib_hwme)
+	{
+		buf[MSG_CMD] = SPI_HWME_SET_REQUEST;
+		buf[MSG_LEN] = HWME_SET_REQ_VALUE - MSG_HEADER_LEN + setting->length;
+		buf[HWME_SET_REQ_ATTR] = setting->attribute;
+		buf[HWME_SET_REQ_ATTRLEN] = setting->length;
+		memcpy(&buf[HWME_SET_REQ_VALUE], setting->value, setting->length);
+		return HWME_SET_REQ_VALUE + setting->length;
+	}
+
+	buf[MSG_CMD] = SPI_MLME_SET_REQUEST;
+	buf[MSG_LEN] = SET_REQ_VALUE - MSG_HEADER_LEN + setting->length;
+	buf[SET_REQ_ATTR] = setting->attribute;
+	buf[SET_REQ_INDEX] = setting->index;
+	buf[SET_REQ_ATTRLEN] = setting->length;
+	memcpy(&buf[SET_REQ_VALUE], setting->value, setting->length);
+	return SET_REQ_VALUE + setting->length;
+}
+
+//Apply a PIB profile through the standby that has taken over from a device,
+//letting the device learn from it as forward_to_standby does
+static int forward_profile_to_standby(struct ca821x_exchange_base *priv,
+                                      struct ca821x_pib_setting *settings,
+                                      size_t count,
+                                      struct ca821x_dev *standby)
+{
+	uint8_t buf[MAX_BUF_SIZE];
+	uint8_t response[MSG_HEADER_LEN + 1];
+	int failures = exchange_apply_pib_profile(settings, count, standby);
+
+	if (failures < 0) return failures;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		response[MSG_CMD] = (settings[i].type == ca821x_pib_hwme) ?
+		                    SPI_HWME_SET_CONFIRM : SPI_MLME_SET_CONFIRM;
+		response[MSG_LEN] = 1;
+		response[CNF_STATUS] = settings[i].status;
+		build_pib_set(&settings[i], buf);
+		observe_sync(priv, buf, response);
+	}
+	return failures;
+}
+
+int exchange_apply_pib_profile(struct ca821x_pib_setting *settings,
+                               size_t count,
+                               struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv;
+	struct ca821x_dev *ref_out, *standby;
+	uint8_t buf[MAX_BUF_SIZE];
+	uint8_t response[sizeof(struct MAC_Message)];
+	uint8_t expected;
+	size_t sent, done = 0;
+	size_t len, offset;
+	int failures = 0;
+	int is_rescuer, forwarded;
+
+	if (!s_generic_initialised || !pDeviceRef || !pDeviceRef->exchange_context)
+		return -1;
+	if (count && !settings) return -1;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		//The whole request has to fit in a frame with a one byte length
+		offset = (settings[i].type == ca821x_pib_hwme) ? HWME_SET_REQ_VALUE :
+		                                                  SET_REQ_VALUE;
+		if (offset + settings[i].length >= MAX_BUF_SIZE) return -1;
+		if (settings[i].length && !settings[i].value) return -1;
+	}
+
+	priv = pDeviceRef->exchange_context;
+
+	//The whole batch is one synchronous exchange as far as other threads are
+	//concerned, so their sync commands cannot steal our confirms.
+	is_rescuer = wait_for_restore(priv);
+	if (!is_rescuer && (standby = standby_active(priv)))
+		return forward_profile_to_standby(priv, settings, count, standby);
+	pthread_mutex_lock(&(priv->sync_mutex));
+
+	while (done < count)
+	{
+		//(Re)start the pipeline from the first unconfirmed setting
+		sent = done;
+
+		while (done < count)
+		{
+			while (sent < count && sent - done < CA821X_PIB_PIPELINE_DEPTH)
+			{
+				len = build_pib_set(&settings[sent], buf);
+				out_queue_add(priv, ca821x_out_sync, buf, len, pDeviceRef);
+				sent++;
+			}
+
+			if (priv->signal_func)
+				priv->signal_func(pDeviceRef);
+
+			len = wait_on_queue(&(priv->in_buffer_queue), &(priv->in_queue_mutex),
+			                    &(priv->sync_cond));
+			pop_from_queue(&(priv->in_buffer_queue), &(priv->in_queue_mutex),
+			               response, sizeof(response), &ref_out);
+
+			//The device failed mid-batch. Any requests still in flight were
+			//lost, so resend everything unconfirmed once it has been restored.
+			if (len == 0)
+			{
+				sync_wait_for_restore(priv);
+				if (!is_rescuer && (standby = standby_active(priv)))
+					goto forward;
+				break;
+			}
+
+			assert(ref_out == pDeviceRef);
+
+			expected = (settings[done].type == ca821x_pib_hwme) ?
+			           SPI_HWME_SET_CONFIRM : SPI_MLME_SET_CONFIRM;
+			if (response[MSG_CMD] == expected)
+				settings[done].status = response[CNF_STATUS];
+			else
+				settings[done].status = MAC_SYSTEM_ERROR;
+
+			build_pib_set(&settings[done], buf);
+			observe_sync(priv, buf, response);
+
+			if (settings[done].status != MAC_SUCCESS) failures++;
+			done++;
+		}
+	}
+
+	if (!is_rescuer) standby_mirror_profile(priv, settings, count);
+	pthread_mutex_unlock(&(priv->sync_mutex));
+
+	return failures;
+
+forward:
+	//The standby took over mid-batch, so it gets whatever is unconfirmed
+	pthread_mutex_unlock(&(priv->sync_mutex));
+	forwarded = forward_profile_to_standby(priv, &settings[done], count - done,
+	                                       standby);
+	return forwarded < 0 ? forwarded : failures + forwarded;
+}
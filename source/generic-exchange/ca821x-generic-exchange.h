@@ -50,6 +50,15 @@ int deinit_generic(struct ca821x_dev *pDeviceRef);
 int ca821x_run_downstream_dispatch(void);
 #endif
 
+/* Number of messages waiting in the shared downstream dispatch queue */
+size_t exchange_downstream_queue_depth(void);
+
+/* Add a message to the downstream dispatch queue, returning 1 if the queue was
+ * full and a message was dropped
+ */
+int exchange_queue_downstream(const uint8_t *buf, size_t len,
+                              struct ca821x_dev *pDeviceRef);
+
 int exchange_handle_error(int error, struct ca821x_dev *pDeviceRef);
 
 void *ca8210_io_worker(void *arg);
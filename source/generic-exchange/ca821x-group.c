@@ -0,0 +1,514 @@
+/**
+ * @file ca821x-group.c
+ * @brief Load balancing across a group of devices
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-generic-exchange.h"
+#include "ca821x-group.h"
+#include "ca821x-msg.h"
+#include "ca821x-queue.h"
+#include "ca821x_api.h"
+
+struct group_member
+{
+	struct ca821x_dev *pDeviceRef;
+	unsigned int outstanding; //!< Data requests routed here and not confirmed
+	int recovering;
+};
+
+struct group_route
+{
+	struct FullAddr dest;
+	struct ca821x_dev *pDeviceRef;
+};
+
+struct ca821x_group
+{
+	struct ca821x_dev dev; //!< Must be first, see group_downstream
+	pthread_mutex_t mutex;
+	exchange_group_callback callback;
+	void *context;
+
+	struct group_member *members;
+	size_t member_count;
+
+	struct group_route *routes;
+	size_t route_count, route_capacity;
+
+	//Member that each MSDU handle was routed to, while unconfirmed
+	struct ca821x_dev *handle_member[256];
+
+	unsigned int users; //!< Dispatches and recoveries under way, see group_get
+};
+
+//Protects the group pointer of every device and the users of every group, so
+//that a group can't be freed while a member's threads are using it
+static pthread_mutex_t s_group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_group_idle = PTHREAD_COND_INITIALIZER;
+
+//Take a reference to the group of a device, or return NULL if it has none
+static struct ca821x_group *group_get(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_group *group;
+
+	//Most devices are never in a group
+	if (!__atomic_load_n(&priv->group, __ATOMIC_ACQUIRE)) return NULL;
+
+	pthread_mutex_lock(&s_group_mutex);
+	group = priv->group;
+	if (group) group->users++;
+	pthread_mutex_unlock(&s_group_mutex);
+	return group;
+}
+
+static void group_put(struct ca821x_group *group)
+{
+	pthread_mutex_lock(&s_group_mutex);
+	if (--group->users == 0) pthread_cond_broadcast(&s_group_idle);
+	pthread_mutex_unlock(&s_group_mutex);
+}
+
+static int route_matches(const struct FullAddr *dest, const uint8_t *buf)
+{
+	if (dest->AddressMode != buf[DATA_REQ_DSTADDRMODE]) return 0;
+	if (memcmp(dest->PANId, &buf[DATA_REQ_DSTPANID], 2)) return 0;
+	return !memcmp(dest->Address, &buf[DATA_REQ_DSTADDR],
+	               MSG_ADDR_LEN(dest->AddressMode));
+}
+
+static int addr_equal(const struct FullAddr *a, const struct FullAddr *b)
+{
+	if (a->AddressMode != b->AddressMode) return 0;
+	if (memcmp(a->PANId, b->PANId, 2)) return 0;
+	return !memcmp(a->Address, b->Address, MSG_ADDR_LEN(a->AddressMode));
+}
+
+//Must be called with the group mutex held
+static struct group_member *find_member(struct ca821x_group *group,
+                                        struct ca821x_dev *pDeviceRef)
+{
+	for (size_t i = 0; i < group->member_count; i++)
+	{
+		if (group->members[i].pDeviceRef == pDeviceRef)
+			return &group->members[i];
+	}
+	return NULL;
+}
+
+//Forget the member that a handle was routed to. Must be called with the group
+//mutex held.
+static void release_handle(struct ca821x_group *group, uint8_t handle)
+{
+	struct group_member *member;
+
+	if (!group->handle_member[handle]) return;
+
+	member = find_member(group, group->handle_member[handle]);
+	if (member && member->outstanding) member->outstanding--;
+	group->handle_member[handle] = NULL;
+}
+
+//Pick the member to send a data request through: the one its destination is
+//mapped to, or else the one with the fewest unconfirmed data requests. Must be
+//called with the group mutex held.
+static struct group_member *pick_member(struct ca821x_group *group,
+                                        const uint8_t *buf,
+                                        struct ca821x_dev *exclude)
+{
+	struct group_member *member, *best = NULL;
+
+	for (size_t i = 0; i < group->route_count; i++)
+	{
+		if (!route_matches(&group->routes[i].dest, buf)) continue;
+
+		member = find_member(group, group->routes[i].pDeviceRef);
+		if (member && !member->recovering && member->pDeviceRef != exclude)
+			return member;
+		break;
+	}
+
+	for (size_t i = 0; i < group->member_count; i++)
+	{
+		member = &group->members[i];
+		if (member->recovering || member->pDeviceRef == exclude) continue;
+		if (!best || member->outstanding < best->outstanding) best = member;
+	}
+
+	return best;
+}
+
+//Send a data request through a member of the group. Returns 1 if there is no
+//member to send it through, otherwise the result of sending it.
+static int route_data(struct ca821x_group *group, const uint8_t *buf,
+                      size_t len, struct ca821x_dev *exclude)
+{
+	struct group_member *member;
+	struct ca821x_dev *pDeviceRef;
+	uint8_t handle = buf[DATA_REQ_HANDLE];
+	int rval;
+
+	pthread_mutex_lock(&group->mutex);
+	member = pick_member(group, buf, exclude);
+	if (!member)
+	{
+		//With every member recovering, wait on the one it would have used
+		if (exclude || !group->member_count)
+		{
+			pthread_mutex_unlock(&group->mutex);
+			return 1;
+		}
+		member = &group->members[0];
+	}
+
+	//A handle reused before its confirm replaces the old request
+	release_handle(group, handle);
+	member->outstanding++;
+	group->handle_member[handle] = member->pDeviceRef;
+	pDeviceRef = member->pDeviceRef;
+	pthread_mutex_unlock(&group->mutex);
+
+	//Never hold the group lock while sending, since the member may block
+	rval = pDeviceRef->ca821x_api_downstream(buf, len, NULL, pDeviceRef);
+	if (rval)
+	{
+		pthread_mutex_lock(&group->mutex);
+		if (group->handle_member[handle] == pDeviceRef)
+			release_handle(group, handle);
+		pthread_mutex_unlock(&group->mutex);
+	}
+	return rval;
+}
+
+//ca821x_api_downstream of the group device
+static int group_downstream(const uint8_t *buf, size_t len, uint8_t *response,
+                            struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_group *group = (struct ca821x_group *)pDeviceRef;
+	struct ca821x_dev *member;
+	uint8_t cmd = buf[MSG_CMD];
+	int rval;
+
+	if (cmd == SPI_MCPS_DATA_REQUEST && len > DATA_REQ_TXOPTIONS)
+		return route_data(group, buf, len, NULL) ? -1 : 0;
+
+	if ((cmd & ~SPI_SYN) != (SPI_MCPS_PURGE_REQUEST & ~SPI_SYN) || len <= 2)
+		return -1;
+
+	//A purge has to go to the member that the request was sent through
+	pthread_mutex_lock(&group->mutex);
+	member = group->handle_member[buf[DATA_CNF_HANDLE]];
+	pthread_mutex_unlock(&group->mutex);
+	if (!member) return -1;
+
+	rval = member->ca821x_api_downstream(buf, len, response, member);
+	if (!rval && response && response[DATA_CNF_STATUS] == MAC_SUCCESS)
+	{
+		pthread_mutex_lock(&group->mutex);
+		if (group->handle_member[buf[DATA_CNF_HANDLE]] == member)
+			release_handle(group, buf[DATA_CNF_HANDLE]);
+		pthread_mutex_unlock(&group->mutex);
+	}
+	return rval;
+}
+
+struct ca821x_group *exchange_group_create(exchange_group_callback callback,
+                                           void *context)
+{
+	struct ca821x_group *group = calloc(1, sizeof(struct ca821x_group));
+
+	if (!group) return NULL;
+
+	ca821x_api_init(&group->dev);
+	group->dev.ca821x_api_downstream = &group_downstream;
+	group->callback = callback;
+	group->context = context;
+	pthread_mutex_init(&group->mutex, NULL);
+	return group;
+}
+
+void exchange_group_destroy(struct ca821x_group *group)
+{
+	if (!group) return;
+
+	while (group->member_count)
+		exchange_group_remove(group, group->members[0].pDeviceRef);
+
+	pthread_mutex_destroy(&group->mutex);
+	free(group->members);
+	free(group->routes);
+	free(group);
+}
+
+struct ca821x_dev *exchange_group_device(struct ca821x_group *group)
+{
+	return &group->dev;
+}
+
+int exchange_group_add(struct ca821x_group *group, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct group_member *members;
+	int error = 0;
+
+	if (!priv) return -1;
+
+	pthread_mutex_lock(&group->mutex);
+	if (priv->group)
+	{
+		error = -1;
+		goto exit;
+	}
+
+	members = realloc(group->members,
+	                  (group->member_count + 1) * sizeof(*members));
+	if (!members)
+	{
+		error = -1;
+		goto exit;
+	}
+	group->members = members;
+	memset(&members[group->member_count], 0, sizeof(*members));
+	members[group->member_count].pDeviceRef = pDeviceRef;
+	group->member_count++;
+
+	pthread_mutex_lock(&s_group_mutex);
+	__atomic_store_n(&priv->group, group, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&s_group_mutex);
+
+exit:
+	pthread_mutex_unlock(&group->mutex);
+	return error;
+}
+
+int exchange_group_remove(struct ca821x_group *group,
+                          struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct group_member *member;
+	size_t i;
+
+	pthread_mutex_lock(&group->mutex);
+	member = find_member(group, pDeviceRef);
+	if (!member)
+	{
+		pthread_mutex_unlock(&group->mutex);
+		return -1;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		if (group->handle_member[i] == pDeviceRef)
+			group->handle_member[i] = NULL;
+	}
+
+	i = member - group->members;
+	group->member_count--;
+	memmove(member, member + 1, (group->member_count - i) * sizeof(*member));
+
+	pthread_mutex_unlock(&group->mutex);
+
+	//Nothing new can start using the group through this device, so wait for
+	//whatever already is
+	pthread_mutex_lock(&s_group_mutex);
+	if (priv) __atomic_store_n(&priv->group, NULL, __ATOMIC_RELEASE);
+	while (group->users)
+		pthread_cond_wait(&s_group_idle, &s_group_mutex);
+	pthread_mutex_unlock(&s_group_mutex);
+	return 0;
+}
+
+int exchange_group_map(struct ca821x_group *group, const struct FullAddr *dest,
+                       struct ca821x_dev *pDeviceRef)
+{
+	struct group_route *routes;
+	size_t i;
+	int error = 0;
+
+	if (!MSG_ADDR_LEN(dest->AddressMode)) return -1;
+
+	pthread_mutex_lock(&group->mutex);
+	for (i = 0; i < group->route_count; i++)
+	{
+		if (addr_equal(&group->routes[i].dest, dest)) break;
+	}
+
+	if (!pDeviceRef)
+	{
+		//Unmap, if it was mapped
+		if (i < group->route_count)
+			group->routes[i] = group->routes[--group->route_count];
+		goto exit;
+	}
+
+	if (!find_member(group, pDeviceRef))
+	{
+		error = -1;
+		goto exit;
+	}
+
+	if (i == group->route_count)
+	{
+		if (group->route_count == group->route_capacity)
+		{
+			size_t capacity = group->route_capacity ? group->route_capacity * 2 : 8;
+			routes = realloc(group->routes, capacity * sizeof(*routes));
+			if (!routes)
+			{
+				error = -1;
+				goto exit;
+			}
+			group->routes = routes;
+			group->route_capacity = capacity;
+		}
+		group->route_count++;
+		memset(&group->routes[i].dest, 0, sizeof(group->routes[i].dest));
+		group->routes[i].dest.AddressMode = dest->AddressMode;
+		memcpy(group->routes[i].dest.PANId, dest->PANId, 2);
+		memcpy(group->routes[i].dest.Address, dest->Address,
+		       MSG_ADDR_LEN(dest->AddressMode));
+	}
+	group->routes[i].pDeviceRef = pDeviceRef;
+
+exit:
+	pthread_mutex_unlock(&group->mutex);
+	return error;
+}
+
+static void observe_confirm(struct ca821x_group *group, const uint8_t *buf,
+                            size_t len, struct ca821x_dev *pDeviceRef)
+{
+	if (buf[MSG_CMD] == SPI_MCPS_DATA_CONFIRM && len > DATA_CNF_STATUS)
+	{
+		pthread_mutex_lock(&group->mutex);
+		if (group->handle_member[buf[DATA_CNF_HANDLE]] == pDeviceRef)
+			release_handle(group, buf[DATA_CNF_HANDLE]);
+		pthread_mutex_unlock(&group->mutex);
+	}
+}
+
+void group_observe(const uint8_t *buf, size_t len, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_group *group = group_get(pDeviceRef);
+
+	if (!group) return;
+
+	observe_confirm(group, buf, len, pDeviceRef);
+	group_put(group);
+}
+
+int group_dispatch(const uint8_t *buf, size_t len, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_group *group = group_get(pDeviceRef);
+	int rval = -1;
+
+	if (!group) return -1;
+
+	observe_confirm(group, buf, len, pDeviceRef);
+	if (group->callback)
+		rval = group->callback(buf, len, pDeviceRef, group->context);
+
+	group_put(group);
+	return rval;
+}
+
+void group_member_recovering(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct buffer_queue *pending = NULL;
+	struct group_member *member;
+	struct ca821x_group *group;
+	struct ca821x_dev *ref_out;
+	uint8_t buf[MAX_BUF_SIZE];
+	size_t len;
+
+	group = group_get(pDeviceRef);
+	if (!group) return;
+
+	pthread_mutex_lock(&group->mutex);
+	member = find_member(group, pDeviceRef);
+	if (member)
+	{
+		//Whatever the device had in progress was lost with it
+		member->recovering = 1;
+		for (int i = 0; i < 256; i++)
+		{
+			if (group->handle_member[i] == pDeviceRef)
+				release_handle(group, i);
+		}
+	}
+	pthread_mutex_unlock(&group->mutex);
+	if (!member) goto exit;
+
+	//Take the data requests out of the restore queue, and leave the rest
+	reseat_queue(&priv->restore_out_buffer_queue, &pending,
+	             &priv->out_queue_mutex, &priv->out_queue_mutex);
+	while (pending)
+	{
+		len = pop_from_queue(&pending, &priv->out_queue_mutex, buf, sizeof(buf),
+		                     &ref_out);
+		if (len > DATA_REQ_TXOPTIONS && buf[MSG_CMD] == SPI_MCPS_DATA_REQUEST &&
+		    route_data(group, buf, len, pDeviceRef) == 0)
+		{
+			continue;
+		}
+
+		if (len)
+		{
+			add_to_queue(&priv->restore_out_buffer_queue,
+			             &priv->out_queue_mutex, buf, len, ref_out);
+		}
+	}
+
+exit:
+	group_put(group);
+}
+
+void group_member_recovered(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_group *group = group_get(pDeviceRef);
+	struct group_member *member;
+
+	if (!group) return;
+
+	pthread_mutex_lock(&group->mutex);
+	member = find_member(group, pDeviceRef);
+	if (member) member->recovering = 0;
+	pthread_mutex_unlock(&group->mutex);
+	group_put(group);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_GROUP_H
+#define CA821X_GROUP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+//The group of a device is looked up and held for the duration of each of
+//these calls, so exchange_group_remove waits for them to finish.
+
+//Free the member handle of a data request once its confirm has been read
+void group_observe(const uint8_t *buf, size_t len, struct ca821x_dev *pDeviceRef);
+
+//Let a device's group, if it has one, see a message about to be dispatched
+//downstream. Returns 0 if the group callback handled it, otherwise negative.
+int group_dispatch(const uint8_t *buf, size_t len, struct ca821x_dev *pDeviceRef);
+
+//Stop routing to a member that has entered recovery, and send the data
+//requests it hadn't written through the other members instead. Called from
+//the member's recovery thread.
+void group_member_recovering(struct ca821x_dev *pDeviceRef);
+
+//Start routing to a member again once it has been recovered
+void group_member_recovered(struct ca821x_dev *pDeviceRef);
+
+#endif
@@ -0,0 +1,353 @@
+/**
+ * @file ca821x-indirect.c
+ * @brief Host queue of indirect frames
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ca821x-generic-exchange.h"
+#include "ca821x-indirect.h"
+#include "ca821x-msg.h"
+#include "ca821x-out-queue.h"
+#include "ca821x-queue.h"
+#include "ca821x-stats.h"
+#include "ca821x_api.h"
+
+static int is_indirect_request(const uint8_t *buf, size_t len)
+{
+	return buf[MSG_CMD] == SPI_MCPS_DATA_REQUEST && len > DATA_REQ_TXOPTIONS &&
+	       (buf[DATA_REQ_TXOPTIONS] & DATA_REQ_TXOPT_INDIRECT);
+}
+
+static int dest_matches(const struct indirect_dest *dest, const uint8_t *buf)
+{
+	if (dest->addr_mode != buf[DATA_REQ_DSTADDRMODE]) return 0;
+	if (memcmp(dest->panid, &buf[DATA_REQ_DSTPANID], 2)) return 0;
+	return !memcmp(dest->addr, &buf[DATA_REQ_DSTADDR],
+	               MSG_ADDR_LEN(dest->addr_mode));
+}
+
+static void update_counts(struct indirect_state *state)
+{
+	uint64_t destinations = 0;
+
+	for (struct indirect_dest *dest = state->dests; dest; dest = dest->next)
+		destinations++;
+
+	__atomic_store_n(&state->stats.on_chip, state->on_chip, __ATOMIC_RELAXED);
+	__atomic_store_n(&state->stats.destinations, destinations, __ATOMIC_RELAXED);
+}
+
+//Find the destination of a request, adding it if it is new
+static struct indirect_dest *get_dest(struct indirect_state *state,
+                                      const uint8_t *buf)
+{
+	struct indirect_dest **link = &state->dests;
+
+	for (; *link; link = &(*link)->next)
+	{
+		if (dest_matches(*link, buf)) return *link;
+	}
+
+	*link = calloc(1, sizeof(struct indirect_dest));
+	if (*link)
+	{
+		(*link)->addr_mode = buf[DATA_REQ_DSTADDRMODE];
+		memcpy((*link)->panid, &buf[DATA_REQ_DSTPANID], 2);
+		memcpy((*link)->addr, &buf[DATA_REQ_DSTADDR],
+		       MSG_ADDR_LEN((*link)->addr_mode));
+	}
+	return *link;
+}
+
+//Forget a destination once nothing is held for it anywhere
+static void put_dest(struct indirect_state *state, struct indirect_dest *dest)
+{
+	struct indirect_dest **link;
+
+	if (dest->queued || dest->on_chip) return;
+
+	for (link = &state->dests; *link; link = &(*link)->next)
+	{
+		if (*link == dest)
+		{
+			*link = dest->next;
+			free(dest);
+			return;
+		}
+	}
+}
+
+//Move a destination to the back of the list, so the others are served first
+static void requeue_dest(struct indirect_state *state, struct indirect_dest *dest)
+{
+	struct indirect_dest **link;
+
+	for (link = &state->dests; *link != dest; link = &(*link)->next)
+		;
+	*link = dest->next;
+	dest->next = NULL;
+
+	while (*link) link = &(*link)->next;
+	*link = dest;
+}
+
+static void track_frame(struct indirect_state *state, struct indirect_dest *dest,
+                        uint8_t handle)
+{
+	struct indirect_dest *old = state->handle_dest[handle];
+
+	//A handle reused before its confirm replaces the old frame
+	if (old)
+	{
+		old->on_chip--;
+		state->on_chip--;
+	}
+
+	state->handle_dest[handle] = dest;
+	dest->on_chip++;
+	state->on_chip++;
+
+	//Which may have been the last thing held for the old destination
+	if (old && old != dest) put_dest(state, old);
+}
+
+static int has_room(struct indirect_state *state)
+{
+	unsigned int slots = __atomic_load_n(&state->chip_slots, __ATOMIC_RELAXED);
+
+	//Once disabled, anything still held is released straight away
+	return !slots || state->on_chip < slots;
+}
+
+struct indirect_state *indirect_create(void)
+{
+	struct indirect_state *state = calloc(1, sizeof(struct indirect_state));
+
+	if (state) state->persistence_ms = CA821X_INDIRECT_PERSISTENCE_MS;
+	return state;
+}
+
+void indirect_destroy(struct ca821x_exchange_base *priv)
+{
+	struct indirect_state *state = priv->indirect;
+	struct indirect_dest *dest;
+
+	if (!state) return;
+
+	while ((dest = state->dests))
+	{
+		state->dests = dest->next;
+		flush_queue(&dest->frames, &priv->out_queue_mutex);
+		free(dest);
+	}
+	free(state);
+	priv->indirect = NULL;
+}
+
+int indirect_admit(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                   size_t len, struct ca821x_dev *pDeviceRef)
+{
+	struct indirect_state *state = __atomic_load_n(&priv->indirect,
+	                                               __ATOMIC_ACQUIRE);
+	struct indirect_dest *dest;
+	unsigned int slots;
+
+	if (!state || !is_indirect_request(buf, len)) return 1;
+
+	slots = __atomic_load_n(&state->chip_slots, __ATOMIC_RELAXED);
+	if (!slots) return 1;
+
+	dest = get_dest(state, buf);
+	if (!dest) return 1;
+
+	//Keep the frames for each destination in order
+	if (!dest->queued && state->on_chip < slots)
+	{
+		track_frame(state, dest, buf[DATA_REQ_HANDLE]);
+		update_counts(state);
+		return 1;
+	}
+
+	add_to_queue(&dest->frames, &priv->out_queue_mutex, buf, len, pDeviceRef);
+	dest->queued++;
+	__atomic_fetch_add(&state->stats.queued, 1, __ATOMIC_RELAXED);
+	out_queue_hold(priv);
+	update_counts(state);
+	return 0;
+}
+
+size_t indirect_release(struct ca821x_exchange_base *priv,
+                        uint8_t *destBuf,
+                        size_t maxlen,
+                        struct ca821x_dev **pDeviceRef_out,
+                        uint64_t *timestamp_out)
+{
+	struct indirect_state *state = __atomic_load_n(&priv->indirect,
+	                                               __ATOMIC_ACQUIRE);
+	struct indirect_dest *dest, *chosen = NULL;
+	size_t len;
+
+	if (!state || !state->stats.queued || !has_room(state)) return 0;
+
+	//A destination that has nothing on the ca821x is waiting the longest
+	for (dest = state->dests; dest; dest = dest->next)
+	{
+		if (!dest->queued) continue;
+		if (!chosen) chosen = dest;
+		if (!dest->on_chip)
+		{
+			chosen = dest;
+			break;
+		}
+	}
+	if (!chosen) return 0;
+
+	len = pop_from_queue_timed(&chosen->frames, &priv->out_queue_mutex,
+	                           destBuf, maxlen, pDeviceRef_out, timestamp_out);
+	if (len == 0) return 0;
+
+	chosen->queued--;
+	__atomic_fetch_sub(&state->stats.queued, 1, __ATOMIC_RELAXED);
+	out_queue_unhold(priv, 1);
+	track_frame(state, chosen, destBuf[DATA_REQ_HANDLE]);
+	requeue_dest(state, chosen);
+	update_counts(state);
+	return len;
+}
+
+void indirect_observe(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                      size_t len)
+{
+	struct indirect_state *state = __atomic_load_n(&priv->indirect,
+	                                               __ATOMIC_ACQUIRE);
+	struct indirect_dest *dest;
+	uint8_t handle;
+
+	if (!state || len <= DATA_CNF_STATUS) return;
+
+	if (buf[MSG_CMD] == SPI_MCPS_PURGE_CONFIRM)
+	{
+		if (buf[DATA_CNF_STATUS] != MAC_SUCCESS) return;
+	}
+	else if (buf[MSG_CMD] != SPI_MCPS_DATA_CONFIRM)
+	{
+		return;
+	}
+
+	handle = buf[DATA_CNF_HANDLE];
+	dest = state->handle_dest[handle];
+	if (!dest) return;
+
+	state->handle_dest[handle] = NULL;
+	dest->on_chip--;
+	state->on_chip--;
+	put_dest(state, dest);
+	update_counts(state);
+}
+
+size_t indirect_expire(struct ca821x_exchange_base *priv, uint8_t *cnf,
+                       struct ca821x_dev **pDeviceRef_out)
+{
+	struct indirect_state *state = __atomic_load_n(&priv->indirect,
+	                                               __ATOMIC_ACQUIRE);
+	uint8_t buf[MAX_BUF_SIZE];
+	uint64_t now, persistence;
+	struct indirect_dest *dest;
+	int expired;
+
+	if (!state || !state->stats.queued) return 0;
+
+	now = get_time_ns();
+	if (now < state->next_check) return 0;
+
+	persistence = __atomic_load_n(&state->persistence_ms, __ATOMIC_RELAXED);
+	persistence *= 1000000ULL;
+
+	for (dest = state->dests; dest; dest = dest->next)
+	{
+		if (!dest->queued) continue;
+
+		//Frames are queued in order, so only the oldest can have expired
+		pthread_mutex_lock(&priv->out_queue_mutex);
+		expired = now - dest->frames->timestamp > persistence;
+		pthread_mutex_unlock(&priv->out_queue_mutex);
+		if (!expired) continue;
+
+		if (!pop_from_queue(&dest->frames, &priv->out_queue_mutex, buf,
+		                    sizeof(buf), pDeviceRef_out))
+			continue;
+
+		dest->queued--;
+		__atomic_fetch_sub(&state->stats.queued, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&state->stats.expired, 1, __ATOMIC_RELAXED);
+		out_queue_unhold(priv, 1);
+		put_dest(state, dest);
+		update_counts(state);
+
+		memset(cnf, 0, DATA_CNF_LEN);
+		cnf[MSG_CMD] = SPI_MCPS_DATA_CONFIRM;
+		cnf[MSG_LEN] = DATA_CNF_LEN - MSG_HEADER_LEN;
+		cnf[DATA_CNF_HANDLE] = buf[DATA_REQ_HANDLE];
+		cnf[DATA_CNF_STATUS] = MAC_TRANSACTION_EXPIRED;
+		return DATA_CNF_LEN;
+	}
+
+	state->next_check = now + INDIRECT_EXPIRY_CHECK_MS * 1000000ULL;
+	return 0;
+}
+
+void indirect_reset(struct ca821x_exchange_base *priv)
+{
+	struct indirect_state *state = __atomic_load_n(&priv->indirect,
+	                                               __ATOMIC_ACQUIRE);
+	struct indirect_dest *dest;
+
+	if (!state) return;
+
+	memset(state->handle_dest, 0, sizeof(state->handle_dest));
+	state->on_chip = 0;
+
+	while ((dest = state->dests))
+	{
+		state->dests = dest->next;
+		reseat_queue(&dest->frames, &priv->restore_out_buffer_queue,
+		             &priv->out_queue_mutex, &priv->out_queue_mutex);
+		free(dest);
+	}
+	out_queue_unhold(priv, __atomic_exchange_n(&state->stats.queued, 0,
+	                                           __ATOMIC_RELAXED));
+	update_counts(state);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_INDIRECT_H
+#define CA821X_INDIRECT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+/** How often frames held by the host are checked for expiry, in milliseconds */
+#define INDIRECT_EXPIRY_CHECK_MS 10
+
+//Indirect frames for one destination
+struct indirect_dest
+{
+	uint8_t addr_mode;
+	uint8_t panid[2];
+	uint8_t addr[8];
+	struct buffer_queue *frames; //!< Protected by the out queue mutex
+	size_t queued;
+	unsigned int on_chip;
+	struct indirect_dest *next;
+};
+
+//Host indirect queue of a device. Apart from the configuration and the
+//statistics, the state is only used by the device's io thread.
+struct indirect_state
+{
+	unsigned int chip_slots; //!< 0 when the host queue is disabled
+	unsigned int persistence_ms;
+	unsigned int on_chip;
+	struct indirect_dest *dests; //!< In the order they are next served
+	struct indirect_dest *handle_dest[256]; //!< Destination of frames on chip
+	uint64_t next_check;
+	struct ca821x_indirect_stats stats;
+};
+
+struct indirect_state *indirect_create(void);
+
+//Free the state of a device, dropping any frames held by the host
+void indirect_destroy(struct ca821x_exchange_base *priv);
+
+//Decide whether a message popped from the out queue can be written now.
+//Returns 1 if so, or 0 if it is an indirect data request that the host is
+//holding until the ca821x has room for it.
+int indirect_admit(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                   size_t len, struct ca821x_dev *pDeviceRef);
+
+//Pop a held indirect frame if the ca821x has room for it, otherwise return 0.
+//Destinations without a frame on the ca821x are served first, in turn.
+size_t indirect_release(struct ca821x_exchange_base *priv,
+                        uint8_t *destBuf,
+                        size_t maxlen,
+                        struct ca821x_dev **pDeviceRef_out,
+                        uint64_t *timestamp_out);
+
+//Free the slot of an indirect frame once its confirm has been read
+void indirect_observe(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                      size_t len);
+
+//Drop one frame that the host has held for longer than the persistence time,
+//writing the MCPS_DATA_confirm that the ca821x would have sent for it into
+//cnf. Returns the length of the confirm, or 0 if nothing has expired.
+size_t indirect_expire(struct ca821x_exchange_base *priv, uint8_t *cnf,
+                       struct ca821x_dev **pDeviceRef_out);
+
+//Forget the frames on the ca821x after it has failed, and move the held
+//frames onto the restore queue along with the rest of the out queue
+void indirect_reset(struct ca821x_exchange_base *priv);
+
+#endif
@@ -0,0 +1,420 @@
+/**
+ * @file ca821x-merge.c
+ * @brief Time-ordered merge of messages from several devices
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-generic-exchange.h"
+#include "ca821x-merge.h"
+#include "ca821x-stats.h"
+
+struct merge_msg
+{
+	struct merge_msg *next;
+	struct ca821x_dev *pDeviceRef;
+	uint64_t timestamp;
+	size_t len;
+	uint8_t buf[];
+};
+
+struct merge_source
+{
+	struct ca821x_dev *pDeviceRef;
+	struct merge_msg *head, *tail; //!< In the order they were read
+	int removed; //!< No longer fed, and freed once emptied
+};
+
+struct ca821x_merge
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	exchange_merge_callback callback;
+	void *context;
+	uint64_t window_ns;
+
+	struct merge_source **sources;
+	size_t source_count;
+	size_t fed_count; //!< Sources that haven't been removed
+
+	//Min-heap of the sources holding messages, keyed by their oldest message
+	struct merge_source **heap;
+	size_t heap_count;
+
+	uint64_t last_timestamp; //!< Of the last message delivered
+	struct ca821x_merge_stats stats;
+};
+
+static int heap_less(struct ca821x_merge *merge, size_t a, size_t b)
+{
+	return merge->heap[a]->head->timestamp < merge->heap[b]->head->timestamp;
+}
+
+static void heap_swap(struct ca821x_merge *merge, size_t a, size_t b)
+{
+	struct merge_source *tmp = merge->heap[a];
+
+	merge->heap[a] = merge->heap[b];
+	merge->heap[b] = tmp;
+}
+
+static void heap_push(struct ca821x_merge *merge, struct merge_source *source)
+{
+	size_t i = merge->heap_count++;
+
+	merge->heap[i] = source;
+	while (i && heap_less(merge, i, (i - 1) / 2))
+	{
+		heap_swap(merge, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_pop(struct ca821x_merge *merge)
+{
+	size_t i = 0, child;
+
+	merge->heap[0] = merge->heap[--merge->heap_count];
+	while ((child = 2 * i + 1) < merge->heap_count)
+	{
+		if (child + 1 < merge->heap_count && heap_less(merge, child + 1, child))
+			child++;
+		if (!heap_less(merge, child, i)) break;
+		heap_swap(merge, i, child);
+		i = child;
+	}
+}
+
+//Must be called with the merge mutex held
+static struct merge_source *find_source(struct ca821x_merge *merge,
+                                        struct ca821x_dev *pDeviceRef)
+{
+	for (size_t i = 0; i < merge->source_count; i++)
+	{
+		if (merge->sources[i]->pDeviceRef == pDeviceRef &&
+		    !merge->sources[i]->removed)
+		{
+			return merge->sources[i];
+		}
+	}
+	return NULL;
+}
+
+//Must be called with the merge mutex held
+static void free_source(struct ca821x_merge *merge, struct merge_source *source)
+{
+	for (size_t i = 0; i < merge->source_count; i++)
+	{
+		if (merge->sources[i] != source) continue;
+
+		merge->sources[i] = merge->sources[--merge->source_count];
+		break;
+	}
+	free(source);
+}
+
+//Whether the oldest held message can be delivered. It can once it has been
+//held for the reorder window, or as soon as every device has something held,
+//as nothing older can still arrive. Must be called with the merge mutex held.
+static int oldest_ready(struct ca821x_merge *merge, uint64_t *deadline_out)
+{
+	struct merge_source *source = merge->heap[0];
+	size_t fed_holding = 0;
+
+	*deadline_out = source->head->timestamp + merge->window_ns;
+	if (!merge->running || source->removed) return 1;
+	if (get_time_ns() >= *deadline_out) return 1;
+
+	for (size_t i = 0; i < merge->heap_count; i++)
+	{
+		if (!merge->heap[i]->removed) fed_holding++;
+	}
+	return fed_holding == merge->fed_count;
+}
+
+static void wait_until(struct ca821x_merge *merge, uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	pthread_cond_timedwait(&merge->cond, &merge->mutex, &ts);
+}
+
+static void *merge_worker(void *arg)
+{
+	struct ca821x_merge *merge = arg;
+	struct merge_source *source;
+	struct merge_msg *msg;
+	uint64_t deadline;
+	int rval;
+
+	pthread_mutex_lock(&merge->mutex);
+	while (merge->running || merge->heap_count)
+	{
+		if (!merge->heap_count)
+		{
+			pthread_cond_wait(&merge->cond, &merge->mutex);
+			continue;
+		}
+
+		if (!oldest_ready(merge, &deadline))
+		{
+			wait_until(merge, deadline);
+			continue;
+		}
+
+		source = merge->heap[0];
+		msg = source->head;
+		source->head = msg->next;
+		heap_pop(merge);
+		if (source->head)
+			heap_push(merge, source);
+		else
+		{
+			source->tail = NULL;
+			if (source->removed) free_source(merge, source);
+		}
+
+		merge->stats.held--;
+		merge->stats.merged++;
+		if (msg->timestamp < merge->last_timestamp)
+			merge->stats.late++;
+		else
+			merge->last_timestamp = msg->timestamp;
+		pthread_mutex_unlock(&merge->mutex);
+
+		rval = -1;
+		if (merge->callback)
+		{
+			rval = merge->callback(msg->buf, msg->len, msg->timestamp,
+			                       msg->pDeviceRef, merge->context);
+		}
+		if (rval < 0)
+			exchange_queue_downstream(msg->buf, msg->len, msg->pDeviceRef);
+		free(msg);
+
+		pthread_mutex_lock(&merge->mutex);
+	}
+	pthread_mutex_unlock(&merge->mutex);
+
+	return NULL;
+}
+
+int merge_add(struct ca821x_merge *merge, const uint8_t *buf, size_t len,
+              struct ca821x_dev *pDeviceRef, uint64_t timestamp)
+{
+	struct merge_source *source;
+	struct merge_msg *msg;
+
+	msg = malloc(sizeof(*msg) + len);
+	if (!msg) return -1;
+	msg->next = NULL;
+	msg->pDeviceRef = pDeviceRef;
+	msg->timestamp = timestamp;
+	msg->len = len;
+	memcpy(msg->buf, buf, len);
+
+	pthread_mutex_lock(&merge->mutex);
+	source = find_source(merge, pDeviceRef);
+	if (!source)
+	{
+		pthread_mutex_unlock(&merge->mutex);
+		free(msg);
+		return -1;
+	}
+
+	if (source->tail)
+	{
+		source->tail->next = msg;
+		source->tail = msg;
+	}
+	else
+	{
+		source->head = source->tail = msg;
+		heap_push(merge, source);
+	}
+
+	merge->stats.held++;
+	if (merge->stats.held > merge->stats.max_held)
+		merge->stats.max_held = merge->stats.held;
+	pthread_cond_signal(&merge->cond);
+	pthread_mutex_unlock(&merge->mutex);
+	return 0;
+}
+
+struct ca821x_merge *exchange_merge_create(exchange_merge_callback callback,
+                                           unsigned int window_us,
+                                           void *context)
+{
+	struct ca821x_merge *merge = calloc(1, sizeof(struct ca821x_merge));
+	pthread_condattr_t condattr;
+
+	if (!merge) return NULL;
+
+	merge->callback = callback;
+	merge->context = context;
+	merge->window_ns = (window_us ? window_us : CA821X_MERGE_WINDOW_US) * 1000ULL;
+	merge->running = 1;
+
+	pthread_mutex_init(&merge->mutex, NULL);
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&merge->cond, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	if (pthread_create(&merge->thread, NULL, &merge_worker, merge))
+	{
+		pthread_cond_destroy(&merge->cond);
+		pthread_mutex_destroy(&merge->mutex);
+		free(merge);
+		return NULL;
+	}
+	return merge;
+}
+
+void exchange_merge_destroy(struct ca821x_merge *merge)
+{
+	if (!merge) return;
+
+	pthread_mutex_lock(&merge->mutex);
+	while (merge->fed_count)
+	{
+		for (size_t i = 0; i < merge->source_count; i++)
+		{
+			if (merge->sources[i]->removed) continue;
+
+			pthread_mutex_unlock(&merge->mutex);
+			exchange_merge_remove(merge, merge->sources[i]->pDeviceRef);
+			pthread_mutex_lock(&merge->mutex);
+			break;
+		}
+	}
+
+	//The worker delivers anything still held before it stops
+	merge->running = 0;
+	pthread_cond_signal(&merge->cond);
+	pthread_mutex_unlock(&merge->mutex);
+	pthread_join(merge->thread, NULL);
+
+	pthread_cond_destroy(&merge->cond);
+	pthread_mutex_destroy(&merge->mutex);
+	free(merge->sources);
+	free(merge->heap);
+	free(merge);
+}
+
+int exchange_merge_add(struct ca821x_merge *merge, struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct merge_source **sources, **heap;
+	struct merge_source *source;
+	size_t count;
+	int error = 0;
+
+	if (!priv) return -1;
+
+	pthread_mutex_lock(&merge->mutex);
+	if (priv->merge)
+	{
+		error = -1;
+		goto exit;
+	}
+
+	source = calloc(1, sizeof(*source));
+	count = merge->source_count + 1;
+	sources = realloc(merge->sources, count * sizeof(*sources));
+	if (sources) merge->sources = sources;
+	heap = realloc(merge->heap, count * sizeof(*heap));
+	if (heap) merge->heap = heap;
+	if (!source || !sources || !heap)
+	{
+		free(source);
+		error = -1;
+		goto exit;
+	}
+
+	source->pDeviceRef = pDeviceRef;
+	merge->sources[merge->source_count++] = source;
+	merge->fed_count++;
+
+	__atomic_store_n(&priv->merge, merge, __ATOMIC_RELEASE);
+
+exit:
+	pthread_mutex_unlock(&merge->mutex);
+	return error;
+}
+
+int exchange_merge_remove(struct ca821x_merge *merge,
+                          struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct merge_source *source;
+
+	pthread_mutex_lock(&merge->mutex);
+	source = find_source(merge, pDeviceRef);
+	if (!source)
+	{
+		pthread_mutex_unlock(&merge->mutex);
+		return -1;
+	}
+
+	if (priv) __atomic_store_n(&priv->merge, NULL, __ATOMIC_RELEASE);
+
+	//Anything still held is delivered without waiting for the window
+	merge->fed_count--;
+	if (source->head)
+		source->removed = 1;
+	else
+		free_source(merge, source);
+	pthread_cond_signal(&merge->cond);
+	pthread_mutex_unlock(&merge->mutex);
+	return 0;
+}
+
+int exchange_get_merge_stats(struct ca821x_merge *merge,
+                             struct ca821x_merge_stats *stats_out)
+{
+	if (!merge) return -1;
+
+	pthread_mutex_lock(&merge->mutex);
+	*stats_out = merge->stats;
+	pthread_mutex_unlock(&merge->mutex);
+	return 0;
+}
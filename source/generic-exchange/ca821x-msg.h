@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Offsets of fields within raw ca821x SPI messages, for the parts of the
+ * exchange that need to look inside messages without fully parsing them.
+ * Every message starts with a command ID byte and a length byte, which counts
+ * the bytes that follow it.
+ */
+
+#ifndef CA821X_MSG_H
+#define CA821X_MSG_H
+
+#define MSG_CMD 0
+#define MSG_LEN 1
+#define MSG_HEADER_LEN 2
+
+/* Command ID of the debug strings that the firmware prints */
+#define MSG_DEBUG_STRING 0xA0
+
+/* MLME_SET_request */
+#define SET_REQ_ATTR 2
+#define SET_REQ_INDEX 3
+#define SET_REQ_ATTRLEN 4
+#define SET_REQ_VALUE 5
+
+/* HWME_SET_request */
+#define HWME_SET_REQ_ATTR 2
+#define HWME_SET_REQ_ATTRLEN 3
+#define HWME_SET_REQ_VALUE 4
+
+/* MLME_GET_request */
+#define GET_REQ_ATTR 2
+#define GET_REQ_INDEX 3
+
+/* MLME_GET_confirm */
+#define GET_CNF_STATUS 2
+#define GET_CNF_ATTR 3
+#define GET_CNF_INDEX 4
+#define GET_CNF_ATTRLEN 5
+#define GET_CNF_VALUE 6
+
+/* MLME_SET_confirm, HWME_SET_confirm and other status-only confirms */
+#define CNF_STATUS 2
+
+/* MLME_RESET_request */
+#define RESET_REQ_SETDEFAULTPIB 2
+
+/* Length of a device address, given its addressing mode. Uses the MAC_MODE_
+ * constants of ca821x_api.h. */
+#define MSG_ADDR_LEN(mode) \
+	((mode) == MAC_MODE_SHORT_ADDR ? 2 : (mode) == MAC_MODE_LONG_ADDR ? 8 : 0)
+
+/* MCPS_DATA_request */
+#define DATA_REQ_SRCADDRMODE 2
+#define DATA_REQ_DSTADDRMODE 3
+#define DATA_REQ_DSTPANID 4
+#define DATA_REQ_DSTADDR 6
+#define DATA_REQ_MSDULEN 14
+#define DATA_REQ_HANDLE 15
+#define DATA_REQ_TXOPTIONS 16
+#define DATA_REQ_TXOPT_INDIRECT 0x04
+
+/* MCPS_DATA_indication */
+#define DATA_IND_SRCADDRMODE 2
+#define DATA_IND_SRCPANID 3
+#define DATA_IND_SRCADDR 5
+
+/* MCPS_DATA_confirm and MCPS_PURGE_confirm */
+#define DATA_CNF_HANDLE 2
+#define DATA_CNF_STATUS 3
+#define DATA_CNF_TIMESTAMP 4
+#define DATA_CNF_LEN 8
+
+#endif
@@ -0,0 +1,294 @@
+/**
+ * @file ca821x-out-queue.c
+ * @brief Priority classes of the out queue
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ca821x-generic-exchange.h"
+#include "ca821x-msg.h"
+#include "ca821x-out-queue.h"
+#include "ca821x-queue.h"
+#include "ca821x_api.h"
+
+enum ca821x_out_class out_queue_classify(const uint8_t *buf, int synchronous)
+{
+	uint8_t cmd = buf[MSG_CMD] & ~SPI_SYN;
+
+	if (synchronous) return ca821x_out_sync;
+	if (cmd == (SPI_MCPS_DATA_REQUEST & ~SPI_SYN) ||
+	    cmd == (SPI_MCPS_PURGE_REQUEST & ~SPI_SYN))
+		return ca821x_out_data;
+	//All of the other host to device primitives are below SPI_S2M
+	if (!(cmd & SPI_S2M)) return ca821x_out_mgmt;
+	return ca821x_out_user;
+}
+
+//Claim a place in a class, returning the new depth or 0 if it is full
+static uint64_t try_reserve(struct ca821x_exchange_base *priv,
+                            enum ca821x_out_class out_class)
+{
+	struct ca821x_out_class_stats *stats = &priv->out_stats[out_class];
+	size_t capacity = __atomic_load_n(&priv->out_capacity, __ATOMIC_RELAXED);
+	uint64_t depth = __atomic_load_n(&stats->depth, __ATOMIC_RELAXED);
+	uint64_t held = 0;
+
+	//Only a handful of sync commands can ever be queued, and they must not be
+	//held up behind the other classes
+	if (out_class == ca821x_out_sync) capacity = 0;
+	//Data requests the host is holding back are still waiting to be sent. The
+	//io thread holds a request just after popping it, so the class can briefly
+	//hold one more than its capacity.
+	if (out_class == ca821x_out_data)
+		held = __atomic_load_n(&priv->out_held, __ATOMIC_RELAXED);
+
+	do
+	{
+		if (capacity && depth + held >= capacity) return 0;
+	} while (!__atomic_compare_exchange_n(&stats->depth, &depth, depth + 1, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return depth + 1;
+}
+
+//Wait up to the out queue timeout for a place in a class, returning the new
+//depth or 0 if none became free
+static uint64_t wait_reserve(struct ca821x_exchange_base *priv,
+                             enum ca821x_out_class out_class)
+{
+	int timeout_ms = __atomic_load_n(&priv->out_timeout_ms, __ATOMIC_RELAXED);
+	struct timespec deadline;
+	uint64_t depth = 0;
+	int rval = 0;
+
+	if (timeout_ms <= 0) return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	//The io thread signals after each pop with the mutex held, so checking the
+	//depth under the mutex can't miss a wakeup
+	pthread_mutex_lock(&priv->out_queue_mutex);
+	while (!(depth = try_reserve(priv, out_class)) && rval != ETIMEDOUT)
+	{
+		rval = pthread_cond_timedwait(&priv->out_space_cond,
+		                              &priv->out_queue_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&priv->out_queue_mutex);
+
+	return depth;
+}
+
+//Let producers waiting for space know that some may have been freed
+static void signal_space(struct ca821x_exchange_base *priv)
+{
+	if (!__atomic_load_n(&priv->out_capacity, __ATOMIC_RELAXED)) return;
+
+	pthread_mutex_lock(&priv->out_queue_mutex);
+	pthread_cond_broadcast(&priv->out_space_cond);
+	pthread_mutex_unlock(&priv->out_queue_mutex);
+}
+
+int out_queue_add(struct ca821x_exchange_base *priv,
+                  enum ca821x_out_class out_class,
+                  const uint8_t *buf,
+                  size_t len,
+                  struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_out_class_stats *stats = &priv->out_stats[out_class];
+	uint64_t depth, max;
+
+	//Count the message before it is visible, so that the depth can never be
+	//decremented below zero by the io thread popping it.
+	depth = try_reserve(priv, out_class);
+	if (!depth) depth = wait_reserve(priv, out_class);
+	if (!depth)
+	{
+		__atomic_fetch_add(&stats->rejected, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	__atomic_fetch_add(&stats->total, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&stats->max_depth, __ATOMIC_RELAXED);
+	while (depth > max &&
+	       !__atomic_compare_exchange_n(&stats->max_depth, &max, depth, 1,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	add_to_queue(&priv->out_buffer_queue[out_class], &priv->out_queue_mutex,
+	             buf, len, pDeviceRef);
+	return 0;
+}
+
+size_t out_queue_pop(struct ca821x_exchange_base *priv,
+                     uint8_t *destBuf,
+                     size_t maxlen,
+                     struct ca821x_dev **pDeviceRef_out,
+                     uint64_t *timestamp_out)
+{
+	uint64_t depth[ca821x_out_class_count];
+	int highest = -1, chosen = -1;
+	size_t len;
+
+	for (int i = 0; i < ca821x_out_class_count; i++)
+	{
+		depth[i] = __atomic_load_n(&priv->out_stats[i].depth, __ATOMIC_ACQUIRE);
+		if (!depth[i]) continue;
+
+		if (highest < 0)
+		{
+			highest = chosen = i;
+		}
+		else if (priv->out_passed[i] >= CA821X_OUT_STARVATION_LIMIT)
+		{
+			chosen = i;
+			break;
+		}
+	}
+
+	if (chosen < 0) return 0;
+
+	len = pop_from_queue_timed(&priv->out_buffer_queue[chosen],
+	                           &priv->out_queue_mutex,
+	                           destBuf, maxlen, pDeviceRef_out, timestamp_out);
+	if (len == 0) return 0;
+
+	__atomic_fetch_sub(&priv->out_stats[chosen].depth, 1, __ATOMIC_RELAXED);
+	signal_space(priv);
+	if (chosen != highest)
+		__atomic_fetch_add(&priv->out_stats[chosen].promoted, 1, __ATOMIC_RELAXED);
+
+	//Everything still waiting in a lower class has been passed over once more
+	priv->out_passed[chosen] = 0;
+	for (int i = chosen + 1; i < ca821x_out_class_count; i++)
+	{
+		if (depth[i]) priv->out_passed[i]++;
+		else priv->out_passed[i] = 0;
+	}
+
+	return len;
+}
+
+void out_queue_hold(struct ca821x_exchange_base *priv)
+{
+	__atomic_fetch_add(&priv->out_held, 1, __ATOMIC_RELAXED);
+}
+
+void out_queue_unhold(struct ca821x_exchange_base *priv, size_t count)
+{
+	if (!count) return;
+
+	__atomic_fetch_sub(&priv->out_held, count, __ATOMIC_RELAXED);
+	signal_space(priv);
+}
+
+size_t out_queue_pending(struct ca821x_exchange_base *priv)
+{
+	size_t pending = 0;
+
+	for (int i = 0; i < ca821x_out_class_count; i++)
+	{
+		pending += __atomic_load_n(&priv->out_stats[i].depth, __ATOMIC_RELAXED);
+	}
+	return pending;
+}
+
+void out_queue_flush(struct ca821x_exchange_base *priv)
+{
+	size_t count;
+
+	for (int i = 0; i < ca821x_out_class_count; i++)
+	{
+		count = flush_queue(&priv->out_buffer_queue[i], &priv->out_queue_mutex);
+		__atomic_fetch_sub(&priv->out_stats[i].depth, count, __ATOMIC_RELAXED);
+	}
+	signal_space(priv);
+}
+
+void out_queue_reseat(struct ca821x_exchange_base *priv,
+                      struct buffer_queue **dest)
+{
+	size_t count;
+
+	for (int i = 0; i < ca821x_out_class_count; i++)
+	{
+		count = reseat_queue(&priv->out_buffer_queue[i], dest,
+		                     &priv->out_queue_mutex, &priv->out_queue_mutex);
+		__atomic_fetch_sub(&priv->out_stats[i].depth, count, __ATOMIC_RELAXED);
+	}
+	signal_space(priv);
+}
+
+size_t out_queue_restore(struct ca821x_exchange_base *priv,
+                         struct buffer_queue **src,
+                         size_t *dropped_out)
+{
+	struct buffer_queue *pending = NULL;
+	enum ca821x_out_class out_class;
+	struct ca821x_dev *pDeviceRef;
+	uint8_t buf[MAX_BUF_SIZE];
+	size_t len, restored = 0;
+
+	reseat_queue(src, &pending, &priv->out_queue_mutex, &priv->out_queue_mutex);
+	while (pending)
+	{
+		len = pop_from_queue(&pending, &priv->out_queue_mutex, buf, sizeof(buf),
+		                     &pDeviceRef);
+		if (!len) continue;
+
+		if (buf[MSG_CMD] & SPI_SYN)
+		{
+			(*dropped_out)++;
+			continue;
+		}
+
+		//Counted before it is visible, as in out_queue_add
+		out_class = out_queue_classify(buf, 0);
+		__atomic_fetch_add(&priv->out_stats[out_class].depth, 1,
+		                   __ATOMIC_RELEASE);
+		add_to_queue(&priv->out_buffer_queue[out_class], &priv->out_queue_mutex,
+		             buf, len, pDeviceRef);
+		restored++;
+	}
+
+	return restored;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_OUT_QUEUE_H
+#define CA821X_OUT_QUEUE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+//Pick the priority class of a message. 'synchronous' is nonzero if the caller
+//waits for the response.
+enum ca821x_out_class out_queue_classify(const uint8_t *buf, int synchronous);
+
+//Add a message to the end of one class of a device's out queue. If the class
+//is full, wait up to the device's out queue timeout for space. Synchronous
+//commands are never limited. Returns 0 for success, -1 if there was no space.
+int out_queue_add(struct ca821x_exchange_base *priv,
+                   enum ca821x_out_class out_class,
+                   const uint8_t *buf,
+                   size_t len,
+                   struct ca821x_dev *pDeviceRef);
+
+//Pop the next message to send: the oldest of the highest priority class,
+//unless a lower class has been passed over CA821X_OUT_STARVATION_LIMIT times.
+//Must only be called from the device's io thread.
+size_t out_queue_pop(struct ca821x_exchange_base *priv,
+                     uint8_t *destBuf,
+                     size_t maxlen,
+                     struct ca821x_dev **pDeviceRef_out,
+                     uint64_t *timestamp_out);
+
+//Count a popped data request that the io thread is holding back against the
+//capacity of the data class, until it is released with out_queue_unhold
+void out_queue_hold(struct ca821x_exchange_base *priv);
+
+//Stop counting held data requests once they are sent, dropped or restored
+void out_queue_unhold(struct ca821x_exchange_base *priv, size_t count);
+
+//Non-blocking function returning the number of messages waiting to be sent
+size_t out_queue_pending(struct ca821x_exchange_base *priv);
+
+//Empty every class into nothing
+void out_queue_flush(struct ca821x_exchange_base *priv);
+
+//Move every class, highest priority first, onto the end of another queue that
+//is protected by the out queue mutex
+void out_queue_reseat(struct ca821x_exchange_base *priv,
+                      struct buffer_queue **dest);
+
+//Put the messages of a queue protected by the out queue mutex back into their
+//classes, in order and regardless of capacity. Synchronous requests are
+//dropped, as their callers resend them. Returns the number put back, and adds
+//the number dropped to dropped_out.
+size_t out_queue_restore(struct ca821x_exchange_base *priv,
+                         struct buffer_queue **src,
+                         size_t *dropped_out);
+
+#endif
@@ -0,0 +1,350 @@
+/**
+ * @file ca821x-pib.c
+ * @brief Host-side shadow of the ca821x PIB
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ca821x_api.h"
+#include "ca821x-msg.h"
+#include "ca821x-pib.h"
+
+//Attributes that the ca821x changes by itself, and so can never be cached
+static int is_volatile_attribute(uint8_t attribute)
+{
+	switch (attribute)
+	{
+	case macDSN:
+	case macBSN:
+	case macFrameCounter:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+//Messages after which the ca821x may have changed PIB values itself
+static int invalidates_pib(uint8_t command_id)
+{
+	switch (command_id)
+	{
+	case SPI_MLME_RESET_REQUEST:
+	case SPI_MLME_START_REQUEST:
+	case SPI_MLME_SCAN_REQUEST:
+	case SPI_MLME_ASSOCIATE_REQUEST:
+	case SPI_MLME_DISASSOCIATE_REQUEST:
+	case SPI_MLME_ASSOCIATE_CONFIRM:
+	case SPI_MLME_DISASSOCIATE_CONFIRM:
+	case SPI_MLME_DISASSOCIATE_INDICATION:
+	case SPI_MLME_SCAN_CONFIRM:
+	case SPI_MLME_SYNC_LOSS_INDICATION:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+//Must be called with the cache mutex held
+static void store(struct pib_cache *cache, uint8_t attribute, uint8_t index,
+                  uint8_t len, const uint8_t *value)
+{
+	struct pib_cache_entry *entry = &cache->entries[attribute];
+
+	if (index != 0 || len > PIB_CACHE_MAX_LEN || is_volatile_attribute(attribute))
+	{
+		//Table attributes and large values aren't cached, but must not be
+		//answered from a stale entry either.
+		entry->valid = 0;
+		return;
+	}
+
+	entry->valid = 1;
+	entry->len = len;
+	memcpy(entry->value, value, len);
+}
+
+struct pib_cache *pib_cache_create(void)
+{
+	struct pib_cache *cache = calloc(1, sizeof(struct pib_cache));
+
+	if (cache) pthread_mutex_init(&cache->mutex, NULL);
+	return cache;
+}
+
+void pib_cache_destroy(struct pib_cache *cache)
+{
+	if (!cache) return;
+
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+void pib_cache_invalidate(struct pib_cache *cache)
+{
+	pthread_mutex_lock(&cache->mutex);
+	for (int i = 0; i < 256; i++)
+	{
+		cache->entries[i].valid = 0;
+	}
+	cache->stats.invalidations++;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+int pib_cache_lookup(struct pib_cache *cache, const uint8_t *req,
+                     uint8_t *response)
+{
+	struct pib_cache_entry *entry;
+	int hit = 0;
+
+	if (req[MSG_CMD] != SPI_MLME_GET_REQUEST) return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (!cache->enabled) goto exit;
+
+	entry = &cache->entries[req[GET_REQ_ATTR]];
+	if (req[GET_REQ_INDEX] == 0 && entry->valid)
+	{
+		response[MSG_CMD] = SPI_MLME_GET_CONFIRM;
+		response[MSG_LEN] = GET_CNF_VALUE - MSG_HEADER_LEN + entry->len;
+		response[GET_CNF_STATUS] = MAC_SUCCESS;
+		response[GET_CNF_ATTR] = req[GET_REQ_ATTR];
+		response[GET_CNF_INDEX] = 0;
+		response[GET_CNF_ATTRLEN] = entry->len;
+		memcpy(&response[GET_CNF_VALUE], entry->value, entry->len);
+		cache->stats.hits++;
+		hit = 1;
+	}
+	else
+	{
+		cache->stats.misses++;
+	}
+
+exit:
+	pthread_mutex_unlock(&cache->mutex);
+	return hit;
+}
+
+void pib_cache_observe_sync(struct pib_cache *cache, const uint8_t *req,
+                            const uint8_t *response)
+{
+	if (invalidates_pib(req[MSG_CMD]))
+	{
+		pib_cache_invalidate(cache);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	if (req[MSG_CMD] == SPI_MLME_SET_REQUEST && response[MSG_CMD] == SPI_MLME_SET_CONFIRM)
+	{
+		if (response[CNF_STATUS] == MAC_SUCCESS)
+		{
+			store(cache, req[SET_REQ_ATTR], req[SET_REQ_INDEX],
+			      req[SET_REQ_ATTRLEN], &req[SET_REQ_VALUE]);
+		}
+		else
+		{
+			cache->entries[req[SET_REQ_ATTR]].valid = 0;
+		}
+	}
+	else if (req[MSG_CMD] == SPI_MLME_GET_REQUEST &&
+	         response[MSG_CMD] == SPI_MLME_GET_CONFIRM &&
+	         response[GET_CNF_STATUS] == MAC_SUCCESS)
+	{
+		store(cache, response[GET_CNF_ATTR], response[GET_CNF_INDEX],
+		      response[GET_CNF_ATTRLEN], &response[GET_CNF_VALUE]);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void pib_cache_observe_async(struct pib_cache *cache, const uint8_t *msg)
+{
+	if (invalidates_pib(msg[MSG_CMD])) pib_cache_invalidate(cache);
+}
+
+//Must be called with the shadow mutex held
+static void shadow_record(struct pib_shadow *shadow, enum ca821x_pib_type type,
+                          uint8_t attribute, uint8_t index, uint8_t len,
+                          const uint8_t *value)
+{
+	struct pib_shadow_entry entry, *entries;
+	size_t i;
+
+	entry.value = malloc(len ? len : 1);
+	if (!entry.value) return;
+	entry.type = type;
+	entry.attribute = attribute;
+	entry.index = index;
+	entry.len = len;
+	memcpy(entry.value, value, len);
+
+	//Drop any older value of the same attribute, so that the shadow stays in
+	//the order that values were last applied in.
+	for (i = 0; i < shadow->count; i++)
+	{
+		if (shadow->entries[i].type == type &&
+		    shadow->entries[i].attribute == attribute &&
+		    shadow->entries[i].index == index)
+		{
+			free(shadow->entries[i].value);
+			memmove(&shadow->entries[i], &shadow->entries[i + 1],
+			        (shadow->count - i - 1) * sizeof(entry));
+			shadow->count--;
+			break;
+		}
+	}
+
+	if (shadow->count == shadow->capacity)
+	{
+		size_t capacity = shadow->capacity ? shadow->capacity * 2 : 16;
+
+		entries = realloc(shadow->entries, capacity * sizeof(entry));
+		if (!entries)
+		{
+			free(entry.value);
+			return;
+		}
+		shadow->entries = entries;
+		shadow->capacity = capacity;
+	}
+
+	shadow->entries[shadow->count++] = entry;
+}
+
+//Must be called with the shadow mutex held
+static void shadow_clear(struct pib_shadow *shadow)
+{
+	for (size_t i = 0; i < shadow->count; i++)
+	{
+		free(shadow->entries[i].value);
+	}
+	shadow->count = 0;
+}
+
+struct pib_shadow *pib_shadow_create(void)
+{
+	struct pib_shadow *shadow = calloc(1, sizeof(struct pib_shadow));
+
+	if (shadow) pthread_mutex_init(&shadow->mutex, NULL);
+	return shadow;
+}
+
+void pib_shadow_destroy(struct pib_shadow *shadow)
+{
+	if (!shadow) return;
+
+	shadow_clear(shadow);
+	free(shadow->entries);
+	pthread_mutex_destroy(&shadow->mutex);
+	free(shadow);
+}
+
+void pib_shadow_clear(struct pib_shadow *shadow)
+{
+	pthread_mutex_lock(&shadow->mutex);
+	shadow_clear(shadow);
+	pthread_mutex_unlock(&shadow->mutex);
+}
+
+void pib_shadow_observe_sync(struct pib_shadow *shadow, const uint8_t *req,
+                             const uint8_t *response)
+{
+	pthread_mutex_lock(&shadow->mutex);
+	if (!shadow->enabled) goto exit;
+
+	if (req[MSG_CMD] == SPI_MLME_SET_REQUEST &&
+	    response[MSG_CMD] == SPI_MLME_SET_CONFIRM &&
+	    response[CNF_STATUS] == MAC_SUCCESS)
+	{
+		shadow_record(shadow, ca821x_pib_mlme, req[SET_REQ_ATTR],
+		              req[SET_REQ_INDEX], req[SET_REQ_ATTRLEN],
+		              &req[SET_REQ_VALUE]);
+	}
+	else if (req[MSG_CMD] == SPI_HWME_SET_REQUEST &&
+	         response[MSG_CMD] == SPI_HWME_SET_CONFIRM &&
+	         response[CNF_STATUS] == MAC_SUCCESS)
+	{
+		shadow_record(shadow, ca821x_pib_hwme, req[HWME_SET_REQ_ATTR], 0,
+		              req[HWME_SET_REQ_ATTRLEN], &req[HWME_SET_REQ_VALUE]);
+	}
+	else if (req[MSG_CMD] == SPI_MLME_RESET_REQUEST &&
+	         req[RESET_REQ_SETDEFAULTPIB])
+	{
+		//Everything set so far has been returned to its default
+		shadow_clear(shadow);
+	}
+
+exit:
+	pthread_mutex_unlock(&shadow->mutex);
+}
+
+struct ca821x_pib_setting *pib_shadow_snapshot(struct pib_shadow *shadow,
+                                               size_t *count_out)
+{
+	struct ca821x_pib_setting *settings = NULL;
+	uint8_t *values;
+	size_t size, i;
+
+	*count_out = 0;
+
+	pthread_mutex_lock(&shadow->mutex);
+	if (!shadow->count) goto exit;
+
+	size = shadow->count * sizeof(struct ca821x_pib_setting);
+	for (i = 0; i < shadow->count; i++)
+	{
+		size += shadow->entries[i].len;
+	}
+
+	settings = malloc(size);
+	if (!settings) goto exit;
+
+	values = (uint8_t *)&settings[shadow->count];
+	for (i = 0; i < shadow->count; i++)
+	{
+		struct pib_shadow_entry *entry = &shadow->entries[i];
+
+		memcpy(values, entry->value, entry->len);
+		settings[i].type = entry->type;
+		settings[i].attribute = entry->attribute;
+		settings[i].index = entry->index;
+		settings[i].length = entry->len;
+		settings[i].value = values;
+		settings[i].status = MAC_SUCCESS;
+		values += entry->len;
+	}
+	*count_out = shadow->count;
+
+exit:
+	pthread_mutex_unlock(&shadow->mutex);
+	return settings;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_PIB_H
+#define CA821X_PIB_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+/** Largest attribute value held by the PIB cache. Longer ones aren't cached. */
+#define PIB_CACHE_MAX_LEN 16
+
+struct pib_cache_entry
+{
+	uint8_t valid;
+	uint8_t len;
+	uint8_t value[PIB_CACHE_MAX_LEN];
+};
+
+struct pib_cache
+{
+	int enabled;
+	pthread_mutex_t mutex;
+	struct pib_cache_entry entries[256]; //!< Indexed by attribute ID
+	struct ca821x_pib_cache_stats stats;
+};
+
+struct pib_shadow_entry
+{
+	enum ca821x_pib_type type;
+	uint8_t attribute;
+	uint8_t index;
+	uint8_t len;
+	uint8_t *value;
+};
+
+struct pib_shadow
+{
+	int enabled;
+	pthread_mutex_t mutex;
+	struct pib_shadow_entry *entries; //!< In the order they were last set
+	size_t count, capacity;
+};
+
+//Allocate a disabled, empty cache
+struct pib_cache *pib_cache_create(void);
+
+void pib_cache_destroy(struct pib_cache *cache);
+
+//Forget all cached values
+void pib_cache_invalidate(struct pib_cache *cache);
+
+//If 'req' is an MLME_GET_request that can be answered from the cache, build
+//the MLME_GET_confirm in 'response' and return 1. Otherwise return 0.
+int pib_cache_lookup(struct pib_cache *cache, const uint8_t *req,
+                     uint8_t *response);
+
+//Learn from a completed synchronous exchange
+void pib_cache_observe_sync(struct pib_cache *cache, const uint8_t *req,
+                            const uint8_t *response);
+
+//Learn from an asynchronous message sent to or received from the device
+void pib_cache_observe_async(struct pib_cache *cache, const uint8_t *msg);
+
+//Allocate a disabled, empty shadow
+struct pib_shadow *pib_shadow_create(void);
+
+void pib_shadow_destroy(struct pib_shadow *shadow);
+
+//Forget all recorded SETs
+void pib_shadow_clear(struct pib_shadow *shadow);
+
+//Record a successful MLME/HWME SET, or forget everything after an
+//MLME_RESET that restored the default PIB
+void pib_shadow_observe_sync(struct pib_shadow *shadow, const uint8_t *req,
+                             const uint8_t *response);
+
+//Copy the recorded SETs into a single allocation that can be passed to
+//exchange_apply_pib_profile and released with free(). Returns NULL and sets
+//count_out to 0 if there is nothing to replay.
+struct ca821x_pib_setting *pib_shadow_snapshot(struct pib_shadow *shadow,
+                                               size_t *count_out);
+
+#endif
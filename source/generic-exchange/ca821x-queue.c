@@ -35,6 +35,8 @@
 #include <string.h>
 
 #include "ca821x-queue.h"
+#include "ca821x-stats.h"
+#include "ca821x-trace.h"
 
 void add_to_queue(struct buffer_queue **head_buffer_queue,
                          pthread_mutex_t *buf_queue_mutex,
@@ -54,9 +56,57 @@ void add_to_waiting_queue(struct buffer_queue **head_buffer_queue,
                           size_t len,
                           struct ca821x_dev *pDeviceRef)
 {
+	add_to_bounded_queue(head_buffer_queue,
+	                     buf_queue_mutex,
+	                     queue_cond, buf, len, pDeviceRef, 0, 0);
+}
+
+int add_to_bounded_queue(struct buffer_queue **head_buffer_queue,
+                         pthread_mutex_t *buf_queue_mutex,
+                         pthread_cond_t *queue_cond,
+                         const uint8_t *buf,
+                         size_t len,
+                         struct ca821x_dev *pDeviceRef,
+                         size_t capacity,
+                         int drop_newest)
+{
+	int dropped = 0;
+
 	if (pthread_mutex_lock(buf_queue_mutex) == 0)
 	{
 		struct buffer_queue *nextbuf = *head_buffer_queue;
+		struct buffer_queue *oldest;
+		size_t depth = 0;
+
+		if (nextbuf != NULL)
+		{
+			depth++;
+			while (nextbuf->next != NULL)
+			{
+				nextbuf = nextbuf->next;
+				depth++;
+			}
+		}
+
+		if (capacity && depth >= capacity)
+		{
+			dropped = 1;
+			CA821X_TRACE4(drop, pDeviceRef, len ? buf[0] : 0, len,
+			              head_buffer_queue);
+			if (drop_newest)
+			{
+				pthread_mutex_unlock(buf_queue_mutex);
+				return dropped;
+			}
+
+			//Make room by discarding the buffer at the head
+			oldest = *head_buffer_queue;
+			*head_buffer_queue = oldest->next;
+			if (nextbuf == oldest) nextbuf = NULL;
+			free(oldest->buf);
+			free(oldest);
+		}
+
 		if (nextbuf == NULL)
 		{
 			//queue empty -> start new queue
@@ -66,10 +116,6 @@ void add_to_waiting_queue(struct buffer_queue **head_buffer_queue,
 		}
 		else
 		{
-			while (nextbuf->next != NULL)
-			{
-				nextbuf = nextbuf->next;
-			}
 			//allocate new buffer cell
 			nextbuf->next = malloc(sizeof(struct buffer_queue));
 			memset(nextbuf->next, 0, sizeof(struct buffer_queue));
@@ -80,16 +126,22 @@ void add_to_waiting_queue(struct buffer_queue **head_buffer_queue,
 		nextbuf->buf = malloc(len);
 		memcpy(nextbuf->buf, buf, len);
 		nextbuf->pDeviceRef = pDeviceRef;
+		nextbuf->timestamp = get_time_ns();
+		CA821X_TRACE4(enqueue, pDeviceRef, len ? buf[0] : 0, len,
+		              head_buffer_queue);
 		if (queue_cond) pthread_cond_broadcast(queue_cond);
 		pthread_mutex_unlock(buf_queue_mutex);
 	}
+
+	return dropped;
 }
 
-void flush_queue(struct buffer_queue **head_buffer_queue,
-                 pthread_mutex_t *buf_queue_mutex)
+size_t flush_queue(struct buffer_queue **head_buffer_queue,
+                   pthread_mutex_t *buf_queue_mutex)
 {
 	struct ca821x_dev * junkDev;
 	uint8_t *junk;
+	size_t count = 0;
 
 	pthread_mutex_lock(buf_queue_mutex);
 	while(*head_buffer_queue != NULL)
@@ -101,25 +153,58 @@ void flush_queue(struct buffer_queue **head_buffer_queue,
 		               junk,
 		               0,
 		               &junkDev);
+		count++;
 
 		pthread_mutex_lock(buf_queue_mutex);
 	}
 	pthread_mutex_unlock(buf_queue_mutex);
+
+	return count;
 }
 
-void reseat_queue(struct buffer_queue **head_buffer_queue,
-                  struct buffer_queue **head_buffer_queue2,
-                  pthread_mutex_t *buf_queue_mutex,
-                  pthread_mutex_t *buf_queue_mutex2)
+size_t remove_device_from_queue(struct buffer_queue **head_buffer_queue,
+                                pthread_mutex_t *buf_queue_mutex,
+                                const struct ca821x_dev *pDeviceRef)
+{
+	struct buffer_queue **link = head_buffer_queue;
+	struct buffer_queue *current;
+	size_t count = 0;
+
+	pthread_mutex_lock(buf_queue_mutex);
+	while ((current = *link) != NULL)
+	{
+		if (current->pDeviceRef != pDeviceRef)
+		{
+			link = &current->next;
+			continue;
+		}
+
+		*link = current->next;
+		free(current->buf);
+		free(current);
+		count++;
+	}
+	pthread_mutex_unlock(buf_queue_mutex);
+
+	return count;
+}
+
+size_t reseat_queue(struct buffer_queue **head_buffer_queue,
+                    struct buffer_queue **head_buffer_queue2,
+                    pthread_mutex_t *buf_queue_mutex,
+                    pthread_mutex_t *buf_queue_mutex2)
 {
 	struct buffer_queue *tomove;
 	struct buffer_queue *endbuf;
+	size_t count = 0;
 
 	pthread_mutex_lock(buf_queue_mutex);
 	tomove = *head_buffer_queue;
 	*head_buffer_queue = NULL;
 	pthread_mutex_unlock(buf_queue_mutex);
 
+	for (endbuf = tomove; endbuf != NULL; endbuf = endbuf->next) count++;
+
 	pthread_mutex_lock(buf_queue_mutex2);
 	endbuf = *head_buffer_queue2;
 	if (endbuf == NULL)
@@ -137,6 +222,8 @@ void reseat_queue(struct buffer_queue **head_buffer_queue,
 		endbuf->next = tomove;
 	}
 	pthread_mutex_unlock(buf_queue_mutex2);
+
+	return count;
 }
 
 size_t pop_from_queue(struct buffer_queue **head_buffer_queue,
@@ -144,6 +231,17 @@ size_t pop_from_queue(struct buffer_queue **head_buffer_queue,
                       uint8_t * destBuf,
                       size_t maxlen,
                       struct ca821x_dev **pDeviceRef_out)
+{
+	return pop_from_queue_timed(head_buffer_queue, buf_queue_mutex, destBuf,
+	                            maxlen, pDeviceRef_out, NULL);
+}
+
+size_t pop_from_queue_timed(struct buffer_queue **head_buffer_queue,
+                            pthread_mutex_t *buf_queue_mutex,
+                            uint8_t * destBuf,
+                            size_t maxlen,
+                            struct ca821x_dev **pDeviceRef_out,
+                            uint64_t *timestamp_out)
 {
 	if (pthread_mutex_lock(buf_queue_mutex) == 0)
 	{
@@ -154,11 +252,14 @@ size_t pop_from_queue(struct buffer_queue **head_buffer_queue,
 		{
 			*head_buffer_queue = current->next;
 			len = current->len;
+			CA821X_TRACE4(dequeue, current->pDeviceRef,
+			              len ? current->buf[0] : 0, len, head_buffer_queue);
 
 			if (len > maxlen) len = 0; //Invalid
 
 			memcpy(destBuf, current->buf, len);
 			*pDeviceRef_out = current->pDeviceRef;
+			if (timestamp_out) *timestamp_out = current->timestamp;
 
 			free(current->buf);
 			free(current);
@@ -170,6 +271,53 @@ size_t pop_from_queue(struct buffer_queue **head_buffer_queue,
 	return 0;
 }
 
+size_t pop_batch_from_queue(struct buffer_queue **head_buffer_queue,
+                            pthread_mutex_t *buf_queue_mutex,
+                            struct buffer_queue **batch_out,
+                            size_t max)
+{
+	struct buffer_queue *last = NULL;
+	size_t count = 0;
+
+	*batch_out = NULL;
+	if (!max) return 0;
+
+	pthread_mutex_lock(buf_queue_mutex);
+	*batch_out = *head_buffer_queue;
+	for (last = *head_buffer_queue; last != NULL; last = last->next)
+	{
+		CA821X_TRACE4(dequeue, last->pDeviceRef,
+		              last->len ? last->buf[0] : 0, last->len, head_buffer_queue);
+		if (++count == max) break;
+	}
+
+	if (last)
+	{
+		*head_buffer_queue = last->next;
+		last->next = NULL;
+	}
+	else
+	{
+		*head_buffer_queue = NULL;
+	}
+	pthread_mutex_unlock(buf_queue_mutex);
+
+	return count;
+}
+
+void free_batch(struct buffer_queue *batch)
+{
+	struct buffer_queue *next;
+
+	while (batch)
+	{
+		next = batch->next;
+		free(batch->buf);
+		free(batch);
+		batch = next;
+	}
+}
+
 //return the length of the next buffer in the queue if it exists, otherwise 0
 size_t peek_queue(struct buffer_queue * head_buffer_queue,
                   pthread_mutex_t *buf_queue_mutex)
@@ -187,6 +335,22 @@ size_t peek_queue(struct buffer_queue * head_buffer_queue,
 	return in_queue;
 }
 
+size_t queue_depth(struct buffer_queue *const *head_buffer_queue,
+                   pthread_mutex_t *buf_queue_mutex)
+{
+	size_t depth = 0;
+
+	if (pthread_mutex_lock(buf_queue_mutex) == 0)
+	{
+		for (struct buffer_queue *cur = *head_buffer_queue; cur; cur = cur->next)
+		{
+			depth++;
+		}
+		pthread_mutex_unlock(buf_queue_mutex);
+	}
+	return depth;
+}
+
 //return the length of the next buffer in the queue, blocking until
 //it arrives. Returns length of buffer (or -1 upon error).
 size_t wait_on_queue(struct buffer_queue ** head_buffer_queue,
@@ -55,13 +55,33 @@ void add_to_waiting_queue(
 	size_t len,
 	struct ca821x_dev *pDeviceRef);
 
-//Empty a queue into nothing
-void flush_queue(
+//Add a buffer onto the end of a queue that holds at most 'capacity' buffers
+//(0 for no limit). If the queue is full, either the buffer at its head is
+//dropped to make room, or if drop_newest is set, the new buffer is dropped.
+//Returns 1 if a buffer was dropped, otherwise 0.
+int add_to_bounded_queue(
+	struct buffer_queue **head_buffer_queue,
+	pthread_mutex_t *buf_queue_mutex,
+	pthread_cond_t *queue_cond,
+	const uint8_t *buf,
+	size_t len,
+	struct ca821x_dev *pDeviceRef,
+	size_t capacity,
+	int drop_newest);
+
+//Empty a queue into nothing, returning the number of buffers dropped
+size_t flush_queue(
 	struct buffer_queue **head_buffer_queue,
 	pthread_mutex_t *buf_queue_mutex);
 
-//Reseat one queue onto the end of another
-void reseat_queue(
+//Drop the buffers a device has on a queue, returning the number dropped
+size_t remove_device_from_queue(
+	struct buffer_queue **head_buffer_queue,
+	pthread_mutex_t *buf_queue_mutex,
+	const struct ca821x_dev *pDeviceRef);
+
+//Reseat one queue onto the end of another, returning the number of buffers moved
+size_t reseat_queue(
 	struct buffer_queue **head_buffer_queue,
 	struct buffer_queue **head_buffer_queue2,
 	pthread_mutex_t *buf_queue_mutex,
@@ -75,11 +95,36 @@ size_t pop_from_queue(
 	size_t maxlen,
 	struct ca821x_dev **pDeviceRef_out);
 
+//Pop a buffer off a queue, also returning the time at which it was queued
+size_t pop_from_queue_timed(
+	struct buffer_queue **head_buffer_queue,
+	pthread_mutex_t *buf_queue_mutex,
+	uint8_t * destBuf,
+	size_t maxlen,
+	struct ca821x_dev **pDeviceRef_out,
+	uint64_t *timestamp_out);
+
+//Detach up to max buffers from the head of a queue in one go, returning how
+//many were taken. The batch must be released with free_batch.
+size_t pop_batch_from_queue(
+	struct buffer_queue **head_buffer_queue,
+	pthread_mutex_t *buf_queue_mutex,
+	struct buffer_queue **batch_out,
+	size_t max);
+
+//Free a batch taken with pop_batch_from_queue
+void free_batch(struct buffer_queue *batch);
+
 //Non-blocking function returning the length of the next buffer on the queue (or 0 if nothing)
 size_t peek_queue(
 	struct buffer_queue *head_buffer_queue,
 	pthread_mutex_t *buf_queue_mutex);
 
+//Non-blocking function returning the number of buffers on the queue
+size_t queue_depth(
+	struct buffer_queue *const *head_buffer_queue,
+	pthread_mutex_t *buf_queue_mutex);
+
 //Wait on a queue, blocking until there is something available
 size_t wait_on_queue(
 	struct buffer_queue ** head_buffer_queue,
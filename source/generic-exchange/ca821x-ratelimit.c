@@ -0,0 +1,66 @@
+/**
+ * @file ca821x-ratelimit.c
+ * @brief Lock-free token bucket rate limiter
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#include "ca821x-ratelimit.h"
+
+void ratelimit_init(struct ratelimit *limit, unsigned int per_sec,
+                    unsigned int burst)
+{
+	if (!burst) burst = 1;
+
+	limit->interval_ns = per_sec ? 1000000000ULL / per_sec : 0;
+	limit->burst_ns = burst * limit->interval_ns;
+	__atomic_store_n(&limit->full_ns, 0, __ATOMIC_RELAXED);
+}
+
+int ratelimit_allow(struct ratelimit *limit, uint64_t now_ns)
+{
+	uint64_t full, next;
+
+	if (!limit->interval_ns) return 1;
+
+	full = __atomic_load_n(&limit->full_ns, __ATOMIC_RELAXED);
+	do
+	{
+		//Taking a token pushes back the time the bucket is full by one
+		//interval, and an empty bucket is one that's a burst away from full
+		next = (full > now_ns ? full : now_ns) + limit->interval_ns;
+		if (next - now_ns > limit->burst_ns) return 0;
+	} while (!__atomic_compare_exchange_n(&limit->full_ns, &full, next, 1,
+	                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return 1;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_RATELIMIT_H
+#define CA821X_RATELIMIT_H
+
+#include <stdint.h>
+
+//Token bucket, kept as the time at which it will next be full so that it can
+//be shared between threads without a lock
+struct ratelimit
+{
+	uint64_t interval_ns; //!< Time to earn one token, 0 for no limit
+	uint64_t burst_ns; //!< Time to fill the bucket
+	uint64_t full_ns; //!< When the bucket will next be full
+};
+
+//Initialiser for a bucket allowing per_sec on average, and up to burst at once
+#define RATELIMIT_INIT(per_sec, burst) \
+	{1000000000ULL / (per_sec), (burst) * (1000000000ULL / (per_sec)), 0}
+
+//Set up a bucket at run time. A rate of 0 allows everything.
+void ratelimit_init(struct ratelimit *limit, unsigned int per_sec,
+                    unsigned int burst);
+
+//Take a token from a bucket if there is one, returning 1 if so, otherwise 0
+int ratelimit_allow(struct ratelimit *limit, uint64_t now_ns);
+
+#endif
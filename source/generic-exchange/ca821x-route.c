@@ -0,0 +1,162 @@
+/**
+ * @file ca821x-route.c
+ * @brief Per-command routing of received messages to subscribers
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ca821x-msg.h"
+#include "ca821x-route.h"
+#include "ca821x_api.h"
+
+//Copy the subscribers of a command that use a thread, and count the ones that
+//don't. Must be called with the lock held.
+static size_t copy_subscribers(struct route_table *table, uint8_t cmd,
+                               enum ca821x_route_thread thread,
+                               exchange_user_callback *callbacks,
+                               size_t *others)
+{
+	size_t count = 0;
+
+	*others = 0;
+	for (size_t i = 0; i < table->count[cmd]; i++)
+	{
+		if (table->subs[cmd][i].thread == thread)
+			callbacks[count++] = table->subs[cmd][i].callback;
+		else
+			(*others)++;
+	}
+
+	return count;
+}
+
+struct route_table *route_table_create(void)
+{
+	struct route_table *table = calloc(1, sizeof(struct route_table));
+
+	if (table) pthread_rwlock_init(&table->lock, NULL);
+	return table;
+}
+
+void route_table_destroy(struct route_table *table)
+{
+	if (!table) return;
+
+	pthread_rwlock_destroy(&table->lock);
+	free(table);
+}
+
+int route_subscribe(struct route_table *table, uint8_t cmd,
+                    exchange_user_callback callback,
+                    enum ca821x_route_thread thread)
+{
+	struct route_subscriber *sub;
+	int id = -1;
+
+	pthread_rwlock_wrlock(&table->lock);
+	if (table->count[cmd] < CA821X_ROUTE_MAX_SUBSCRIBERS)
+	{
+		sub = &table->subs[cmd][table->count[cmd]++];
+		sub->id = id = table->next_id++;
+		sub->callback = callback;
+		sub->thread = thread;
+	}
+	pthread_rwlock_unlock(&table->lock);
+
+	return id;
+}
+
+int route_unsubscribe(struct route_table *table, int id)
+{
+	struct route_subscriber *subs;
+	int error = -1;
+
+	pthread_rwlock_wrlock(&table->lock);
+	for (int cmd = 0; cmd < 256 && error; cmd++)
+	{
+		subs = table->subs[cmd];
+		for (size_t i = 0; i < table->count[cmd]; i++)
+		{
+			if (subs[i].id != id) continue;
+
+			table->count[cmd]--;
+			memmove(&subs[i], &subs[i + 1],
+			        (table->count[cmd] - i) * sizeof(*subs));
+			error = 0;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&table->lock);
+
+	return error;
+}
+
+int route_io(struct route_table *table, const uint8_t *buf, size_t len,
+             struct ca821x_dev *pDeviceRef)
+{
+	exchange_user_callback callbacks[CA821X_ROUTE_MAX_SUBSCRIBERS];
+	size_t count, others;
+
+	pthread_rwlock_rdlock(&table->lock);
+	count = copy_subscribers(table, buf[MSG_CMD], ca821x_route_io, callbacks,
+	                         &others);
+	pthread_rwlock_unlock(&table->lock);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		callbacks[i](buf, len, pDeviceRef);
+	}
+
+	return (!count || others) ? 1 : 0;
+}
+
+int route_dispatch(struct route_table *table, const uint8_t *buf, size_t len,
+                   struct ca821x_dev *pDeviceRef)
+{
+	exchange_user_callback callbacks[CA821X_ROUTE_MAX_SUBSCRIBERS];
+	size_t count, others;
+
+	pthread_rwlock_rdlock(&table->lock);
+	count = copy_subscribers(table, buf[MSG_CMD], ca821x_route_dispatch,
+	                         callbacks, &others);
+	pthread_rwlock_unlock(&table->lock);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		callbacks[i](buf, len, pDeviceRef);
+	}
+
+	return (int)count;
+}
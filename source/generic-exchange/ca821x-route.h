@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_ROUTE_H
+#define CA821X_ROUTE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+#include "ca821x_api.h"
+
+struct route_subscriber
+{
+	int id;
+	exchange_user_callback callback;
+	enum ca821x_route_thread thread;
+};
+
+//Subscribers of a device, indexed by command ID. Subscribers are copied out
+//under the read lock and called without it, so a callback may subscribe or
+//unsubscribe.
+struct route_table
+{
+	pthread_rwlock_t lock;
+	struct route_subscriber subs[256][CA821X_ROUTE_MAX_SUBSCRIBERS];
+	uint8_t count[256];
+	int next_id;
+};
+
+struct route_table *route_table_create(void);
+
+void route_table_destroy(struct route_table *table);
+
+//Add a subscriber for a command ID, returning its ID or -1 if the command
+//already has as many as it can take
+int route_subscribe(struct route_table *table, uint8_t cmd,
+                    exchange_user_callback callback,
+                    enum ca821x_route_thread thread);
+
+int route_unsubscribe(struct route_table *table, int id);
+
+//Deliver a message to the subscribers that asked for the io thread. Returns 1
+//if it must still be queued for the dispatch thread, or 0 if it was consumed.
+int route_io(struct route_table *table, const uint8_t *buf, size_t len,
+             struct ca821x_dev *pDeviceRef);
+
+//Deliver a message to the subscribers that asked for the dispatch thread,
+//returning how many there were
+int route_dispatch(struct route_table *table, const uint8_t *buf, size_t len,
+                   struct ca821x_dev *pDeviceRef);
+
+#endif
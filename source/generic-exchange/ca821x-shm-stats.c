@@ -0,0 +1,263 @@
+/**
+ * @file ca821x-shm-stats.c
+ * @brief Publication of live device statistics to shared memory
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-posix/ca821x-stats-shm.h"
+#include "ca821x-generic-exchange.h"
+#include "ca821x-out-queue.h"
+#include "ca821x-queue.h"
+#include "ca821x-shm-stats.h"
+#include "ca821x-stats.h"
+
+static struct ca821x_shm_stats *s_shm = NULL;
+static char s_shm_name[32];
+static struct ca821x_dev *s_shm_devs[CA821X_SHM_MAX_DEVICES];
+
+static pthread_t s_publish_thread;
+static int s_publish_runflag = 0;
+static pthread_mutex_t s_shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_publish_cond = PTHREAD_COND_INITIALIZER;
+
+static void summarise_latency(struct ca821x_histogram *hist,
+                              struct ca821x_shm_latency *out)
+{
+	out->count = hist->count;
+	out->p50_us = ca821x_histogram_percentile(hist, 50);
+	out->p90_us = ca821x_histogram_percentile(hist, 90);
+	out->p99_us = ca821x_histogram_percentile(hist, 99);
+	out->p999_us = ca821x_histogram_percentile(hist, 99.9);
+	out->max_us = hist->max_us;
+}
+
+//Must be called with s_shm_mutex held
+static void publish_device(struct ca821x_dev *pDeviceRef,
+                           struct ca821x_shm_device *slot)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	//Static so that the (large) histogram isn't placed on the stack
+	static struct ca821x_histogram hist;
+	struct ca821x_shm_device update = {0};
+	uint32_t seq;
+
+	//Gather everything before entering the write side of the seqlock, so that
+	//readers are only held off for the duration of a memcpy.
+	update.in_use = 1;
+	update.exchange_type = priv->exchange_type;
+	update.timestamp_ns = get_time_ns();
+	update.tx_msgs = __atomic_load_n(&priv->counters.tx_msgs, __ATOMIC_RELAXED);
+	update.tx_bytes = __atomic_load_n(&priv->counters.tx_bytes, __ATOMIC_RELAXED);
+	update.rx_msgs = __atomic_load_n(&priv->counters.rx_msgs, __ATOMIC_RELAXED);
+	update.rx_bytes = __atomic_load_n(&priv->counters.rx_bytes, __ATOMIC_RELAXED);
+	update.errors = __atomic_load_n(&priv->counters.errors, __ATOMIC_RELAXED);
+	update.in_queue_depth = queue_depth(&priv->in_buffer_queue,
+	                                    &priv->in_queue_mutex);
+	update.out_queue_depth = out_queue_pending(priv);
+	update.restore_queue_depth = queue_depth(&priv->restore_out_buffer_queue,
+	                                         &priv->out_queue_mutex);
+
+	update.num_latencies = ca821x_latency_count;
+	if (update.num_latencies > CA821X_SHM_MAX_LATENCIES)
+		update.num_latencies = CA821X_SHM_MAX_LATENCIES;
+
+	for (uint32_t i = 0; i < update.num_latencies; i++)
+	{
+		histogram_snapshot(&priv->latency[i], &hist);
+		summarise_latency(&hist, &update.latency[i]);
+	}
+
+	seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	update.seq = seq + 1;
+	memcpy(slot, &update, sizeof(update));
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+//Must be called with s_shm_mutex held
+static void clear_slot(struct ca821x_shm_device *slot)
+{
+	uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset((uint8_t *)slot + sizeof(slot->seq), 0,
+	       sizeof(*slot) - sizeof(slot->seq));
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *shm_publish_worker(void *arg)
+{
+	struct timespec deadline;
+
+	(void) arg;
+
+	pthread_mutex_lock(&s_shm_mutex);
+	while (s_publish_runflag)
+	{
+		for (int i = 0; i < CA821X_SHM_MAX_DEVICES; i++)
+		{
+			if (s_shm_devs[i]) publish_device(s_shm_devs[i], &s_shm->devices[i]);
+		}
+		__atomic_store_n(&s_shm->downstream_queue_depth,
+		                 exchange_downstream_queue_depth(), __ATOMIC_RELAXED);
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += CA821X_SHM_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&s_publish_cond, &s_shm_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&s_shm_mutex);
+
+	return NULL;
+}
+
+int shm_stats_init(void)
+{
+	int fd, error = 0;
+
+	snprintf(s_shm_name, sizeof(s_shm_name), CA821X_SHM_NAME_FMT, (int)getpid());
+
+	//Only reuse the name of a segment left behind by a dead process of our own,
+	//and never share the statistics with other users
+	shm_unlink(s_shm_name);
+	fd = shm_open(s_shm_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) return -1;
+
+	if (ftruncate(fd, sizeof(struct ca821x_shm_stats)) < 0)
+	{
+		error = -1;
+		goto exit;
+	}
+
+	s_shm = mmap(NULL, sizeof(struct ca821x_shm_stats), PROT_READ | PROT_WRITE,
+	             MAP_SHARED, fd, 0);
+	if (s_shm == MAP_FAILED)
+	{
+		s_shm = NULL;
+		error = -1;
+		goto exit;
+	}
+
+	s_shm->version = CA821X_SHM_VERSION;
+	s_shm->pid = getpid();
+	s_shm->interval_ms = CA821X_SHM_INTERVAL_MS;
+	s_shm->max_devices = CA821X_SHM_MAX_DEVICES;
+	//Publish the magic last so that monitors don't use a half-built header
+	__atomic_store_n(&s_shm->magic, CA821X_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	s_publish_runflag = 1;
+	error = pthread_create(&s_publish_thread, NULL, &shm_publish_worker, NULL);
+	if (error)
+	{
+		s_publish_runflag = 0;
+		error = -1;
+	}
+
+exit:
+	close(fd);
+	if (error)
+	{
+		if (s_shm) munmap(s_shm, sizeof(struct ca821x_shm_stats));
+		s_shm = NULL;
+		shm_unlink(s_shm_name);
+	}
+	return error;
+}
+
+void shm_stats_deinit(void)
+{
+	if (!s_shm) return;
+
+	pthread_mutex_lock(&s_shm_mutex);
+	s_publish_runflag = 0;
+	pthread_cond_signal(&s_publish_cond);
+	pthread_mutex_unlock(&s_shm_mutex);
+
+	pthread_join(s_publish_thread, NULL);
+
+	munmap(s_shm, sizeof(struct ca821x_shm_stats));
+	s_shm = NULL;
+	shm_unlink(s_shm_name);
+}
+
+int shm_stats_add_device(struct ca821x_dev *pDeviceRef)
+{
+	int error = -1;
+
+	pthread_mutex_lock(&s_shm_mutex);
+	if (!s_shm) goto exit;
+
+	for (int i = 0; i < CA821X_SHM_MAX_DEVICES; i++)
+	{
+		if (s_shm_devs[i] == NULL)
+		{
+			s_shm_devs[i] = pDeviceRef;
+			publish_device(pDeviceRef, &s_shm->devices[i]);
+			error = 0;
+			break;
+		}
+	}
+
+exit:
+	pthread_mutex_unlock(&s_shm_mutex);
+	return error;
+}
+
+void shm_stats_remove_device(struct ca821x_dev *pDeviceRef)
+{
+	pthread_mutex_lock(&s_shm_mutex);
+	for (int i = 0; s_shm && i < CA821X_SHM_MAX_DEVICES; i++)
+	{
+		if (s_shm_devs[i] == pDeviceRef)
+		{
+			s_shm_devs[i] = NULL;
+			clear_slot(&s_shm->devices[i]);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s_shm_mutex);
+}
@@ -0,0 +1,350 @@
+/**
+ * @file ca821x-standby.c
+ * @brief Hot standby pairing of two devices
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-generic-exchange.h"
+#include "ca821x-msg.h"
+#include "ca821x-pib.h"
+#include "ca821x-queue.h"
+#include "ca821x-standby.h"
+#include "ca821x_api.h"
+
+static const uint8_t s_quiet = 0;
+
+static void add_stat(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static int is_rx_on_when_idle(enum ca821x_pib_type type, uint8_t attribute)
+{
+	return type == ca821x_pib_mlme && attribute == macRxOnWhenIdle;
+}
+
+//Apply settings to the standby, keeping its receiver off while idle so that
+//it stays quiet until it takes over
+static void mirror_settings(struct standby_state *state,
+                            struct ca821x_dev *standby,
+                            const struct ca821x_pib_setting *settings,
+                            size_t count_in)
+{
+	struct ca821x_pib_setting *copy;
+	size_t n = 0;
+	int failures;
+
+	if (!count_in) return;
+
+	copy = malloc(count_in * sizeof(*copy));
+	if (!copy)
+	{
+		add_stat(&state->stats.mirror_failures, count_in);
+		return;
+	}
+
+	for (size_t i = 0; i < count_in; i++)
+	{
+		if (settings[i].status != MAC_SUCCESS) continue;
+
+		copy[n] = settings[i];
+		if (is_rx_on_when_idle(copy[n].type, copy[n].attribute) && copy[n].length)
+		{
+			copy[n].length = 1;
+			copy[n].value = &s_quiet;
+		}
+		n++;
+	}
+
+	failures = n ? exchange_apply_pib_profile(copy, n, standby) : 0;
+	add_stat(&state->stats.mirrored, n);
+	add_stat(&state->stats.mirror_failures, failures < 0 ? n : (size_t)failures);
+	free(copy);
+}
+
+static int set_rx_on_when_idle(struct ca821x_dev *standby, uint8_t value)
+{
+	uint8_t set[] = {SPI_MLME_SET_REQUEST, 4, macRxOnWhenIdle, 0, 1, value};
+	uint8_t response[sizeof(struct MAC_Message)];
+
+	if (ca8210_exchange_commands(set, sizeof(set), response, standby))
+		return -1;
+	return response[CNF_STATUS] == MAC_SUCCESS ? 0 : -1;
+}
+
+//Find the receiver setting that was last recorded for a device
+static uint8_t recorded_rx_on_when_idle(struct ca821x_exchange_base *priv)
+{
+	struct ca821x_pib_setting *settings;
+	size_t count_out;
+	uint8_t value = 0;
+
+	if (!priv->pib_shadow) return 0;
+
+	settings = pib_shadow_snapshot(priv->pib_shadow, &count_out);
+	for (size_t i = 0; i < count_out; i++)
+	{
+		if (is_rx_on_when_idle(settings[i].type, settings[i].attribute) &&
+		    settings[i].length)
+		{
+			value = *(const uint8_t *)settings[i].value;
+		}
+	}
+	free(settings);
+	return value;
+}
+
+struct standby_state *standby_create(void)
+{
+	return calloc(1, sizeof(struct standby_state));
+}
+
+void standby_destroy(struct ca821x_exchange_base *priv)
+{
+	struct ca821x_exchange_base *other;
+	struct standby_state *state;
+
+	//A primary carries on without its standby
+	if (priv->standby_for)
+	{
+		other = priv->standby_for->exchange_context;
+		state = __atomic_load_n(&other->standby, __ATOMIC_ACQUIRE);
+		if (state)
+		{
+			__atomic_store_n(&state->active, 0, __ATOMIC_RELEASE);
+			__atomic_store_n(&state->dev, NULL, __ATOMIC_RELEASE);
+		}
+		priv->standby_for = NULL;
+	}
+
+	//And a standby goes back to being an ordinary device
+	state = priv->standby;
+	if (!state) return;
+	if (state->dev)
+	{
+		other = state->dev->exchange_context;
+		__atomic_store_n(&other->standby_for, NULL, __ATOMIC_RELEASE);
+	}
+	free(state);
+	priv->standby = NULL;
+}
+
+int standby_pair(struct ca821x_dev *pDeviceRef, struct ca821x_dev *standby)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct ca821x_exchange_base *spriv;
+	struct standby_state *state = priv->standby;
+	struct ca821x_dev *old = __atomic_load_n(&state->dev, __ATOMIC_ACQUIRE);
+	struct ca821x_pib_setting *settings;
+	const uint8_t reset[] = {SPI_MLME_RESET_REQUEST, 1, 1};
+	uint8_t response[sizeof(struct MAC_Message)];
+	size_t count_out;
+
+	if (old == standby) return 0;
+	if (__atomic_load_n(&state->active, __ATOMIC_ACQUIRE)) return -1;
+
+	if (old)
+	{
+		spriv = old->exchange_context;
+		__atomic_store_n(&state->dev, NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&spriv->standby_for, NULL, __ATOMIC_RELEASE);
+	}
+	if (!standby) return 0;
+
+	spriv = standby->exchange_context;
+	if (!spriv || standby == pDeviceRef || priv->standby_for ||
+	    spriv->standby_for || (spriv->standby && spriv->standby->dev))
+	{
+		return -1;
+	}
+
+	//The primary's PIB is recorded so that it can be copied, and both are
+	//recorded so that either can be restored after an error
+	if (exchange_enable_pib_replay(1, pDeviceRef) ||
+	    exchange_enable_pib_replay(1, standby))
+	{
+		return -1;
+	}
+
+	settings = pib_shadow_snapshot(priv->pib_shadow, &count_out);
+	if (ca8210_exchange_commands(reset, sizeof(reset), response, standby))
+	{
+		free(settings);
+		return -1;
+	}
+	mirror_settings(state, standby, settings, count_out);
+	free(settings);
+
+	__atomic_store_n(&spriv->standby_for, pDeviceRef, __ATOMIC_RELEASE);
+	__atomic_store_n(&state->dev, standby, __ATOMIC_RELEASE);
+	return 0;
+}
+
+struct ca821x_dev *standby_active(struct ca821x_exchange_base *priv)
+{
+	struct standby_state *state = __atomic_load_n(&priv->standby,
+	                                              __ATOMIC_ACQUIRE);
+
+	if (!state || !__atomic_load_n(&state->active, __ATOMIC_ACQUIRE))
+		return NULL;
+	return __atomic_load_n(&state->dev, __ATOMIC_ACQUIRE);
+}
+
+void standby_mirror(struct ca821x_exchange_base *priv, const uint8_t *req,
+                    const uint8_t *response)
+{
+	struct standby_state *state = __atomic_load_n(&priv->standby,
+	                                              __ATOMIC_ACQUIRE);
+	struct ca821x_dev *standby;
+	uint8_t buf[MAX_BUF_SIZE];
+	uint8_t rsp[sizeof(struct MAC_Message)];
+	size_t len;
+
+	if (!state) return;
+	standby = __atomic_load_n(&state->dev, __ATOMIC_ACQUIRE);
+	if (!standby) return;
+
+	if (req[MSG_CMD] == SPI_MLME_SET_REQUEST)
+	{
+		if (response[MSG_CMD] != SPI_MLME_SET_CONFIRM) return;
+	}
+	else if (req[MSG_CMD] == SPI_HWME_SET_REQUEST)
+	{
+		if (response[MSG_CMD] != SPI_HWME_SET_CONFIRM) return;
+	}
+	else if (req[MSG_CMD] != SPI_MLME_RESET_REQUEST)
+	{
+		return;
+	}
+	if (response[CNF_STATUS] != MAC_SUCCESS) return;
+
+	len = req[MSG_LEN] + MSG_HEADER_LEN;
+	memcpy(buf, req, len);
+	if (buf[MSG_CMD] == SPI_MLME_SET_REQUEST &&
+	    is_rx_on_when_idle(ca821x_pib_mlme, buf[SET_REQ_ATTR]) &&
+	    buf[SET_REQ_ATTRLEN])
+	{
+		buf[SET_REQ_VALUE] = s_quiet;
+	}
+
+	add_stat(&state->stats.mirrored, 1);
+	if (ca8210_exchange_commands(buf, len, rsp, standby) ||
+	    rsp[CNF_STATUS] != MAC_SUCCESS)
+	{
+		add_stat(&state->stats.mirror_failures, 1);
+	}
+}
+
+void standby_mirror_profile(struct ca821x_exchange_base *priv,
+                            const struct ca821x_pib_setting *settings,
+                            size_t count_in)
+{
+	struct standby_state *state = __atomic_load_n(&priv->standby,
+	                                              __ATOMIC_ACQUIRE);
+	struct ca821x_dev *standby;
+
+	if (!state) return;
+	standby = __atomic_load_n(&state->dev, __ATOMIC_ACQUIRE);
+	if (standby) mirror_settings(state, standby, settings, count_in);
+}
+
+void standby_failover(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct standby_state *state = __atomic_load_n(&priv->standby,
+	                                              __ATOMIC_ACQUIRE);
+	struct buffer_queue *pending = NULL;
+	struct ca821x_dev *standby, *ref_out;
+	uint8_t buf[MAX_BUF_SIZE];
+	size_t len;
+
+	if (!state) return;
+	standby = __atomic_load_n(&state->dev, __ATOMIC_ACQUIRE);
+	if (!standby) return;
+
+	//Let the standby listen in place of the primary
+	state->rx_on_when_idle = recorded_rx_on_when_idle(priv);
+	if (state->rx_on_when_idle)
+		set_rx_on_when_idle(standby, state->rx_on_when_idle);
+
+	//Pass on what the primary hadn't sent, ahead of any new traffic. The
+	//callers of synchronous requests resend them, so those are left alone.
+	reseat_queue(&priv->restore_out_buffer_queue, &pending,
+	             &priv->out_queue_mutex, &priv->out_queue_mutex);
+	while (pending)
+	{
+		len = pop_from_queue(&pending, &priv->out_queue_mutex, buf, sizeof(buf),
+		                     &ref_out);
+		if (!len) continue;
+
+		if (buf[MSG_CMD] & SPI_SYN)
+		{
+			add_to_queue(&priv->restore_out_buffer_queue,
+			             &priv->out_queue_mutex, buf, len, ref_out);
+			continue;
+		}
+
+		ca8210_exchange_commands(buf, len, NULL, standby);
+		add_stat(&state->stats.redirected, 1);
+	}
+
+	//Release everything waiting for the primary to be restored
+	pthread_mutex_lock(&priv->flag_mutex);
+	__atomic_store_n(&state->active, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&priv->restore_cond);
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	add_stat(&state->stats.failovers, 1);
+}
+
+void standby_failback(struct ca821x_dev *pDeviceRef)
+{
+	struct ca821x_exchange_base *priv = pDeviceRef->exchange_context;
+	struct standby_state *state = __atomic_load_n(&priv->standby,
+	                                              __ATOMIC_ACQUIRE);
+	struct ca821x_dev *standby;
+
+	if (!state || !__atomic_load_n(&state->active, __ATOMIC_ACQUIRE)) return;
+
+	//New traffic waits for the primary again from here
+	pthread_mutex_lock(&priv->flag_mutex);
+	__atomic_store_n(&state->active, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&priv->flag_mutex);
+
+	standby = __atomic_load_n(&state->dev, __ATOMIC_ACQUIRE);
+	if (standby && state->rx_on_when_idle) set_rx_on_when_idle(standby, 0);
+}
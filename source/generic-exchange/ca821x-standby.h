@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_STANDBY_H
+#define CA821X_STANDBY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+//Pairing of a primary device with a hot standby, held by the primary
+struct standby_state
+{
+	struct ca821x_dev *dev; //!< The standby, or NULL when unpaired
+	int active; //!< Traffic for the primary is going to the standby
+	uint8_t rx_on_when_idle; //!< Value given to the standby on failover
+	struct ca821x_standby_stats stats;
+};
+
+struct standby_state *standby_create(void);
+
+//Unpair a device that is being closed, whichever side of a pair it is on
+void standby_destroy(struct ca821x_exchange_base *priv);
+
+//Pair a primary with a standby (or unpair it if standby is NULL), resetting
+//the standby and copying the primary's recorded PIB onto it
+int standby_pair(struct ca821x_dev *pDeviceRef, struct ca821x_dev *standby);
+
+//Return the standby if it has taken over from the device, otherwise NULL
+struct ca821x_dev *standby_active(struct ca821x_exchange_base *priv);
+
+//Repeat a completed SET or reset on the device's standby, if it has one
+void standby_mirror(struct ca821x_exchange_base *priv, const uint8_t *req,
+                    const uint8_t *response);
+
+//Repeat the successful settings of an applied PIB profile on the standby
+void standby_mirror_profile(struct ca821x_exchange_base *priv,
+                            const struct ca821x_pib_setting *settings,
+                            size_t count);
+
+//Hand the device's traffic over to its standby. Called from the recovery
+//thread as soon as the device has failed.
+void standby_failover(struct ca821x_dev *pDeviceRef);
+
+//Take the traffic back from the standby, and quieten it again. Called from
+//the recovery thread before the device is restored.
+void standby_failback(struct ca821x_dev *pDeviceRef);
+
+#endif
@@ -0,0 +1,157 @@
+/**
+ * @file ca821x-stats.c
+ * @brief Log-linear latency histograms for ca821x-posix data exchange
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "ca821x-stats.h"
+
+/*
+ * Buckets are laid out HDR-style: values below CA821X_HIST_SUB_COUNT get a
+ * bucket each, and every power of two above that is split into
+ * CA821X_HIST_SUB_COUNT linear sub-buckets. This bounds the relative error of
+ * any reported value to 1/CA821X_HIST_SUB_COUNT.
+ */
+static unsigned int bucket_index(uint32_t value)
+{
+	unsigned int msb, shift;
+
+	if (value < CA821X_HIST_SUB_COUNT) return value;
+
+	msb = 31 - __builtin_clz(value);
+	shift = msb - CA821X_HIST_SUB_BITS;
+
+	return ((shift + 1) << CA821X_HIST_SUB_BITS) +
+	       ((value >> shift) - CA821X_HIST_SUB_COUNT);
+}
+
+//Highest value that maps into the given bucket
+static uint32_t bucket_upper(unsigned int index)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (index < CA821X_HIST_SUB_COUNT) return index;
+
+	shift = (index >> CA821X_HIST_SUB_BITS) - 1;
+	sub = (index & (CA821X_HIST_SUB_COUNT - 1)) + CA821X_HIST_SUB_COUNT;
+
+	return (uint32_t)(((sub + 1) << shift) - 1);
+}
+
+uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void histogram_record(struct ca821x_histogram *hist, uint64_t value_us)
+{
+	uint32_t value, max;
+
+	value = (value_us > UINT32_MAX) ? UINT32_MAX : (uint32_t)value_us;
+
+	__atomic_fetch_add(&hist->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum_us, value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED);
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&hist->max_us, &max, value, 1,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void histogram_record_since(struct ca821x_histogram *hist, uint64_t start_ns)
+{
+	histogram_record(hist, (get_time_ns() - start_ns) / 1000);
+}
+
+void histogram_snapshot(const struct ca821x_histogram *hist,
+                        struct ca821x_histogram *hist_out)
+{
+	uint64_t count = 0;
+
+	for (int i = 0; i < CA821X_HIST_BUCKETS; i++)
+	{
+		hist_out->buckets[i] = __atomic_load_n(&hist->buckets[i],
+		                                       __ATOMIC_RELAXED);
+		count += hist_out->buckets[i];
+	}
+	//Derive the count from the copied buckets so that percentiles are
+	//consistent even if samples were recorded during the copy.
+	hist_out->count = count;
+	hist_out->sum_us = __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED);
+	hist_out->max_us = __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED);
+}
+
+void histogram_reset(struct ca821x_histogram *hist)
+{
+	for (int i = 0; i < CA821X_HIST_BUCKETS; i++)
+	{
+		__atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum_us, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->max_us, 0, __ATOMIC_RELAXED);
+}
+
+uint32_t ca821x_histogram_percentile(const struct ca821x_histogram *hist,
+                                     double percentile)
+{
+	uint64_t rank, seen = 0;
+	uint32_t value;
+
+	if (hist->count == 0) return 0;
+	if (percentile < 0) percentile = 0;
+	if (percentile > 100) percentile = 100;
+
+	rank = (uint64_t)((percentile / 100.0) * hist->count + 0.5);
+	if (rank == 0) rank = 1;
+
+	for (int i = 0; i < CA821X_HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if (seen >= rank)
+		{
+			value = bucket_upper(i);
+			//Don't report beyond the largest value actually recorded
+			if (hist->max_us && value > hist->max_us) value = hist->max_us;
+			return value;
+		}
+	}
+
+	return hist->max_us;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_STATS_H
+#define CA821X_STATS_H
+
+#include <stdint.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+//Current CLOCK_MONOTONIC time in nanoseconds
+uint64_t get_time_ns(void);
+
+//Record a latency sample (in microseconds). Lock and allocation free, safe to
+//call from any thread.
+void histogram_record(struct ca821x_histogram *hist, uint64_t value_us);
+
+//Record the time elapsed since start_ns (from get_time_ns)
+void histogram_record_since(struct ca821x_histogram *hist, uint64_t start_ns);
+
+//Copy a histogram that may be concurrently recorded into
+void histogram_snapshot(const struct ca821x_histogram *hist,
+                        struct ca821x_histogram *hist_out);
+
+//Zero a histogram that may be concurrently recorded into
+void histogram_reset(struct ca821x_histogram *hist);
+
+#endif
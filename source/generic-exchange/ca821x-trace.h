@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Static (USDT) tracepoints for the exchange hot path. When built with
+ * CA821X_TRACEPOINTS these compile to a single nop each, which perf, bpftrace
+ * or systemtap can attach to at runtime, eg:
+ *
+ *   bpftrace -e 'usdt:./libca821x-posix.so:ca821x:write_return { ... }'
+ *
+ * Every probe carries the device pointer, the command ID and the length of the
+ * message as its first three arguments. Some carry a fourth: the queue for
+ * enqueue, dequeue and drop, the write's result for write_return, the length
+ * of the response (0 if the device failed) for sync_wait_end, and the error
+ * for recovery_start and recovery_end, whose message is the last one written
+ * before the error. Messages passed to a bulk callback each get a
+ * dispatch_start and dispatch_end around the whole call. Without sys/sdt.h
+ * they compile out.
+ */
+
+#ifndef CA821X_TRACE_H
+#define CA821X_TRACE_H
+
+#include "ca821x-posix/ca821x-posix-config.h"
+
+#if CA821X_TRACEPOINTS
+#include <sys/sdt.h>
+
+#define CA821X_TRACE3(probe, dev, cmd, len) \
+	DTRACE_PROBE3(ca821x, probe, dev, cmd, len)
+#define CA821X_TRACE4(probe, dev, cmd, len, arg) \
+	DTRACE_PROBE4(ca821x, probe, dev, cmd, len, arg)
+
+#else
+
+#define CA821X_TRACE3(probe, dev, cmd, len) do {} while (0)
+#define CA821X_TRACE4(probe, dev, cmd, len, arg) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,193 @@
+/**
+ * @file ca821x-txn.c
+ * @brief Admission control of data requests
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ca821x-msg.h"
+#include "ca821x-out-queue.h"
+#include "ca821x-queue.h"
+#include "ca821x-stats.h"
+#include "ca821x-txn.h"
+#include "ca821x_api.h"
+
+static int is_in_flight(struct txn_state *txn, uint8_t handle)
+{
+	return txn->in_flight[handle / 8] & (1 << (handle % 8));
+}
+
+static void claim_handle(struct txn_state *txn, uint8_t handle)
+{
+	//A handle reused before its confirm replaces the old transaction, which
+	//must not expire the new one early
+	txn->sent_time[handle] = get_time_ns();
+	if (is_in_flight(txn, handle)) return;
+
+	txn->in_flight[handle / 8] |= (1 << (handle % 8));
+	txn->outstanding++;
+	__atomic_store_n(&txn->stats.outstanding, txn->outstanding, __ATOMIC_RELAXED);
+}
+
+static void free_handle(struct txn_state *txn, uint8_t handle)
+{
+	if (!is_in_flight(txn, handle)) return;
+
+	txn->in_flight[handle / 8] &= ~(1 << (handle % 8));
+	txn->outstanding--;
+	__atomic_store_n(&txn->stats.outstanding, txn->outstanding, __ATOMIC_RELAXED);
+}
+
+//Stop counting requests whose confirms have been lost
+static void expire_handles(struct txn_state *txn)
+{
+	uint64_t now = get_time_ns();
+
+	for (int i = 0; i < 256; i++)
+	{
+		if (!is_in_flight(txn, i)) continue;
+		if (now - txn->sent_time[i] > CA821X_TXN_TIMEOUT_MS * 1000000ULL)
+			free_handle(txn, i);
+	}
+}
+
+static int has_room(struct txn_state *txn)
+{
+	unsigned int max = __atomic_load_n(&txn->max_outstanding, __ATOMIC_RELAXED);
+
+	if (!max || txn->outstanding < max) return 1;
+
+	expire_handles(txn);
+	return txn->outstanding < max;
+}
+
+static int is_data_request(const uint8_t *buf, size_t len)
+{
+	return buf[MSG_CMD] == SPI_MCPS_DATA_REQUEST && len > DATA_REQ_HANDLE;
+}
+
+struct txn_state *txn_create(void)
+{
+	return calloc(1, sizeof(struct txn_state));
+}
+
+void txn_destroy(struct ca821x_exchange_base *priv)
+{
+	if (!priv->txn) return;
+
+	flush_queue(&priv->txn->hold_queue, &priv->out_queue_mutex);
+	free(priv->txn);
+	priv->txn = NULL;
+}
+
+int txn_admit(struct ca821x_exchange_base *priv, const uint8_t *buf,
+              size_t len, struct ca821x_dev *pDeviceRef)
+{
+	struct txn_state *txn = __atomic_load_n(&priv->txn, __ATOMIC_ACQUIRE);
+	uint64_t held;
+
+	if (!txn || !is_data_request(buf, len)) return 1;
+
+	//Keep data requests in order behind any that are already held
+	if (!txn->stats.held && has_room(txn))
+	{
+		claim_handle(txn, buf[DATA_REQ_HANDLE]);
+		return 1;
+	}
+
+	add_to_queue(&txn->hold_queue, &priv->out_queue_mutex, buf, len, pDeviceRef);
+	out_queue_hold(priv);
+	held = __atomic_add_fetch(&txn->stats.held, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&txn->stats.total_held, 1, __ATOMIC_RELAXED);
+	if (held > txn->stats.max_held)
+		__atomic_store_n(&txn->stats.max_held, held, __ATOMIC_RELAXED);
+	return 0;
+}
+
+size_t txn_release(struct ca821x_exchange_base *priv,
+                   uint8_t *destBuf,
+                   size_t maxlen,
+                   struct ca821x_dev **pDeviceRef_out,
+                   uint64_t *timestamp_out)
+{
+	struct txn_state *txn = __atomic_load_n(&priv->txn, __ATOMIC_ACQUIRE);
+	size_t len;
+
+	if (!txn || !txn->stats.held || !has_room(txn)) return 0;
+
+	len = pop_from_queue_timed(&txn->hold_queue, &priv->out_queue_mutex,
+	                           destBuf, maxlen, pDeviceRef_out, timestamp_out);
+	if (len == 0) return 0;
+
+	__atomic_fetch_sub(&txn->stats.held, 1, __ATOMIC_RELAXED);
+	out_queue_unhold(priv, 1);
+	claim_handle(txn, destBuf[DATA_REQ_HANDLE]);
+	return len;
+}
+
+void txn_observe(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                 size_t len)
+{
+	struct txn_state *txn = __atomic_load_n(&priv->txn, __ATOMIC_ACQUIRE);
+
+	if (!txn || len <= DATA_CNF_STATUS) return;
+
+	if (buf[MSG_CMD] == SPI_MCPS_DATA_CONFIRM)
+	{
+		free_handle(txn, buf[DATA_CNF_HANDLE]);
+	}
+	else if (buf[MSG_CMD] == SPI_MCPS_PURGE_CONFIRM &&
+	         buf[DATA_CNF_STATUS] == MAC_SUCCESS)
+	{
+		//A purged request will never be confirmed
+		free_handle(txn, buf[DATA_CNF_HANDLE]);
+	}
+}
+
+void txn_reset(struct ca821x_exchange_base *priv)
+{
+	struct txn_state *txn = __atomic_load_n(&priv->txn, __ATOMIC_ACQUIRE);
+	size_t count;
+
+	if (!txn) return;
+
+	memset(txn->in_flight, 0, sizeof(txn->in_flight));
+	txn->outstanding = 0;
+	__atomic_store_n(&txn->stats.outstanding, 0, __ATOMIC_RELAXED);
+
+	count = reseat_queue(&txn->hold_queue, &priv->restore_out_buffer_queue,
+	                     &priv->out_queue_mutex, &priv->out_queue_mutex);
+	__atomic_fetch_sub(&txn->stats.held, count, __ATOMIC_RELAXED);
+	out_queue_unhold(priv, count);
+}
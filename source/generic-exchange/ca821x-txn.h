@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_TXN_H
+#define CA821X_TXN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+/**
+ * Time after which a data request whose confirm never arrived is presumed
+ * lost, and stops counting against the limit, in milliseconds
+ */
+#ifndef CA821X_TXN_TIMEOUT_MS
+#define CA821X_TXN_TIMEOUT_MS 60000
+#endif
+
+//Admission control of MCPS_DATA_requests. Apart from the limit and the
+//statistics, the state is only used by the device's io thread.
+struct txn_state
+{
+	unsigned int max_outstanding; //!< 0 for no limit
+	unsigned int outstanding;
+	uint8_t in_flight[256 / 8]; //!< Bitmap indexed by MSDU handle
+	uint64_t sent_time[256]; //!< When each handle in flight was sent
+	struct buffer_queue *hold_queue; //!< Protected by the out queue mutex
+	struct ca821x_txn_stats stats;
+};
+
+struct txn_state *txn_create(void);
+
+//Free the state of a device, dropping any held requests
+void txn_destroy(struct ca821x_exchange_base *priv);
+
+//Decide whether a message popped from the out queue can be written now.
+//Returns 1 if so, or 0 if it is a data request that has been held back.
+int txn_admit(struct ca821x_exchange_base *priv, const uint8_t *buf,
+              size_t len, struct ca821x_dev *pDeviceRef);
+
+//Pop the oldest held data request if the device has room for it, otherwise
+//return 0
+size_t txn_release(struct ca821x_exchange_base *priv,
+                   uint8_t *destBuf,
+                   size_t maxlen,
+                   struct ca821x_dev **pDeviceRef_out,
+                   uint64_t *timestamp_out);
+
+//Free the handle of a data request once its confirm has been read
+void txn_observe(struct ca821x_exchange_base *priv, const uint8_t *buf,
+                 size_t len);
+
+//Forget everything in flight after the device has failed, and move held
+//requests onto the restore queue along with the rest of the out queue
+void txn_reset(struct ca821x_exchange_base *priv);
+
+#endif
@@ -46,6 +46,7 @@
 
 #include "ca821x-queue.h"
 #include "ca821x-generic-exchange.h"
+#include "ca821x-out-queue.h"
 #include "kernel-exchange.h"
 
 /******************************************************************************/
@@ -121,7 +122,7 @@ ssize_t kernel_exchange_try_read(struct ca821x_dev *pDeviceRef,
 	struct kernel_exchange_priv *priv = pDeviceRef->exchange_context;
 	struct timeval timeout;
 
-	if (!peek_queue(priv->base.out_buffer_queue, &(priv->base.out_queue_mutex)))
+	if (!out_queue_pending(&priv->base))
 	{
 		int nfds;
 		uint8_t dummybyte = 0;
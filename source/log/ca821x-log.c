@@ -0,0 +1,253 @@
+/**
+ * @file ca821x-log.c
+ * @brief Rate-limited, asynchronous logging for the library
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-log.h"
+#include "ca821x-stats.h"
+
+//How long the writer sleeps if it misses a wakeup, in ms
+#define LOG_POLL_MS 100
+
+//A slot of the ring. Its sequence number says whose turn it is: the producer
+//that claims position n waits for it to be n, and hands it to the writer by
+//making it n + 1.
+struct log_slot
+{
+	uint64_t seq;
+	enum ca821x_log_level level;
+	char msg[CA821X_LOG_LINE_LEN];
+};
+
+static struct log_slot s_ring[CA821X_LOG_RING_SIZE];
+static uint64_t s_head; //!< Next position for a producer to claim
+static uint64_t s_tail; //!< Next position for the writer, under s_write_mutex
+
+static enum ca821x_log_level s_level = ca821x_log_warning;
+static exchange_log_sink s_sink = NULL;
+static struct ca821x_log_stats s_stats;
+
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static int s_started = 0;
+static pthread_t s_writer;
+static pthread_mutex_t s_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_write_cond;
+
+static const char *const s_level_names[] = {
+	[ca821x_log_error] = "error",
+	[ca821x_log_warning] = "warning",
+	[ca821x_log_info] = "info",
+	[ca821x_log_debug] = "debug",
+};
+
+//Write out everything in the ring. Must be called with s_write_mutex held.
+static void drain_ring(void)
+{
+	struct log_slot *slot;
+	exchange_log_sink sink;
+
+	for (;;)
+	{
+		slot = &s_ring[s_tail % CA821X_LOG_RING_SIZE];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != s_tail + 1) break;
+
+		sink = __atomic_load_n(&s_sink, __ATOMIC_ACQUIRE);
+		if (sink)
+			sink(slot->level, slot->msg);
+		else
+			fprintf(stderr, "ca821x %s: %s\n", s_level_names[slot->level],
+			        slot->msg);
+
+		//Hand the slot back for the producer one lap ahead
+		__atomic_store_n(&slot->seq, s_tail + CA821X_LOG_RING_SIZE,
+		                 __ATOMIC_RELEASE);
+		s_tail++;
+	}
+}
+
+static void *log_writer(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&s_write_mutex);
+	for (;;)
+	{
+		drain_ring();
+
+		//Producers signal without the lock, so a wakeup can be missed and
+		//the wait is bounded
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += LOG_POLL_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&s_write_cond, &s_write_mutex, &ts);
+	}
+
+	return NULL;
+}
+
+//Write whatever is still queued when the process exits
+static void flush_at_exit(void)
+{
+	pthread_mutex_lock(&s_write_mutex);
+	drain_ring();
+	pthread_mutex_unlock(&s_write_mutex);
+}
+
+static void start_writer(void)
+{
+	pthread_condattr_t condattr;
+	pthread_attr_t attr;
+
+	for (uint64_t i = 0; i < CA821X_LOG_RING_SIZE; i++)
+	{
+		s_ring[i].seq = i;
+	}
+
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s_write_cond, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	//The writer lives as long as the process, so is never joined
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (!pthread_create(&s_writer, &attr, &log_writer, NULL))
+	{
+		atexit(flush_at_exit);
+		__atomic_store_n(&s_started, 1, __ATOMIC_RELEASE);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+//Claim a slot in the ring, returning NULL if it is full
+static struct log_slot *claim_slot(uint64_t *pos_out)
+{
+	struct log_slot *slot;
+	uint64_t pos, seq;
+
+	pos = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		slot = &s_ring[pos % CA821X_LOG_RING_SIZE];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos)
+		{
+			if (__atomic_compare_exchange_n(&s_head, &pos, pos + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*pos_out = pos;
+				return slot;
+			}
+		}
+		else if (seq < pos)
+		{
+			//The writer hasn't freed this slot since the last lap
+			return NULL;
+		}
+		else
+		{
+			pos = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int log_enabled(enum ca821x_log_level level)
+{
+	return level <= __atomic_load_n(&s_level, __ATOMIC_RELAXED);
+}
+
+void log_limited(struct ratelimit *limit, enum ca821x_log_level level,
+                 const char *format, ...)
+{
+	struct log_slot *slot;
+	uint64_t pos;
+	va_list args;
+
+	if (!ratelimit_allow(limit, get_time_ns()))
+	{
+		__atomic_fetch_add(&s_stats.suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	pthread_once(&s_once, &start_writer);
+	if (!__atomic_load_n(&s_started, __ATOMIC_ACQUIRE)) goto drop;
+
+	slot = claim_slot(&pos);
+	if (!slot) goto drop;
+
+	slot->level = level;
+	va_start(args, format);
+	vsnprintf(slot->msg, sizeof(slot->msg), format, args);
+	va_end(args);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&s_stats.logged, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&s_write_cond);
+	return;
+
+drop:
+	__atomic_fetch_add(&s_stats.dropped, 1, __ATOMIC_RELAXED);
+}
+
+int exchange_set_log_level(enum ca821x_log_level level)
+{
+	if ((unsigned int)level > ca821x_log_debug) return -1;
+
+	__atomic_store_n(&s_level, level, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void exchange_set_log_sink(exchange_log_sink sink)
+{
+	__atomic_store_n(&s_sink, sink, __ATOMIC_RELEASE);
+}
+
+void exchange_get_log_stats(struct ca821x_log_stats *stats_out)
+{
+	stats_out->logged = __atomic_load_n(&s_stats.logged, __ATOMIC_RELAXED);
+	stats_out->suppressed = __atomic_load_n(&s_stats.suppressed,
+	                                        __ATOMIC_RELAXED);
+	stats_out->dropped = __atomic_load_n(&s_stats.dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CA821X_LOG_H
+#define CA821X_LOG_H
+
+#include <stdint.h>
+
+#include "ca821x-posix/ca821x-types.h"
+#include "ca821x-ratelimit.h"
+
+//Log a printf-style message. Each call site has its own token bucket, so a
+//message repeated in a loop can't flood the log. Neither formatting nor
+//queueing the message takes a lock.
+#define CA821X_LOG(level, ...) \
+	do \
+	{ \
+		static struct ratelimit ca821x_log_limit = \
+			RATELIMIT_INIT(CA821X_LOG_RATE, CA821X_LOG_BURST); \
+		if (log_enabled(level)) \
+			log_limited(&ca821x_log_limit, level, __VA_ARGS__); \
+	} while (0)
+
+//Whether messages of a level are being logged
+int log_enabled(enum ca821x_log_level level);
+
+//Queue a message for the log writer if the call site's limit allows it
+void log_limited(struct ratelimit *limit, enum ca821x_log_level level,
+                 const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#endif
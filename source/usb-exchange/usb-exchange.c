@@ -37,38 +37,61 @@
 #include <assert.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <time.h>
+#include <wchar.h>
 
 #include "hidapi/hidapi.h"
 #include "ca821x_api.h"
 #include "ca821x-queue.h"
 #include "ca821x-generic-exchange.h"
+#include "ca821x-log.h"
+#include "ca821x-out-queue.h"
 #include "usb-exchange.h"
-
-#define USB_VID 0x0416
-#define USB_PID 0x5020
+#include "usb-registry.h"
 
 #define MAX_FRAG_SIZE 64
 /** Max time to wait on rx data in milliseconds */
 #define POLL_DELAY 2
 
-#ifndef USB_MAX_DEVICES
-#define USB_MAX_DEVICES 5
+/** Delay before the first attempt to reconnect a lost dongle, in ms */
+#ifndef USB_RECONNECT_MIN_MS
+#define USB_RECONNECT_MIN_MS 50
+#endif
+/** Longest delay between attempts to reconnect a lost dongle, in ms */
+#ifndef USB_RECONNECT_MAX_MS
+#define USB_RECONNECT_MAX_MS 5000
 #endif
 
 #define FRAG_LEN_MASK 0x3F
 #define FRAG_LAST_MASK (1 << 7)
 #define FRAG_FIRST_MASK (1 << 6)
 
+enum usb_link_state
+{
+	usb_link_attached = 0,
+	usb_link_detached //!< Dongle lost, waiting for the reconnector
+};
+
 struct usb_exchange_priv
 {
 	struct ca821x_exchange_base base;
 	hid_device *hid_dev;
 	char *hid_path;
+	char *hid_serial;
+
+	//Reconnection state, protected by devs_mutex. The link state is also
+	//read locklessly by the io thread.
+	enum usb_link_state link_state;
+	unsigned int backoff_ms;
+	struct timespec next_attempt;
+	int closing;
 };
 
-static struct ca821x_dev *s_devs[USB_MAX_DEVICES] = { 0 };
-static int s_devcount = 0;
+//Protected by devs_mutex
+static struct usb_registry s_registry = { 0 };
 static int s_initialised = 0;
+static int s_scans = 0; //!< Scans using the library without devs_mutex held
+static int s_unload_deferred = 0; //!< The last device closed during a scan
 
 //Dynamic hid-api library
 static void *s_hid_lib_handle = NULL;
@@ -79,11 +102,16 @@ static void (*dhid_free_enumeration)(struct hid_device_info *);
 static int (*dhid_read_timeout)(hid_device *, unsigned char *, size_t, int);
 static int (*dhid_write)(hid_device *, const unsigned char *, size_t);
 
-static int reload_hid_device(struct ca821x_dev *pDeviceRef);
-
 static pthread_mutex_t devs_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t devs_cond = PTHREAD_COND_INITIALIZER;
 
+//Background reconnection of lost dongles
+static pthread_t s_reconnect_thread;
+static pthread_cond_t s_reconnect_cond;
+static int s_reconnect_run = 0;
+
+static void detach_device(struct ca821x_dev *pDeviceRef);
+
 //returns 1 for non-final fragment, 0 for final
 static int get_next_frag(const uint8_t *buf_in, uint8_t len_in, uint8_t *frag_out,
                          uint8_t *offset)
@@ -181,7 +209,14 @@ ssize_t usb_try_read(struct ca821x_dev *pDeviceRef,
 	uint8_t delay, len, offset;
 	int error;
 
-	if (peek_queue(priv->base.out_buffer_queue, &(priv->base.out_queue_mutex)))
+	if (__atomic_load_n(&priv->link_state, __ATOMIC_ACQUIRE) == usb_link_detached)
+	{
+		//Nothing to read until the reconnector has found the dongle again
+		usleep(POLL_DELAY * 1000);
+		return 0;
+	}
+
+	if (out_queue_pending(&priv->base))
 	{ //Use a nonblocking read if we are waiting to send messages
 		delay = 0;
 	}
@@ -203,18 +238,14 @@ ssize_t usb_try_read(struct ca821x_dev *pDeviceRef,
 	if(error < 0)
 	{
 		error = -usb_exchange_err_usb;
-		reload_hid_device(pDeviceRef); //usb disconnected - attempt to grab new device
+		detach_device(pDeviceRef); //usb disconnected - reconnect in the background
+		return error;
 	}
 
 	if(buf[0] == 0xF0)
 	{
-		static int ecount = 0;
-		if(ecount < 20)
-		{
-			fprintf(stderr, "\r\nERROR CODE 0x%02x\r\n", buf[2]);
-			fflush(stderr);
-			ecount++;
-		}
+		CA821X_LOG(ca821x_log_error, "device %p reported error code 0x%02x",
+		           (void *)pDeviceRef, buf[2]);
 		//Error packet indicating coprocessor has reset ca821x - let app know
 		if(buf[3]) error = -usb_exchange_err_ca821x;
 	}
@@ -226,6 +257,20 @@ ssize_t usb_try_read(struct ca821x_dev *pDeviceRef,
 	return len;
 }
 
+//Keep a message that couldn't be written to a lost dongle, to be sent once it
+//has been reconnected
+static void hold_message(const uint8_t *buffer, size_t len,
+                         struct ca821x_dev *pDeviceRef)
+{
+	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
+
+	add_to_queue(&(priv->base.restore_out_buffer_queue),
+	             &(priv->base.out_queue_mutex),
+	             buffer,
+	             len,
+	             pDeviceRef);
+}
+
 int usb_try_write(const uint8_t *buffer,
                   size_t len,
                   struct ca821x_dev *pDeviceRef)
@@ -235,6 +280,14 @@ int usb_try_write(const uint8_t *buffer,
 	int rval, error;
 	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
 
+	if (__atomic_load_n(&priv->link_state, __ATOMIC_ACQUIRE) == usb_link_detached)
+	{
+		//Synchronous commands are resent by their caller after recovery
+		if (buffer[0] & SPI_SYN) return -usb_exchange_err_usb;
+		hold_message(buffer, len, pDeviceRef);
+		return 0;
+	}
+
 	do
 	{
 		uint8_t retries = 0;
@@ -249,7 +302,8 @@ int usb_try_write(const uint8_t *buffer,
 	if (error < 0)
 	{
 		error = -usb_exchange_err_usb;
-		reload_hid_device(pDeviceRef); //usb disconnected - attempt to grab new device
+		if (!(buffer[0] & SPI_SYN)) hold_message(buffer, len, pDeviceRef);
+		detach_device(pDeviceRef); //usb disconnected - reconnect in the background
 	}
 	return error;
 }
@@ -329,17 +383,54 @@ int usb_exchange_init(struct ca821x_dev *pDeviceRef)
 	return usb_exchange_init_withhandler(NULL, pDeviceRef);
 }
 
-static int is_hidpath_in_use(char *path)
+//Copy a HID serial number into a newly allocated narrow string. Serials are
+//ASCII in practice, so anything else is replaced rather than converted.
+static char *copy_serial(const wchar_t *serial)
 {
-	int rval;
-	for (int i = 0; i < USB_MAX_DEVICES; i++)
+	size_t len = serial ? wcslen(serial) : 0;
+	char *copy = calloc(1, len + 1);
+
+	if (!copy) return NULL;
+	for (size_t i = 0; i < len; i++)
 	{
-		if (!s_devs[i]) continue;
-		struct usb_exchange_priv *cur = s_devs[i]->exchange_context;
-		rval = strcmp(path, cur->hid_path);
-		if (rval == 0) return 1;
+		copy[i] = (serial[i] > 0 && serial[i] < 0x80) ? (char)serial[i] : '?';
 	}
-	return 0;
+	return copy;
+}
+
+static int serial_matches(const wchar_t *hid_serial, const char *serial)
+{
+	size_t i;
+
+	if (!hid_serial) return 0;
+	for (i = 0; serial[i] && hid_serial[i]; i++)
+	{
+		if (hid_serial[i] != (unsigned char)serial[i]) return 0;
+	}
+	return serial[i] == hid_serial[i];
+}
+
+static int selector_matches(const struct ca821x_device_selector *selector,
+                            const struct hid_device_info *hid)
+{
+	if (!selector) return 1;
+	if (selector->path && strcmp(selector->path, hid->path)) return 0;
+	if (selector->serial && !serial_matches(hid->serial_number, selector->serial))
+		return 0;
+	return 1;
+}
+
+static int is_attached(struct ca821x_dev *pDeviceRef, void *context)
+{
+	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
+	(void)context;
+	//A lost dongle's path is only kept to recognise it by
+	return priv->link_state != usb_link_detached;
+}
+
+static int is_hidpath_in_use(char *path)
+{
+	return !!usb_registry_find(&s_registry.by_path, path, &is_attached, NULL);
 }
 
 static struct hid_device_info *get_next_hid(struct hid_device_info *hid_cur)
@@ -353,45 +444,337 @@ static struct hid_device_info *get_next_hid(struct hid_device_info *hid_cur)
 	return hid_cur;
 }
 
-static int reload_hid_device(struct ca821x_dev *pDeviceRef)
+static void add_ms(struct timespec *ts, unsigned int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int is_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+static int needs_reconnect(struct usb_exchange_priv *priv)
+{
+	return priv->link_state == usb_link_detached && !priv->closing;
+}
+
+//Whether a dongle is remembered by a lost device other than 'self', which
+//should get the chance to reclaim it. Must be called with devs_mutex held.
+static int is_other_lost(struct ca821x_dev *pDeviceRef, void *context)
 {
 	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
-	struct hid_device_info *hid_ll = NULL, *hid_cur = NULL;
-	size_t len;
-	int error = 0;
+	return priv != context && needs_reconnect(priv);
+}
 
-	pthread_mutex_lock(&devs_mutex);
+static int is_awaited_by_other(const struct hid_device_info *hid,
+                               struct usb_exchange_priv *self)
+{
+	struct ca821x_dev *found;
+	char *serial = copy_serial(hid->serial_number);
 
-	dhid_close(priv->hid_dev);
+	//Dongles without a serial number can't be told apart, so nobody waits
+	if (!serial) return 0;
+	found = NULL;
+	if (*serial)
+	{
+		found = usb_registry_find(&s_registry.by_serial, serial,
+		                          &is_other_lost, self);
+	}
+	free(serial);
+	return found != NULL;
+}
+
+//Try to give a lost device a dongle from the enumeration, preferring the one
+//it had before. Must be called with devs_mutex held.
+static int reattach_device(struct ca821x_dev *pDeviceRef,
+                           struct hid_device_info *hid_ll)
+{
+	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
+	struct hid_device_info *hid_cur;
+	hid_device *dev = NULL;
+	char *path, *serial;
+
+	for (hid_cur = hid_ll; hid_cur; hid_cur = hid_cur->next)
+	{
+		if (is_hidpath_in_use(hid_cur->path)) continue;
+		if (!priv->hid_serial || !*priv->hid_serial) break;
+		if (serial_matches(hid_cur->serial_number, priv->hid_serial)) break;
+	}
+
+	if (hid_cur) dev = dhid_open_path(hid_cur->path);
+
+	for (hid_cur = hid_ll; !dev && hid_cur; hid_cur = hid_cur->next)
+	{
+		if (is_hidpath_in_use(hid_cur->path)) continue;
+		if (is_awaited_by_other(hid_cur, priv)) continue;
+		dev = dhid_open_path(hid_cur->path);
+		if (dev) break;
+	}
+
+	if (!dev) return -1;
+
+	path = strdup(hid_cur->path);
+	serial = copy_serial(hid_cur->serial_number);
+	if (!path || !serial)
+	{
+		free(path);
+		free(serial);
+		dhid_close(dev);
+		return -1;
+	}
+
+	//The registry only fails to rekey for lack of memory, in which case the
+	//dongle is still usable, just not found by lookups.
+	usb_registry_rekey(&s_registry, pDeviceRef, priv->hid_path,
+	                   priv->hid_serial, path, serial);
 	free(priv->hid_path);
-	priv->hid_dev = NULL;
-	priv->hid_path = "";
+	free(priv->hid_serial);
+	priv->hid_path = path;
+	priv->hid_serial = serial;
+	priv->hid_dev = dev;
+	__atomic_store_n(&priv->link_state, usb_link_attached, __ATOMIC_RELEASE);
+	CA821X_LOG(ca821x_log_info, "reconnected device %p to USB dongle %s",
+	           (void *)pDeviceRef, path);
 
-	//Iterate through compatible HIDs until one is found that hasn't already
-	//been opened.
-	hid_ll = dhid_enumerate(USB_VID, USB_PID);
-	hid_cur = get_next_hid(hid_ll);
-	while (priv->hid_dev == NULL && hid_cur != NULL)
+	//Wake the recovery thread waiting in usb_wait_ready
+	pthread_cond_broadcast(&devs_cond);
+	return 0;
+}
+
+//Find the earliest time a lost device is due an attempt. Returns 1 if any are
+//due now. Must be called with devs_mutex held.
+static int next_reconnect(const struct timespec *now, struct timespec *wake,
+                          int *waiting)
+{
+	int due = 0;
+
+	*waiting = 0;
+	for (size_t i = 0; i < s_registry.count; i++)
+	{
+		struct usb_exchange_priv *cur = s_registry.devs[i]->exchange_context;
+		if (!needs_reconnect(cur)) continue;
+
+		if (!is_before(now, &cur->next_attempt)) due = 1;
+		if (!*waiting || is_before(&cur->next_attempt, wake))
+			*wake = cur->next_attempt;
+		*waiting = 1;
+	}
+	return due;
+}
+
+static void *reconnect_worker(void *arg)
+{
+	struct hid_device_info *hid_ll;
+	struct timespec now, wake;
+	int waiting;
+
+	(void) arg;
+
+	pthread_mutex_lock(&devs_mutex);
+	while (s_reconnect_run)
 	{
-		priv->hid_dev = dhid_open_path(hid_cur->path);
-		if (priv->hid_dev == NULL)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!next_reconnect(&now, &wake, &waiting))
 		{
-			hid_cur = get_next_hid(hid_cur->next);
+			if (waiting)
+				pthread_cond_timedwait(&s_reconnect_cond, &devs_mutex, &wake);
+			else
+				pthread_cond_wait(&s_reconnect_cond, &devs_mutex);
+			continue;
+		}
+
+		//Enumerating is slow, so don't hold up the healthy devices meanwhile
+		pthread_mutex_unlock(&devs_mutex);
+		hid_ll = dhid_enumerate(USB_VID, USB_PID);
+		pthread_mutex_lock(&devs_mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (size_t i = 0; i < s_registry.count; i++)
+		{
+			struct usb_exchange_priv *cur = s_registry.devs[i]->exchange_context;
+			if (!needs_reconnect(cur)) continue;
+			if (is_before(&now, &cur->next_attempt)) continue;
+
+			if (reattach_device(s_registry.devs[i], hid_ll) == 0) continue;
+
+			cur->next_attempt = now;
+			add_ms(&cur->next_attempt, cur->backoff_ms);
+			cur->backoff_ms *= 2;
+			if (cur->backoff_ms > USB_RECONNECT_MAX_MS)
+				cur->backoff_ms = USB_RECONNECT_MAX_MS;
 		}
+
+		if (hid_ll) dhid_free_enumeration(hid_ll);
 	}
-	if (hid_cur == NULL)
-	{ //Device not found
+	pthread_mutex_unlock(&devs_mutex);
+
+	return NULL;
+}
+
+//Must be called with devs_mutex held
+static int start_reconnector(void)
+{
+	pthread_condattr_t attr;
+
+	if (s_reconnect_run) return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s_reconnect_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	s_reconnect_run = 1;
+	if (pthread_create(&s_reconnect_thread, NULL, &reconnect_worker, NULL))
+	{
+		s_reconnect_run = 0;
+		pthread_cond_destroy(&s_reconnect_cond);
+		return -1;
+	}
+	return 0;
+}
+
+//Stop the reconnector once there are no devices left for it. Must be called
+//without devs_mutex held.
+static void stop_reconnector(void)
+{
+	pthread_mutex_lock(&devs_mutex);
+	if (!s_reconnect_run || s_registry.count)
+	{
+		pthread_mutex_unlock(&devs_mutex);
+		return;
+	}
+	s_reconnect_run = 0;
+	pthread_cond_signal(&s_reconnect_cond);
+	pthread_mutex_unlock(&devs_mutex);
+
+	pthread_join(s_reconnect_thread, NULL);
+	pthread_cond_destroy(&s_reconnect_cond);
+}
+
+//Called on the io thread when the dongle has gone. Its traffic is held until
+//the reconnector finds it again, without stalling the other devices.
+static void detach_device(struct ca821x_dev *pDeviceRef)
+{
+	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
+
+	CA821X_LOG(ca821x_log_warning, "lost USB dongle %s of device %p, reconnecting",
+	           priv->hid_path ? priv->hid_path : "?", (void *)pDeviceRef);
+
+	pthread_mutex_lock(&devs_mutex);
+	dhid_close(priv->hid_dev);
+	priv->hid_dev = NULL;
+	priv->backoff_ms = USB_RECONNECT_MIN_MS;
+	clock_gettime(CLOCK_MONOTONIC, &priv->next_attempt);
+	__atomic_store_n(&priv->link_state, usb_link_detached, __ATOMIC_RELEASE);
+	if (s_reconnect_run) pthread_cond_signal(&s_reconnect_cond);
+	pthread_mutex_unlock(&devs_mutex);
+}
+
+static int usb_wait_ready(struct ca821x_dev *pDeviceRef)
+{
+	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
+	int closing;
+
+	pthread_mutex_lock(&devs_mutex);
+	while (needs_reconnect(priv))
+	{
+		pthread_cond_wait(&devs_cond, &devs_mutex);
+	}
+	closing = priv->closing;
+	pthread_mutex_unlock(&devs_mutex);
+
+	return closing ? -1 : 0;
+}
+
+void usb_exchange_kick_reconnect(void)
+{
+	struct timespec now;
+
+	pthread_mutex_lock(&devs_mutex);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (size_t i = 0; i < s_registry.count; i++)
+	{
+		struct usb_exchange_priv *cur = s_registry.devs[i]->exchange_context;
+		if (!needs_reconnect(cur)) continue;
+		cur->next_attempt = now;
+		cur->backoff_ms = USB_RECONNECT_MIN_MS;
+	}
+	if (s_reconnect_run) pthread_cond_signal(&s_reconnect_cond);
+	pthread_mutex_unlock(&devs_mutex);
+}
+
+//Set up the exchange for an opened hid device and add it to the device list.
+//Must be called with devs_mutex held.
+static int attach_device(hid_device *dev, const struct hid_device_info *hid,
+                         ca821x_errorhandler callback,
+                         struct ca821x_dev *pDeviceRef)
+{
+	struct usb_exchange_priv *priv = NULL;
+	int registered = 0;
+	int error = 0;
+
+	pDeviceRef->exchange_context = calloc(1, sizeof(struct usb_exchange_priv));
+	priv = pDeviceRef->exchange_context;
+	if (!priv)
+	{
+		error = -1;
+		goto exit;
+	}
+	priv->base.exchange_type = ca821x_exchange_usb;
+	priv->base.error_callback = callback;
+	priv->base.write_func = usb_try_write;
+	priv->base.read_func = usb_try_read;
+	priv->base.flush_func = flush_unread_usb;
+	priv->base.ready_func = usb_wait_ready;
+
+	priv->hid_path = strdup(hid->path);
+	priv->hid_serial = copy_serial(hid->serial_number);
+	priv->hid_dev = dev;
+	if (!priv->hid_path || !priv->hid_serial)
+	{
 		error = -1;
 		goto exit;
 	}
 
-	len = strlen(hid_cur->path);
-	priv->hid_path = calloc(1, len + 1);
-	strncpy(priv->hid_path, hid_cur->path, len);
+	error = start_reconnector();
+	if (error) goto exit;
+
+	//Add the new device to the device list
+	error = usb_registry_add(&s_registry, pDeviceRef, priv->hid_path,
+	                         priv->hid_serial);
+	if (error) goto exit;
+	registered = 1;
+
+	error = init_generic(pDeviceRef);
+
+	if (error != 0)
+	{
+		error = -1;
+		goto exit;
+	}
+	pthread_cond_signal(&devs_cond);
 
 exit:
-	pthread_mutex_unlock(&devs_mutex);
-	if (hid_ll) dhid_free_enumeration(hid_ll);
+	if (error && registered)
+	{
+		usb_registry_remove(&s_registry, pDeviceRef, priv->hid_path,
+		                    priv->hid_serial);
+	}
+	if (error && priv)
+	{
+		free(priv->hid_path);
+		free(priv->hid_serial);
+		free(priv);
+		pDeviceRef->exchange_context = NULL;
+	}
 	return error;
 }
 
@@ -400,9 +783,7 @@ int usb_exchange_init_withhandler(ca821x_errorhandler callback,
 {
 	struct hid_device_info *hid_ll = NULL, *hid_cur = NULL;
 	hid_device *dev = NULL;
-	struct usb_exchange_priv *priv = NULL;
 	int error = 0;
-	size_t len = 0;
 
 	if (!s_initialised)
 	{
@@ -413,11 +794,6 @@ int usb_exchange_init_withhandler(ca821x_errorhandler callback,
 	if (pDeviceRef->exchange_context) return 1;
 
 	pthread_mutex_lock(&devs_mutex);
-	if (s_devcount >= USB_MAX_DEVICES)
-	{
-		error = -1;
-		goto exit;
-	}
 
 	//Iterate through compatible HIDs until one is found that hasn't already
 	//been opened.
@@ -437,73 +813,178 @@ int usb_exchange_init_withhandler(ca821x_errorhandler callback,
 		goto exit;
 	}
 
-	pDeviceRef->exchange_context = calloc(1, sizeof(struct usb_exchange_priv));
-	priv = pDeviceRef->exchange_context;
-	priv->base.exchange_type = ca821x_exchange_usb;
-	priv->base.error_callback = callback;
-	priv->base.write_func = usb_try_write;
-	priv->base.read_func = usb_try_read;
-	priv->base.flush_func = flush_unread_usb;
+	error = attach_device(dev, hid_cur, callback, pDeviceRef);
+	if (error) dhid_close(dev);
 
-	len = strlen(hid_cur->path);
-	priv->hid_path = calloc(1, len + 1);
-	strncpy(priv->hid_path, hid_cur->path, len);
-	priv->hid_dev = dev;
+exit:
+	if (hid_ll) dhid_free_enumeration(hid_ll);
+	pthread_mutex_unlock(&devs_mutex);
+	return error;
+}
 
-	error = init_generic(pDeviceRef);
+int usb_exchange_scan(usb_exchange_scan_callback callback, void *context)
+{
+	struct hid_device_info *hid_ll = NULL, *hid_cur = NULL;
+	char *serial;
+	int error = 0;
 
-	if (error != 0)
+	//Keep the library loaded until the scan is done with it
+	pthread_mutex_lock(&devs_mutex);
+	if (!s_initialised) error = init_statics();
+	if (!error) s_scans++;
+	pthread_mutex_unlock(&devs_mutex);
+	if (error) return error;
+
+	//The device list isn't needed, so don't hold up the other devices
+	hid_ll = dhid_enumerate(USB_VID, USB_PID);
+	for (hid_cur = hid_ll; hid_cur; hid_cur = hid_cur->next)
 	{
-		error = -1;
-		goto exit;
+		serial = copy_serial(hid_cur->serial_number);
+		callback(hid_cur->path, serial ? serial : "", context);
+		free(serial);
 	}
+	if (hid_ll) dhid_free_enumeration(hid_ll);
 
-	//Add the new device to the device list for io
-	s_devcount++;
-	pthread_cond_signal(&devs_cond);
-	for (int i = 0; i < USB_MAX_DEVICES; i++)
+	pthread_mutex_lock(&devs_mutex);
+	if (--s_scans == 0 && s_unload_deferred)
+	{
+		s_unload_deferred = 0;
+		if (s_registry.count == 0) deinit_statics();
+	}
+	pthread_mutex_unlock(&devs_mutex);
+	return error;
+}
+
+struct bulk_open_job
+{
+	const struct hid_device_info *hid;
+	hid_device *dev;
+	pthread_t thread;
+	int started;
+};
+
+static void *bulk_open_worker(void *arg)
+{
+	struct bulk_open_job *job = arg;
+
+	job->dev = dhid_open_path(job->hid->path);
+	return NULL;
+}
+
+int usb_exchange_init_bulk(struct ca821x_dev *devs,
+                           const struct ca821x_device_selector *selectors,
+                           size_t count,
+                           ca821x_errorhandler callback)
+{
+	struct hid_device_info *hid_ll = NULL, *hid_cur = NULL;
+	struct bulk_open_job *jobs = NULL;
+	size_t i, j;
+	int initialised = 0;
+	int error = 0;
+
+	if (!s_initialised)
 	{
-		if (s_devs[i] == NULL)
+		error = init_statics();
+		if (error) return -1;
+	}
+
+	jobs = calloc(count ? count : 1, sizeof(struct bulk_open_job));
+	if (!jobs) return -1;
+
+	//Hold the device list for the whole bring-up, so that the paths chosen
+	//here can't be claimed by another init or a reconnecting device.
+	pthread_mutex_lock(&devs_mutex);
+
+	//A single enumeration serves every device
+	hid_ll = dhid_enumerate(USB_VID, USB_PID);
+
+	for (i = 0; i < count; i++)
+	{
+		if (devs[i].exchange_context) continue;
+
+		for (hid_cur = get_next_hid(hid_ll); hid_cur;
+		     hid_cur = get_next_hid(hid_cur->next))
 		{
-			s_devs[i] = pDeviceRef;
-			break;
+			if (!selector_matches(selectors ? &selectors[i] : NULL, hid_cur))
+				continue;
+
+			//Skip paths already chosen for an earlier entry
+			for (j = 0; j < i; j++)
+			{
+				if (jobs[j].hid == hid_cur) break;
+			}
+			if (j == i) break;
 		}
+
+		if (!hid_cur) continue;
+		jobs[i].hid = hid_cur;
+		initialised++;
 	}
 
-exit:
-	if (hid_ll) dhid_free_enumeration(hid_ll);
-	if (error && pDeviceRef->exchange_context)
+	//Opening a dongle takes far longer than enumerating, so do them all at once
+	for (i = 0; i < count; i++)
 	{
-		free(priv->hid_path);
-		free(pDeviceRef->exchange_context);
-		pDeviceRef->exchange_context = NULL;
+		if (!jobs[i].hid) continue;
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+		                                  &bulk_open_worker, &jobs[i]);
+		if (!jobs[i].started) bulk_open_worker(&jobs[i]);
 	}
+
+	initialised = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (!jobs[i].hid) continue;
+		if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+		if (!jobs[i].dev) continue;
+
+		//The generic exchange is set up one device at a time
+		if (attach_device(jobs[i].dev, jobs[i].hid, callback, &devs[i]))
+		{
+			dhid_close(jobs[i].dev);
+			continue;
+		}
+		initialised++;
+	}
+
 	pthread_mutex_unlock(&devs_mutex);
-	return error;
+
+	if (hid_ll) dhid_free_enumeration(hid_ll);
+	free(jobs);
+	return initialised;
 }
 
 void usb_exchange_deinit(struct ca821x_dev *pDeviceRef)
 {
 	struct usb_exchange_priv *priv = pDeviceRef->exchange_context;
 
+	//Stop any reconnection, and release a recovery thread waiting for one
+	pthread_mutex_lock(&devs_mutex);
+	priv->closing = 1;
+	pthread_cond_broadcast(&devs_cond);
+	pthread_mutex_unlock(&devs_mutex);
+
 	deinit_generic(pDeviceRef);
-	dhid_close(priv->hid_dev);
+	if (priv->hid_dev) dhid_close(priv->hid_dev);
 
 	pthread_mutex_lock(&devs_mutex);
-	s_devcount--;
-	if (s_devcount == 0) deinit_statics();
+	usb_registry_remove(&s_registry, pDeviceRef, priv->hid_path,
+	                    priv->hid_serial);
 	pthread_cond_signal(&devs_cond);
-	for (int i = 0; i < USB_MAX_DEVICES; i++)
+	pthread_mutex_unlock(&devs_mutex);
+
+	stop_reconnector();
+
+	pthread_mutex_lock(&devs_mutex);
+	if (s_registry.count == 0)
 	{
-		if (s_devs[i] == pDeviceRef)
-		{
-			s_devs[i] = NULL;
-			break;
-		}
+		usb_registry_clear(&s_registry);
+		if (s_scans) s_unload_deferred = 1;
+		else deinit_statics();
 	}
 	pthread_mutex_unlock(&devs_mutex);
 
 	free(priv->hid_path);
+	free(priv->hid_serial);
 	free(priv);
 	pDeviceRef->exchange_context = NULL;
 }
@@ -521,10 +1002,5 @@ int usb_exchange_user_send(const uint8_t *buf, size_t len,
 	assert(!(buf[0] & SPI_SYN));
 	assert(len < MAX_BUF_SIZE);
 	if (!s_initialised) return -1;
-	add_to_queue(&(priv->base.out_buffer_queue),
-	             &(priv->base.out_queue_mutex),
-	             buf,
-	             len,
-	             pDeviceRef);
-	return 0;
+	return out_queue_add(&priv->base, ca821x_out_user, buf, len, pDeviceRef);
 }
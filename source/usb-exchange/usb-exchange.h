@@ -36,6 +36,9 @@
 #include "ca821x-posix/ca821x-types.h"
 #define TEST_ENABLE 1
 
+#define USB_VID 0x0416
+#define USB_PID 0x5020
+
 enum usb_exchange_errors {
 	usb_exchange_err_usb = 1,		//Usb error - probably device removed and going to have to crash safely
 	usb_exchange_err_ca821x,	//ca821x error - ca821x has been reset
@@ -77,6 +80,39 @@ int usb_exchange_init(struct ca821x_dev *pDeviceRef);
 int usb_exchange_init_withhandler(ca821x_errorhandler callback,
                                   struct ca821x_dev *pDeviceRef);
 
+/**
+ * Initialise the usb exchange for several devices at once. The attached
+ * dongles are enumerated a single time, each entry of devs is matched to an
+ * unused dongle according to its selector, and the matched dongles are then
+ * opened in parallel. Entries that are already initialised, or that no dongle
+ * could be found for, are left untouched.
+ *
+ * @param[in,out]  devs        Array of device references to initialise
+ * @param[in]      selectors   Array of count selectors, one for each entry of
+ *                             devs, or NULL to take any available dongles
+ * @param[in]      count       Number of entries in devs
+ * @param[in]      callback    Function pointer to an error-handling callback
+ *
+ * @returns Number of devices initialised, or -1 for error
+ *
+ */
+int usb_exchange_init_bulk(struct ca821x_dev *devs,
+                           const struct ca821x_device_selector *selectors,
+                           size_t count,
+                           ca821x_errorhandler callback);
+
+//Called by usb_exchange_scan for each attached dongle
+typedef void (*usb_exchange_scan_callback)(const char *path, const char *serial,
+                                           void *context);
+
+//Enumerate the attached dongles, calling callback for each of them. Returns 0
+//for success, -1 for error.
+int usb_exchange_scan(usb_exchange_scan_callback callback, void *context);
+
+//Retry reconnecting any lost dongles straight away, for example because
+//hotplug has seen a new one arrive
+void usb_exchange_kick_reconnect(void);
+
 /**
  * Sends a USB command over the USB interface using the TLV format from ca821x-spi.
  *
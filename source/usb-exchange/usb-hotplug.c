@@ -0,0 +1,373 @@
+/**
+ * @file usb-hotplug.c
+ * @brief Event-driven discovery of ca821x USB dongles
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "usb-exchange.h"
+
+//Time to let a burst of events settle before the bus is rescanned, which also
+//gives udev time to set up the permissions of a new device node
+#ifndef USB_HOTPLUG_SETTLE_MS
+#define USB_HOTPLUG_SETTLE_MS 100
+#endif
+
+//Directory watched when kernel uevents are unavailable
+#define USB_HOTPLUG_DEFAULT_DIR "/dev"
+
+#define UEVENT_BUFFER_SIZE 4096
+
+struct known_dongle
+{
+	char *path;
+	char *serial;
+	int present;
+	int announced;
+	struct known_dongle *next;
+};
+
+static pthread_mutex_t s_hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_hotplug_running = 0;
+static pthread_t s_hotplug_thread;
+static int s_event_fd = -1;
+static int s_using_inotify = 0;
+static int s_stop_pipe[2] = {-1, -1};
+static char *s_watch_dir = NULL;
+
+static ca821x_hotplug_callback s_arrival, s_departure;
+static void *s_context;
+
+//Only touched by the hotplug thread
+static struct known_dongle *s_known = NULL;
+
+static int open_uevent_socket(void)
+{
+	struct sockaddr_nl addr = {0};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	            NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) return -1;
+
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; //Kernel uevents
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int open_inotify(const char *dir)
+{
+	int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+	if (fd < 0) return -1;
+
+	if (inotify_add_watch(fd, dir, IN_CREATE | IN_DELETE | IN_ATTRIB |
+	                               IN_MOVED_FROM | IN_MOVED_TO) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//A uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings, all nul
+//terminated. Only hidraw nodes and our own USB devices are interesting.
+static int is_relevant_uevent(const char *buf, ssize_t len)
+{
+	char product[32];
+	int is_usb = 0, is_ours = 0;
+	ssize_t i;
+
+	snprintf(product, sizeof(product), "PRODUCT=%x/%x/", USB_VID, USB_PID);
+
+	for (i = 0; i < len; i += strlen(&buf[i]) + 1)
+	{
+		if (!strcmp(&buf[i], "SUBSYSTEM=hidraw")) return 1;
+		if (!strcmp(&buf[i], "SUBSYSTEM=usb")) is_usb = 1;
+		if (!strncmp(&buf[i], product, strlen(product))) is_ours = 1;
+	}
+	return is_usb && is_ours;
+}
+
+//Drain the event source, returning 1 if anything warrants a rescan
+static int read_events(int fd)
+{
+	char buf[UEVENT_BUFFER_SIZE]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	ssize_t len;
+	int relevant = 0;
+
+	while ((len = read(fd, buf, sizeof(buf) - 1)) > 0)
+	{
+		if (!s_using_inotify)
+		{
+			buf[len] = '\0';
+			relevant |= is_relevant_uevent(buf, len);
+			continue;
+		}
+
+		for (char *ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + event->len)
+		{
+			event = (struct inotify_event *)ptr;
+			if (event->len && !strncmp(event->name, "hidraw", 6)) relevant = 1;
+		}
+	}
+
+	return relevant;
+}
+
+static void found_dongle(const char *path, const char *serial, void *context)
+{
+	struct known_dongle *cur;
+
+	(void) context;
+
+	for (cur = s_known; cur; cur = cur->next)
+	{
+		if (!strcmp(cur->path, path) && !strcmp(cur->serial, serial))
+		{
+			cur->present = 1;
+			return;
+		}
+	}
+
+	cur = calloc(1, sizeof(struct known_dongle));
+	if (!cur) return;
+	cur->path = strdup(path);
+	cur->serial = strdup(serial);
+	if (!cur->path || !cur->serial)
+	{
+		free(cur->path);
+		free(cur->serial);
+		free(cur);
+		return;
+	}
+	cur->present = 1;
+	cur->next = s_known;
+	s_known = cur;
+}
+
+//Enumerate the bus and report the differences from the last scan. The
+//callbacks are only called once the device list has been released, so that
+//they are free to initialise devices.
+static void rescan(void)
+{
+	struct known_dongle **prev, *cur;
+
+	for (cur = s_known; cur; cur = cur->next)
+	{
+		cur->present = 0;
+	}
+
+	if (usb_exchange_scan(&found_dongle, NULL)) return;
+
+	prev = &s_known;
+	while ((cur = *prev) != NULL)
+	{
+		if (cur->present && !cur->announced)
+		{
+			cur->announced = 1;
+			usb_exchange_kick_reconnect();
+			if (s_arrival) s_arrival(cur->path, cur->serial, s_context);
+		}
+		else if (!cur->present)
+		{
+			if (s_departure) s_departure(cur->path, cur->serial, s_context);
+			*prev = cur->next;
+			free(cur->path);
+			free(cur->serial);
+			free(cur);
+			continue;
+		}
+		prev = &cur->next;
+	}
+}
+
+static void forget_dongles(void)
+{
+	struct known_dongle *cur;
+
+	while ((cur = s_known) != NULL)
+	{
+		s_known = cur->next;
+		free(cur->path);
+		free(cur->serial);
+		free(cur);
+	}
+}
+
+static void *hotplug_worker(void *arg)
+{
+	struct pollfd fds[2];
+	int pending = 0;
+	int rval;
+
+	(void) arg;
+
+	fds[0].fd = s_event_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = s_stop_pipe[0];
+	fds[1].events = POLLIN;
+
+	rescan();
+
+	while (1)
+	{
+		rval = poll(fds, 2, pending ? USB_HOTPLUG_SETTLE_MS : -1);
+
+		if (rval < 0 && errno != EINTR) break;
+		if (fds[1].revents) break;
+
+		if (rval == 0)
+		{
+			pending = 0;
+			rescan();
+		}
+		else if (rval > 0 && (fds[0].revents & POLLIN))
+		{
+			pending |= read_events(s_event_fd);
+		}
+	}
+
+	forget_dongles();
+	return NULL;
+}
+
+int ca821x_util_start_hotplug(ca821x_hotplug_callback arrival,
+                              ca821x_hotplug_callback departure,
+                              void *context)
+{
+	int error = 0;
+
+	pthread_mutex_lock(&s_hotplug_mutex);
+	if (s_hotplug_running)
+	{
+		error = -1;
+		goto exit;
+	}
+
+	s_using_inotify = 0;
+	s_event_fd = -1;
+	if (!s_watch_dir) s_event_fd = open_uevent_socket();
+	if (s_event_fd < 0)
+	{
+		s_using_inotify = 1;
+		s_event_fd = open_inotify(s_watch_dir ? s_watch_dir : USB_HOTPLUG_DEFAULT_DIR);
+	}
+	if (s_event_fd < 0)
+	{
+		error = -1;
+		goto exit;
+	}
+
+	if (pipe(s_stop_pipe))
+	{
+		error = -1;
+		goto exit;
+	}
+
+	s_arrival = arrival;
+	s_departure = departure;
+	s_context = context;
+
+	if (pthread_create(&s_hotplug_thread, NULL, &hotplug_worker, NULL))
+	{
+		error = -1;
+		goto exit;
+	}
+	s_hotplug_running = 1;
+
+exit:
+	if (error && !s_hotplug_running)
+	{
+		if (s_event_fd >= 0) close(s_event_fd);
+		if (s_stop_pipe[0] >= 0) close(s_stop_pipe[0]);
+		if (s_stop_pipe[1] >= 0) close(s_stop_pipe[1]);
+		s_event_fd = s_stop_pipe[0] = s_stop_pipe[1] = -1;
+	}
+	pthread_mutex_unlock(&s_hotplug_mutex);
+	return error;
+}
+
+void ca821x_util_stop_hotplug(void)
+{
+	const char stop = 0;
+
+	pthread_mutex_lock(&s_hotplug_mutex);
+	if (!s_hotplug_running) goto exit;
+
+	while (write(s_stop_pipe[1], &stop, 1) < 0 && errno == EINTR);
+	pthread_join(s_hotplug_thread, NULL);
+
+	close(s_event_fd);
+	close(s_stop_pipe[0]);
+	close(s_stop_pipe[1]);
+	s_event_fd = s_stop_pipe[0] = s_stop_pipe[1] = -1;
+	s_hotplug_running = 0;
+
+exit:
+	pthread_mutex_unlock(&s_hotplug_mutex);
+}
+
+int ca821x_util_set_hotplug_dir(const char *dir)
+{
+	char *copy = NULL;
+
+	if (dir)
+	{
+		copy = strdup(dir);
+		if (!copy) return -1;
+	}
+
+	pthread_mutex_lock(&s_hotplug_mutex);
+	free(s_watch_dir);
+	s_watch_dir = copy;
+	pthread_mutex_unlock(&s_hotplug_mutex);
+	return 0;
+}
@@ -0,0 +1,208 @@
+/**
+ * @file usb-registry.c
+ * @brief Hash-indexed registry of open USB devices
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb-registry.h"
+
+#define INITIAL_BUCKETS 16
+#define INITIAL_CAPACITY 8
+
+//FNV-1a
+static size_t hash_key(const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key)
+	{
+		hash ^= (uint8_t)*key++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//Double the bucket count once the index is more than 3/4 full
+static int grow_index(struct usb_registry_index *index)
+{
+	struct usb_registry_node **buckets, *node, *next;
+	size_t bucket_count;
+
+	if (index->bucket_count && index->count * 4 < index->bucket_count * 3)
+		return 0;
+
+	bucket_count = index->bucket_count ? index->bucket_count * 2 : INITIAL_BUCKETS;
+	buckets = calloc(bucket_count, sizeof(*buckets));
+	if (!buckets) return -1;
+
+	for (size_t i = 0; i < index->bucket_count; i++)
+	{
+		for (node = index->buckets[i]; node; node = next)
+		{
+			size_t b = hash_key(node->key) & (bucket_count - 1);
+
+			next = node->next;
+			node->next = buckets[b];
+			buckets[b] = node;
+		}
+	}
+
+	free(index->buckets);
+	index->buckets = buckets;
+	index->bucket_count = bucket_count;
+	return 0;
+}
+
+static int index_add(struct usb_registry_index *index, const char *key,
+                     struct ca821x_dev *pDeviceRef)
+{
+	struct usb_registry_node *node;
+	size_t b;
+
+	if (grow_index(index)) return -1;
+
+	node = malloc(sizeof(*node));
+	if (!node) return -1;
+
+	b = hash_key(key) & (index->bucket_count - 1);
+	node->key = key;
+	node->pDeviceRef = pDeviceRef;
+	node->next = index->buckets[b];
+	index->buckets[b] = node;
+	index->count++;
+	return 0;
+}
+
+static void index_remove(struct usb_registry_index *index, const char *key,
+                         struct ca821x_dev *pDeviceRef)
+{
+	struct usb_registry_node **prev, *node;
+
+	if (!index->bucket_count) return;
+
+	prev = &index->buckets[hash_key(key) & (index->bucket_count - 1)];
+	while ((node = *prev) != NULL)
+	{
+		if (node->pDeviceRef == pDeviceRef && !strcmp(node->key, key))
+		{
+			*prev = node->next;
+			free(node);
+			index->count--;
+			return;
+		}
+		prev = &node->next;
+	}
+}
+
+int usb_registry_add(struct usb_registry *reg, struct ca821x_dev *pDeviceRef,
+                     const char *path, const char *serial)
+{
+	if (reg->count == reg->capacity)
+	{
+		size_t capacity = reg->capacity ? reg->capacity * 2 : INITIAL_CAPACITY;
+		struct ca821x_dev **devs = realloc(reg->devs, capacity * sizeof(*devs));
+
+		if (!devs) return -1;
+		reg->devs = devs;
+		reg->capacity = capacity;
+	}
+
+	if (index_add(&reg->by_path, path, pDeviceRef)) return -1;
+	if (index_add(&reg->by_serial, serial, pDeviceRef))
+	{
+		index_remove(&reg->by_path, path, pDeviceRef);
+		return -1;
+	}
+
+	reg->devs[reg->count++] = pDeviceRef;
+	return 0;
+}
+
+void usb_registry_remove(struct usb_registry *reg, struct ca821x_dev *pDeviceRef,
+                         const char *path, const char *serial)
+{
+	index_remove(&reg->by_path, path, pDeviceRef);
+	index_remove(&reg->by_serial, serial, pDeviceRef);
+
+	for (size_t i = 0; i < reg->count; i++)
+	{
+		if (reg->devs[i] == pDeviceRef)
+		{
+			reg->devs[i] = reg->devs[--reg->count];
+			break;
+		}
+	}
+}
+
+int usb_registry_rekey(struct usb_registry *reg, struct ca821x_dev *pDeviceRef,
+                       const char *old_path, const char *old_serial,
+                       const char *path, const char *serial)
+{
+	index_remove(&reg->by_path, old_path, pDeviceRef);
+	index_remove(&reg->by_serial, old_serial, pDeviceRef);
+
+	if (index_add(&reg->by_path, path, pDeviceRef)) return -1;
+	if (index_add(&reg->by_serial, serial, pDeviceRef))
+	{
+		index_remove(&reg->by_path, path, pDeviceRef);
+		return -1;
+	}
+	return 0;
+}
+
+struct ca821x_dev *usb_registry_find(const struct usb_registry_index *index,
+                                     const char *key, usb_registry_match match,
+                                     void *context)
+{
+	struct usb_registry_node *node;
+
+	if (!index->bucket_count) return NULL;
+
+	node = index->buckets[hash_key(key) & (index->bucket_count - 1)];
+	for (; node; node = node->next)
+	{
+		if (strcmp(node->key, key)) continue;
+		if (!match || match(node->pDeviceRef, context)) return node->pDeviceRef;
+	}
+	return NULL;
+}
+
+void usb_registry_clear(struct usb_registry *reg)
+{
+	free(reg->by_path.buckets);
+	free(reg->by_serial.buckets);
+	free(reg->devs);
+	memset(reg, 0, sizeof(*reg));
+}
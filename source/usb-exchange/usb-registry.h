@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USB_REGISTRY_H
+#define USB_REGISTRY_H
+
+#include <stddef.h>
+
+#include "ca821x-posix/ca821x-types.h"
+
+struct usb_registry_node
+{
+	const char *key; //!< Owned by the device's exchange
+	struct ca821x_dev *pDeviceRef;
+	struct usb_registry_node *next;
+};
+
+//String-keyed hash index. Several devices may share a key.
+struct usb_registry_index
+{
+	struct usb_registry_node **buckets;
+	size_t bucket_count;
+	size_t count;
+};
+
+//The open usb devices, in a list for iteration and indexed by hid path and
+//serial number. Not locked, so the caller must serialise access.
+struct usb_registry
+{
+	struct ca821x_dev **devs;
+	size_t count;
+	size_t capacity;
+	struct usb_registry_index by_path;
+	struct usb_registry_index by_serial;
+};
+
+//Called by usb_registry_find to check each device with a matching key
+typedef int (*usb_registry_match)(struct ca821x_dev *pDeviceRef, void *context);
+
+//Add a device, keyed by the given strings, which must stay valid until the
+//device is removed or rekeyed. Returns 0 for success, -1 for error.
+int usb_registry_add(struct usb_registry *reg, struct ca821x_dev *pDeviceRef,
+                     const char *path, const char *serial);
+
+//Remove a device that was added with the given keys
+void usb_registry_remove(struct usb_registry *reg, struct ca821x_dev *pDeviceRef,
+                         const char *path, const char *serial);
+
+//Change the keys of a device, eg. after reconnecting it to another dongle.
+//Returns 0 for success, -1 for error (in which case the device is unindexed).
+int usb_registry_rekey(struct usb_registry *reg, struct ca821x_dev *pDeviceRef,
+                       const char *old_path, const char *old_serial,
+                       const char *path, const char *serial);
+
+//Find a device with the given key that 'match' accepts (or any, if match is
+//NULL). Returns NULL if there is none.
+struct ca821x_dev *usb_registry_find(const struct usb_registry_index *index,
+                                     const char *key, usb_registry_match match,
+                                     void *context);
+
+//Free everything allocated by the registry. It must be empty.
+void usb_registry_clear(struct usb_registry *reg);
+
+#endif
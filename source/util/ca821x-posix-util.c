@@ -51,6 +51,19 @@ exit:
 	return error;
 }
 
+int ca821x_util_init_bulk(struct ca821x_dev *devs,
+                          const struct ca821x_device_selector *selectors,
+                          size_t count,
+                          ca821x_errorhandler errorHandler)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (ca821x_api_init(&devs[i])) return -1;
+	}
+
+	return usb_exchange_init_bulk(devs, selectors, count, errorHandler);
+}
+
 void ca821x_util_deinit(struct ca821x_dev *pDeviceRef)
 {
 	struct ca821x_exchange_base *base = pDeviceRef->exchange_context;
@@ -0,0 +1,232 @@
+/**
+ * @file filter-test.c
+ * @brief Tests for the receive filter predicate compiler and interpreter
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ca821x-filter.h"
+#include "ca821x-msg.h"
+#include "ca821x_api.h"
+
+#define OP(o, a) { ca821x_filter_op_##o, (a) }
+#define INSN(o, a) ((struct ca821x_filter_insn)OP(o, a))
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			        #cond); \
+			s_failures++; \
+		} \
+	} while (0)
+
+//Run a predicate through a single dropping filter, returning 1 if it matched
+static int matches(const struct ca821x_filter_insn *predicate, size_t len,
+                   const uint8_t *buf, size_t buflen)
+{
+	struct ca821x_filter filter;
+	struct filter_set *set;
+	int drops = -1;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.action = ca821x_filter_drop;
+	filter.any_cmd = 1;
+	filter.predicate = predicate;
+	filter.predicate_len = len;
+
+	set = filter_set_create();
+	if (!set) return -1;
+	if (filter_set_add(set, &filter) >= 0)
+		drops = filter_set_drops(set, buf, buflen);
+	filter_set_destroy(set);
+
+	return drops;
+}
+
+static void test_compile(void)
+{
+	struct ca821x_filter_insn insns[CA821X_FILTER_MAX_INSNS + 1];
+	const struct ca821x_filter_insn valid[] = {
+		OP(byte, 0), OP(const, 0x20), OP(eq, 0), OP(len, 0), OP(const, 4),
+		OP(gt, 0), OP(and, 0), OP(not, 0)
+	};
+	const struct ca821x_filter_insn underflow[] = { OP(const, 1), OP(eq, 0) };
+	const struct ca821x_filter_insn unary_empty[] = { OP(not, 0) };
+	const struct ca821x_filter_insn two_left[] = { OP(const, 1), OP(const, 2) };
+	const struct ca821x_filter_insn bad_op[] = {
+		{ ca821x_filter_op_count, 0 }
+	};
+
+	CHECK(filter_compile(NULL, 0) == 0);
+	CHECK(filter_compile(valid, sizeof(valid) / sizeof(valid[0])) == 0);
+	CHECK(filter_compile(underflow, 2) == -1);
+	CHECK(filter_compile(unary_empty, 1) == -1);
+	CHECK(filter_compile(two_left, 2) == -1);
+	CHECK(filter_compile(bad_op, 1) == -1);
+
+	//Deepest stack allowed, then one more
+	for (int i = 0; i < CA821X_FILTER_STACK_DEPTH; i++)
+		insns[i] = INSN(const, i);
+	for (int i = 0; i < CA821X_FILTER_STACK_DEPTH - 1; i++)
+		insns[CA821X_FILTER_STACK_DEPTH + i] = INSN(or, 0);
+	CHECK(filter_compile(insns, 2 * CA821X_FILTER_STACK_DEPTH - 1) == 0);
+	for (int i = 0; i <= CA821X_FILTER_STACK_DEPTH; i++)
+		insns[i] = INSN(const, i);
+	for (int i = 0; i < CA821X_FILTER_STACK_DEPTH; i++)
+		insns[CA821X_FILTER_STACK_DEPTH + 1 + i] = INSN(or, 0);
+	CHECK(filter_compile(insns, 2 * CA821X_FILTER_STACK_DEPTH + 1) == -1);
+
+	//Longest predicate allowed, then one more
+	insns[0] = INSN(const, 1);
+	for (int i = 1; i <= CA821X_FILTER_MAX_INSNS; i++)
+		insns[i] = INSN(not, 0);
+	CHECK(filter_compile(insns, CA821X_FILTER_MAX_INSNS) == 0);
+	CHECK(filter_compile(insns, CA821X_FILTER_MAX_INSNS + 1) == -1);
+}
+
+static void test_loads(void)
+{
+	const uint8_t msg[] = { SPI_MCPS_DATA_INDICATION, 3, 0x34, 0x12, 0xff };
+	const struct ca821x_filter_insn byte[] = {
+		OP(byte, 2), OP(const, 0x34), OP(eq, 0)
+	};
+	const struct ca821x_filter_insn half[] = {
+		OP(half, 2), OP(const, 0x1234), OP(eq, 0)
+	};
+	const struct ca821x_filter_insn len[] = {
+		OP(len, 0), OP(const, 5), OP(eq, 0)
+	};
+	const struct ca821x_filter_insn past_end[] = { OP(byte, 5), OP(not, 0) };
+	const struct ca821x_filter_insn half_end[] = {
+		OP(half, 4), OP(const, 0xff), OP(eq, 0)
+	};
+
+	CHECK(matches(byte, 3, msg, sizeof(msg)) == 1);
+	CHECK(matches(half, 3, msg, sizeof(msg)) == 1);
+	CHECK(matches(len, 3, msg, sizeof(msg)) == 1);
+	CHECK(matches(len, 3, msg, sizeof(msg) - 1) == 0);
+	//Anything beyond the end of the message reads as zero
+	CHECK(matches(past_end, 2, msg, sizeof(msg)) == 1);
+	CHECK(matches(half_end, 3, msg, sizeof(msg)) == 1);
+}
+
+static void test_operators(void)
+{
+	const uint8_t msg[] = { SPI_MCPS_DATA_INDICATION, 2, 0x5a, 7 };
+	const struct ca821x_filter_insn mask[] = {
+		OP(byte, 2), OP(mask, 0x0f), OP(const, 0x0a), OP(eq, 0)
+	};
+	const struct ca821x_filter_insn ne[] = {
+		OP(byte, 3), OP(const, 7), OP(ne, 0)
+	};
+	const struct ca821x_filter_insn lt[] = {
+		OP(byte, 3), OP(const, 8), OP(lt, 0)
+	};
+	const struct ca821x_filter_insn gt[] = {
+		OP(byte, 3), OP(const, 7), OP(gt, 0)
+	};
+	const struct ca821x_filter_insn and[] = {
+		OP(const, 1), OP(const, 0), OP(and, 0)
+	};
+	const struct ca821x_filter_insn or[] = {
+		OP(const, 0), OP(const, 2), OP(or, 0)
+	};
+	const struct ca821x_filter_insn not[] = { OP(const, 0), OP(not, 0) };
+	const struct ca821x_filter_insn order[] = {
+		OP(const, 3), OP(const, 5), OP(lt, 0)
+	};
+
+	CHECK(matches(mask, 4, msg, sizeof(msg)) == 1);
+	CHECK(matches(ne, 3, msg, sizeof(msg)) == 0);
+	CHECK(matches(lt, 3, msg, sizeof(msg)) == 1);
+	CHECK(matches(gt, 3, msg, sizeof(msg)) == 0);
+	CHECK(matches(and, 3, msg, sizeof(msg)) == 0);
+	CHECK(matches(or, 3, msg, sizeof(msg)) == 1);
+	CHECK(matches(not, 2, msg, sizeof(msg)) == 1);
+	//Binary operators compare the value pushed first with the one pushed last
+	CHECK(matches(order, 3, msg, sizeof(msg)) == 1);
+}
+
+static void test_first_match(void)
+{
+	const uint8_t msg[] = { SPI_MCPS_DATA_INDICATION, 1, 9 };
+	const struct ca821x_filter_insn is_nine[] = {
+		OP(byte, 2), OP(const, 9), OP(eq, 0)
+	};
+	struct ca821x_filter filter;
+	struct filter_set *set = filter_set_create();
+	uint8_t cnf = SPI_MCPS_DATA_CONFIRM;
+	int pass_id;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.any_cmd = 1;
+	filter.predicate = is_nine;
+	filter.predicate_len = 3;
+
+	//A passing filter ahead of a dropping one keeps the message
+	filter.action = ca821x_filter_pass;
+	pass_id = filter_set_add(set, &filter);
+	filter.action = ca821x_filter_drop;
+	filter_set_add(set, &filter);
+	CHECK(filter_set_drops(set, msg, sizeof(msg)) == 0);
+
+	CHECK(filter_set_remove(set, pass_id) == 0);
+	CHECK(filter_set_drops(set, msg, sizeof(msg)) == 1);
+
+	//Only matching command IDs are tested at all
+	filter_set_destroy(set);
+	set = filter_set_create();
+	filter.any_cmd = 0;
+	filter.cmd_mask[cnf / 8] |= 1 << (cnf % 8);
+	filter_set_add(set, &filter);
+	CHECK(filter_set_drops(set, msg, sizeof(msg)) == 0);
+	filter_set_destroy(set);
+}
+
+int main(void)
+{
+	test_compile();
+	test_loads();
+	test_operators();
+	test_first_match();
+
+	if (s_failures) fprintf(stderr, "%d checks failed\n", s_failures);
+	return s_failures ? 1 : 0;
+}
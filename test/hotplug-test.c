@@ -0,0 +1,332 @@
+/**
+ * @file hotplug-test.c
+ * @brief Tests for USB hotplug detection, with the bus scan stubbed out
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//The hotplug thread is tested on its own, so its statics are needed and the
+//real bus scan is replaced with the stubs below
+#include "usb-hotplug.c"
+
+#define MAX_EVENTS 16
+#define MAX_FAKE_DONGLES 4
+#define EVENT_TIMEOUT_MS 2000
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			        #cond); \
+			s_failures++; \
+		} \
+	} while (0)
+
+struct hotplug_event
+{
+	char kind; //!< '+' for an arrival, '-' for a departure
+	char path[64];
+	char serial[16];
+};
+
+static pthread_mutex_t s_events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_events_cond = PTHREAD_COND_INITIALIZER;
+static struct hotplug_event s_events[MAX_EVENTS];
+static int s_event_count = 0;
+static int s_kicks = 0;
+
+//What the stubbed scan reports: the fixed list, or the hidraw nodes in a
+//directory if one is set. The directory is read by the hotplug thread.
+static const char *s_fake_paths[MAX_FAKE_DONGLES];
+static const char *s_fake_serials[MAX_FAKE_DONGLES];
+static int s_fake_count = 0;
+static int s_fake_fail = 0;
+static const char *s_fake_dir = NULL;
+
+int usb_exchange_scan(usb_exchange_scan_callback callback, void *context)
+{
+	const char *dir_path = __atomic_load_n(&s_fake_dir, __ATOMIC_ACQUIRE);
+	struct dirent *entry;
+	DIR *dir;
+
+	if (s_fake_fail) return -1;
+
+	if (!dir_path)
+	{
+		for (int i = 0; i < s_fake_count; i++)
+			callback(s_fake_paths[i], s_fake_serials[i], context);
+		return 0;
+	}
+
+	dir = opendir(dir_path);
+	if (!dir) return -1;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (!strncmp(entry->d_name, "hidraw", 6))
+			callback(entry->d_name, "", context);
+	}
+	closedir(dir);
+	return 0;
+}
+
+void usb_exchange_kick_reconnect(void)
+{
+	s_kicks++;
+}
+
+static void record(char kind, const char *path, const char *serial)
+{
+	pthread_mutex_lock(&s_events_mutex);
+	if (s_event_count < MAX_EVENTS)
+	{
+		s_events[s_event_count].kind = kind;
+		snprintf(s_events[s_event_count].path,
+		         sizeof(s_events[s_event_count].path), "%s", path);
+		snprintf(s_events[s_event_count].serial,
+		         sizeof(s_events[s_event_count].serial), "%s", serial);
+		s_event_count++;
+	}
+	pthread_cond_broadcast(&s_events_cond);
+	pthread_mutex_unlock(&s_events_mutex);
+}
+
+static void arrival(const char *path, const char *serial, void *context)
+{
+	CHECK(context == &s_events);
+	record('+', path, serial);
+}
+
+static void departure(const char *path, const char *serial, void *context)
+{
+	CHECK(context == &s_events);
+	record('-', path, serial);
+}
+
+static void clear_events(void)
+{
+	pthread_mutex_lock(&s_events_mutex);
+	s_event_count = 0;
+	pthread_mutex_unlock(&s_events_mutex);
+}
+
+//Return 1 if an event was recorded for the path, waiting up to timeout_ms
+static int saw_event(char kind, const char *path, int timeout_ms)
+{
+	struct timespec deadline;
+	int found = 0, rval = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&s_events_mutex);
+	while (!found && rval != ETIMEDOUT)
+	{
+		for (int i = 0; i < s_event_count && !found; i++)
+		{
+			found = s_events[i].kind == kind && !strcmp(s_events[i].path, path);
+		}
+		if (!found)
+			rval = pthread_cond_timedwait(&s_events_cond, &s_events_mutex,
+			                              &deadline);
+	}
+	pthread_mutex_unlock(&s_events_mutex);
+	return found;
+}
+
+static int event_count(void)
+{
+	int count;
+
+	pthread_mutex_lock(&s_events_mutex);
+	count = s_event_count;
+	pthread_mutex_unlock(&s_events_mutex);
+	return count;
+}
+
+static void test_uevents(void)
+{
+	const char hidraw[] = "add@/devices/x/hidraw/hidraw3\0ACTION=add\0"
+	                      "SUBSYSTEM=hidraw\0DEVNAME=hidraw3";
+	const char other_usb[] = "add@/devices/x/1-1\0ACTION=add\0"
+	                         "SUBSYSTEM=usb\0PRODUCT=46d/c52b/1201";
+	const char not_usb[] = "add@/devices/x/input9\0SUBSYSTEM=input\0";
+	char ours[128];
+	int len;
+
+	CHECK(is_relevant_uevent(hidraw, sizeof(hidraw)) == 1);
+	CHECK(is_relevant_uevent(other_usb, sizeof(other_usb)) == 0);
+	CHECK(is_relevant_uevent(not_usb, sizeof(not_usb)) == 0);
+
+	len = snprintf(ours, sizeof(ours), "remove@/devices/x/1-2%cSUBSYSTEM=usb%c"
+	               "PRODUCT=%x/%x/100", 0, 0, USB_VID, USB_PID);
+	CHECK(is_relevant_uevent(ours, len + 1) == 1);
+
+	//Our product under another subsystem is only interesting as hidraw
+	len = snprintf(ours, sizeof(ours), "add@/devices/x/1-2:1.0%c"
+	               "SUBSYSTEM=hid%cPRODUCT=%x/%x/100", 0, 0, USB_VID, USB_PID);
+	CHECK(is_relevant_uevent(ours, len + 1) == 0);
+}
+
+static void test_rescan(void)
+{
+	s_arrival = &arrival;
+	s_departure = &departure;
+	s_context = &s_events;
+
+	//Everything on the first scan is new
+	s_fake_paths[0] = "p0";
+	s_fake_serials[0] = "s0";
+	s_fake_paths[1] = "p1";
+	s_fake_serials[1] = "s1";
+	s_fake_count = 2;
+	rescan();
+	CHECK(event_count() == 2);
+	CHECK(saw_event('+', "p0", 0) && saw_event('+', "p1", 0));
+	CHECK(s_kicks == 2);
+
+	//Nothing changed
+	clear_events();
+	rescan();
+	CHECK(event_count() == 0);
+
+	//A failed scan says nothing about what is attached
+	s_fake_fail = 1;
+	rescan();
+	s_fake_fail = 0;
+	CHECK(event_count() == 0);
+
+	//A dongle went away
+	s_fake_count = 1;
+	rescan();
+	CHECK(event_count() == 1 && saw_event('-', "p1", 0));
+
+	//A different dongle took over the same path
+	clear_events();
+	s_fake_serials[0] = "s2";
+	rescan();
+	CHECK(event_count() == 2);
+	CHECK(saw_event('-', "p0", 0) && saw_event('+', "p0", 0));
+
+	forget_dongles();
+	clear_events();
+	s_fake_count = 0;
+	s_kicks = 0;
+}
+
+static int touch(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_CREAT | O_WRONLY, 0600);
+	if (fd < 0) return -1;
+	close(fd);
+	return 0;
+}
+
+static void remove_file(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	unlink(path);
+}
+
+static void test_watch_dir(void)
+{
+	char dir[] = "/tmp/ca821x-hotplug-XXXXXX";
+
+	if (!mkdtemp(dir))
+	{
+		CHECK(!"mkdtemp failed");
+		return;
+	}
+	__atomic_store_n(&s_fake_dir, dir, __ATOMIC_RELEASE);
+
+	//A node that is already there is reported when hotplug starts
+	CHECK(touch(dir, "hidraw0") == 0);
+	CHECK(ca821x_util_set_hotplug_dir(dir) == 0);
+	CHECK(ca821x_util_start_hotplug(&arrival, &departure, &s_events) == 0);
+	CHECK(ca821x_util_start_hotplug(&arrival, &departure, &s_events) == -1);
+	CHECK(s_using_inotify);
+	CHECK(saw_event('+', "hidraw0", EVENT_TIMEOUT_MS));
+
+	CHECK(touch(dir, "hidraw1") == 0);
+	CHECK(saw_event('+', "hidraw1", EVENT_TIMEOUT_MS));
+
+	remove_file(dir, "hidraw0");
+	CHECK(saw_event('-', "hidraw0", EVENT_TIMEOUT_MS));
+
+	//Other nodes don't cause a rescan, so a change behind their back is missed
+	clear_events();
+	__atomic_store_n(&s_fake_dir, NULL, __ATOMIC_RELEASE);
+	CHECK(touch(dir, "ttyUSB0") == 0);
+	usleep(3 * USB_HOTPLUG_SETTLE_MS * 1000);
+	CHECK(event_count() == 0);
+
+	ca821x_util_stop_hotplug();
+	ca821x_util_set_hotplug_dir(NULL);
+
+	remove_file(dir, "hidraw1");
+	remove_file(dir, "ttyUSB0");
+	rmdir(dir);
+}
+
+int main(void)
+{
+	test_uevents();
+	test_rescan();
+	test_watch_dir();
+
+	if (s_failures) fprintf(stderr, "%d checks failed\n", s_failures);
+	return s_failures ? 1 : 0;
+}
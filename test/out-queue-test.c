@@ -0,0 +1,170 @@
+/**
+ * @file out-queue-test.c
+ * @brief Tests for the prioritised out queue
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-out-queue.h"
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			        #cond); \
+			s_failures++; \
+		} \
+	} while (0)
+
+static struct ca821x_dev s_dev;
+
+static void init_base(struct ca821x_exchange_base *priv)
+{
+	memset(priv, 0, sizeof(*priv));
+	pthread_mutex_init(&priv->out_queue_mutex, NULL);
+	pthread_cond_init(&priv->out_space_cond, NULL);
+}
+
+static void deinit_base(struct ca821x_exchange_base *priv)
+{
+	out_queue_flush(priv);
+	pthread_mutex_destroy(&priv->out_queue_mutex);
+	pthread_cond_destroy(&priv->out_space_cond);
+}
+
+//Queue a one byte message, tagged with its class and a sequence number
+static int add(struct ca821x_exchange_base *priv,
+               enum ca821x_out_class out_class, uint8_t seq)
+{
+	uint8_t buf[2] = {out_class, seq};
+
+	return out_queue_add(priv, out_class, buf, sizeof(buf), &s_dev);
+}
+
+//Pop the next message, returning its class or -1 if nothing was queued
+static int pop(struct ca821x_exchange_base *priv, uint8_t *seq_out)
+{
+	struct ca821x_dev *pDeviceRef = NULL;
+	uint8_t buf[2];
+	uint64_t timestamp;
+
+	if (out_queue_pop(priv, buf, sizeof(buf), &pDeviceRef, &timestamp) != 2)
+		return -1;
+	CHECK(pDeviceRef == &s_dev);
+	if (seq_out) *seq_out = buf[1];
+	return buf[0];
+}
+
+static void test_priority(void)
+{
+	struct ca821x_exchange_base priv;
+
+	init_base(&priv);
+	CHECK(add(&priv, ca821x_out_user, 0) == 0);
+	CHECK(add(&priv, ca821x_out_data, 0) == 0);
+	CHECK(add(&priv, ca821x_out_mgmt, 0) == 0);
+	CHECK(add(&priv, ca821x_out_sync, 0) == 0);
+	CHECK(out_queue_pending(&priv) == 4);
+
+	CHECK(pop(&priv, NULL) == ca821x_out_sync);
+	CHECK(pop(&priv, NULL) == ca821x_out_mgmt);
+	CHECK(pop(&priv, NULL) == ca821x_out_data);
+	CHECK(pop(&priv, NULL) == ca821x_out_user);
+	CHECK(pop(&priv, NULL) == -1);
+	for (int i = 0; i < ca821x_out_class_count; i++)
+		CHECK(priv.out_stats[i].promoted == 0);
+	deinit_base(&priv);
+}
+
+static void test_starvation(void)
+{
+	struct ca821x_exchange_base priv;
+	uint8_t seq;
+	int i;
+
+	init_base(&priv);
+	for (i = 0; i < 2 * CA821X_OUT_STARVATION_LIMIT; i++)
+		add(&priv, ca821x_out_data, i);
+	add(&priv, ca821x_out_user, 0);
+	add(&priv, ca821x_out_user, 1);
+
+	//A lower class is sent once it has been passed over enough times
+	for (i = 0; i < CA821X_OUT_STARVATION_LIMIT; i++)
+	{
+		CHECK(pop(&priv, &seq) == ca821x_out_data);
+		CHECK(seq == i);
+	}
+	CHECK(priv.out_passed[ca821x_out_user] == CA821X_OUT_STARVATION_LIMIT);
+	CHECK(pop(&priv, &seq) == ca821x_out_user);
+	CHECK(seq == 0);
+	CHECK(priv.out_stats[ca821x_out_user].promoted == 1);
+
+	//And then has to wait its turn again
+	CHECK(priv.out_passed[ca821x_out_user] == 0);
+	CHECK(pop(&priv, &seq) == ca821x_out_data);
+	CHECK(seq == CA821X_OUT_STARVATION_LIMIT);
+	CHECK(priv.out_passed[ca821x_out_user] == 1);
+	deinit_base(&priv);
+
+	//Time spent with nothing waiting doesn't count as being passed over
+	init_base(&priv);
+	for (i = 0; i < CA821X_OUT_STARVATION_LIMIT; i++)
+	{
+		add(&priv, ca821x_out_mgmt, i);
+		CHECK(pop(&priv, NULL) == ca821x_out_mgmt);
+	}
+	CHECK(priv.out_passed[ca821x_out_user] == 0);
+	add(&priv, ca821x_out_mgmt, 0);
+	add(&priv, ca821x_out_user, 0);
+	CHECK(pop(&priv, NULL) == ca821x_out_mgmt);
+	CHECK(pop(&priv, NULL) == ca821x_out_user);
+	CHECK(priv.out_stats[ca821x_out_user].promoted == 0);
+	deinit_base(&priv);
+}
+
+int main(void)
+{
+	test_priority();
+	test_starvation();
+
+	if (s_failures) fprintf(stderr, "%d checks failed\n", s_failures);
+	return s_failures ? 1 : 0;
+}
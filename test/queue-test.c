@@ -0,0 +1,138 @@
+/**
+ * @file queue-test.c
+ * @brief Tests for the buffer queues
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-queue.h"
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			        #cond); \
+			s_failures++; \
+		} \
+	} while (0)
+
+static struct ca821x_dev s_dev;
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Add a one byte buffer to a bounded queue, returning 1 if one was dropped
+static int add(struct buffer_queue **queue, uint8_t value, size_t capacity,
+               int drop_newest)
+{
+	return add_to_bounded_queue(queue, &s_mutex, NULL, &value, 1, &s_dev,
+	                            capacity, drop_newest);
+}
+
+//Pop a one byte buffer, returning its value or -1 if the queue was empty
+static int pop(struct buffer_queue **queue)
+{
+	struct ca821x_dev *pDeviceRef = NULL;
+	uint8_t value;
+
+	if (pop_from_queue(queue, &s_mutex, &value, 1, &pDeviceRef) != 1) return -1;
+	CHECK(pDeviceRef == &s_dev);
+	return value;
+}
+
+static void test_drop_oldest(void)
+{
+	struct buffer_queue *queue = NULL;
+
+	CHECK(add(&queue, 1, 3, 0) == 0);
+	CHECK(add(&queue, 2, 3, 0) == 0);
+	CHECK(add(&queue, 3, 3, 0) == 0);
+	CHECK(add(&queue, 4, 3, 0) == 1);
+	CHECK(add(&queue, 5, 3, 0) == 1);
+	CHECK(queue_depth(&queue, &s_mutex) == 3);
+
+	CHECK(pop(&queue) == 3);
+	CHECK(pop(&queue) == 4);
+	CHECK(pop(&queue) == 5);
+	CHECK(pop(&queue) == -1);
+
+	//With room for one, the head being dropped is also the tail
+	CHECK(add(&queue, 6, 1, 0) == 0);
+	CHECK(add(&queue, 7, 1, 0) == 1);
+	CHECK(queue_depth(&queue, &s_mutex) == 1);
+	CHECK(pop(&queue) == 7);
+	CHECK(queue == NULL);
+}
+
+static void test_drop_newest(void)
+{
+	struct buffer_queue *queue = NULL;
+
+	CHECK(add(&queue, 1, 2, 1) == 0);
+	CHECK(add(&queue, 2, 2, 1) == 0);
+	CHECK(add(&queue, 3, 2, 1) == 1);
+	CHECK(queue_depth(&queue, &s_mutex) == 2);
+
+	CHECK(pop(&queue) == 1);
+	//Space is made again as soon as a buffer is taken
+	CHECK(add(&queue, 4, 2, 1) == 0);
+	CHECK(pop(&queue) == 2);
+	CHECK(pop(&queue) == 4);
+	CHECK(pop(&queue) == -1);
+}
+
+static void test_unbounded(void)
+{
+	struct buffer_queue *queue = NULL;
+
+	for (int i = 0; i < 100; i++) CHECK(add(&queue, i, 0, 0) == 0);
+	CHECK(queue_depth(&queue, &s_mutex) == 100);
+	CHECK(flush_queue(&queue, &s_mutex) == 100);
+	CHECK(queue == NULL);
+}
+
+int main(void)
+{
+	test_drop_oldest();
+	test_drop_newest();
+	test_unbounded();
+
+	if (s_failures) fprintf(stderr, "%d checks failed\n", s_failures);
+	return s_failures ? 1 : 0;
+}
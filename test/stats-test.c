@@ -0,0 +1,140 @@
+/**
+ * @file stats-test.c
+ * @brief Tests for the latency histograms
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ca821x-posix/ca821x-posix.h"
+#include "ca821x-stats.h"
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			        #cond); \
+			s_failures++; \
+		} \
+	} while (0)
+
+//Upper bound of the bucket a value was recorded into, found by recording it
+//below a much larger sample so that the largest sample doesn't clamp it
+static uint32_t bucket_of(uint32_t value)
+{
+	struct ca821x_histogram hist;
+
+	memset(&hist, 0, sizeof(hist));
+	histogram_record(&hist, value);
+	histogram_record(&hist, UINT32_MAX);
+	return ca821x_histogram_percentile(&hist, 50);
+}
+
+static void test_buckets(void)
+{
+	struct ca821x_histogram hist;
+
+	//Small values get a bucket each
+	for (uint32_t v = 0; v < CA821X_HIST_SUB_COUNT; v++)
+		CHECK(bucket_of(v) == v);
+
+	//Above that, each power of two is split into CA821X_HIST_SUB_COUNT
+	CHECK(bucket_of(CA821X_HIST_SUB_COUNT) == CA821X_HIST_SUB_COUNT);
+	CHECK(bucket_of(2 * CA821X_HIST_SUB_COUNT - 1) == 2 * CA821X_HIST_SUB_COUNT - 1);
+	CHECK(bucket_of(2 * CA821X_HIST_SUB_COUNT) == 2 * CA821X_HIST_SUB_COUNT + 1);
+	CHECK(bucket_of(2 * CA821X_HIST_SUB_COUNT + 1) == 2 * CA821X_HIST_SUB_COUNT + 1);
+	CHECK(bucket_of(4 * CA821X_HIST_SUB_COUNT) == 4 * CA821X_HIST_SUB_COUNT + 3);
+
+	//So no value is reported more than 1/CA821X_HIST_SUB_COUNT too high
+	for (uint32_t v = 1; v < (1u << 31); v += v / 7 + 1)
+	{
+		uint32_t upper = bucket_of(v);
+
+		CHECK(upper >= v);
+		CHECK(upper - v <= v / CA821X_HIST_SUB_COUNT);
+	}
+	CHECK(bucket_of(UINT32_MAX - 1) == UINT32_MAX);
+
+	//Samples too large for the histogram are counted at its top
+	memset(&hist, 0, sizeof(hist));
+	histogram_record(&hist, (uint64_t)1 << 40);
+	CHECK(hist.count == 1);
+	CHECK(hist.max_us == UINT32_MAX);
+	CHECK(hist.buckets[CA821X_HIST_BUCKETS - 1] == 1);
+}
+
+static void test_percentiles(void)
+{
+	struct ca821x_histogram hist;
+
+	memset(&hist, 0, sizeof(hist));
+	CHECK(ca821x_histogram_percentile(&hist, 50) == 0);
+
+	for (uint64_t v = 1; v <= 10; v++) histogram_record(&hist, v);
+	CHECK(hist.count == 10);
+	CHECK(hist.sum_us == 55);
+	CHECK(hist.max_us == 10);
+
+	CHECK(ca821x_histogram_percentile(&hist, 50) == 5);
+	CHECK(ca821x_histogram_percentile(&hist, 90) == 9);
+	CHECK(ca821x_histogram_percentile(&hist, 99.9) == 10);
+	CHECK(ca821x_histogram_percentile(&hist, 100) == 10);
+	//At least one sample is always counted
+	CHECK(ca821x_histogram_percentile(&hist, 0) == 1);
+	//Out of range percentiles are clamped
+	CHECK(ca821x_histogram_percentile(&hist, -5) == 1);
+	CHECK(ca821x_histogram_percentile(&hist, 150) == 10);
+
+	//Never reported above the largest sample, even inside a wide bucket
+	memset(&hist, 0, sizeof(hist));
+	histogram_record(&hist, 1000);
+	CHECK(ca821x_histogram_percentile(&hist, 100) == 1000);
+
+	histogram_reset(&hist);
+	CHECK(hist.count == 0);
+	CHECK(ca821x_histogram_percentile(&hist, 100) == 0);
+}
+
+int main(void)
+{
+	test_buckets();
+	test_percentiles();
+
+	if (s_failures) fprintf(stderr, "%d checks failed\n", s_failures);
+	return s_failures ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+/**
+ * @file ca821x-top.c
+ * @brief Live monitor for the statistics published by ca821x-posix
+ *//*
+ * Copyright (c) 2017, Cascoda
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: ca821x-top [pid]
+ *
+ * Attaches to the statistics segment of the given process (or the first one
+ * found if no pid is given) and redraws a table of per-device traffic rates,
+ * queue depths and latency percentiles every second.
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ca821x-posix/ca821x-types.h"
+#include "ca821x-posix/ca821x-stats-shm.h"
+
+/* Colour codes for printf */
+#ifndef NO_COLOR
+#define RED        "\x1b[31m"
+#define GREEN      "\x1b[32m"
+#define BOLDWHITE  "\x1b[1m\x1b[37m"
+#define RESET      "\x1b[0m"
+#define CLEAR      "\x1b[H\x1b[2J"
+#else
+#define RED        ""
+#define GREEN      ""
+#define BOLDWHITE  ""
+#define RESET      ""
+#define CLEAR      "\n"
+#endif
+
+#define COLOR_SET(C,X) C X RESET
+
+#define REFRESH_S 1
+
+static const char *latency_names[] = {
+	[ca821x_latency_sync] = "Sync RTT",
+	[ca821x_latency_tx_queue] = "Tx queue",
+	[ca821x_latency_rx_dispatch] = "Rx->cb",
+	[ca821x_latency_callback] = "Callback",
+	[ca821x_latency_recovery_reseat] = "Reseat",
+	[ca821x_latency_recovery_callback] = "Err cb",
+	[ca821x_latency_recovery_restore] = "Restore",
+};
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void quit(int sig)
+{
+	(void) sig;
+	s_quit = 1;
+}
+
+//Find the pid of the first process publishing statistics
+static int find_publisher(void)
+{
+	DIR *dir = opendir("/dev/shm");
+	struct dirent *ent;
+	int pid = -1;
+
+	if (!dir) return -1;
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (strncmp(ent->d_name, CA821X_SHM_NAME_PREFIX,
+		            strlen(CA821X_SHM_NAME_PREFIX)) == 0)
+		{
+			pid = atoi(ent->d_name + strlen(CA821X_SHM_NAME_PREFIX));
+			break;
+		}
+	}
+	closedir(dir);
+	return pid;
+}
+
+static const struct ca821x_shm_stats *attach(int pid)
+{
+	char name[32];
+	const struct ca821x_shm_stats *shm;
+	int fd;
+
+	snprintf(name, sizeof(name), CA821X_SHM_NAME_FMT, pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return NULL;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) return NULL;
+
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != CA821X_SHM_MAGIC ||
+	    shm->version != CA821X_SHM_VERSION)
+	{
+		munmap((void *)shm, sizeof(*shm));
+		return NULL;
+	}
+	return shm;
+}
+
+static double rate(uint64_t now, uint64_t prev, uint64_t dt_ns)
+{
+	if (dt_ns == 0 || now < prev) return 0;
+	return (double)(now - prev) * 1e9 / dt_ns;
+}
+
+static void draw(const struct ca821x_shm_stats *shm,
+                 struct ca821x_shm_device *prev)
+{
+	struct ca821x_shm_device cur;
+	int lat_count;
+
+	printf(CLEAR);
+	printf(COLOR_SET(BOLDWHITE, "ca821x-top") " - pid %d, downstream queue %u\n\n",
+	       shm->pid, __atomic_load_n(&shm->downstream_queue_depth, __ATOMIC_RELAXED));
+	printf("|Dev|Type  |" COLOR_SET(GREEN, "  Tx/s  |  Rx/s  | TxB/s  | RxB/s  ")
+	       "|" COLOR_SET(RED, " Err ") "| InQ| OutQ| RstQ|\n");
+
+	for (uint32_t i = 0; i < shm->max_devices && i < CA821X_SHM_MAX_DEVICES; i++)
+	{
+		uint64_t dt;
+
+		if (ca821x_shm_read_device(&shm->devices[i], &cur) || !cur.in_use)
+		{
+			prev[i].in_use = 0;
+			continue;
+		}
+
+		dt = prev[i].in_use ? cur.timestamp_ns - prev[i].timestamp_ns : 0;
+		printf("|%3u|%-6s|" GREEN "%8.1f|%8.1f|%8.0f|%8.0f" RESET "|" RED "%5llu" RESET
+		       "|%4u|%5u|%5u|\n",
+		       i, cur.exchange_type == ca821x_exchange_usb ? "usb" : "kernel",
+		       rate(cur.tx_msgs, prev[i].tx_msgs, dt),
+		       rate(cur.rx_msgs, prev[i].rx_msgs, dt),
+		       rate(cur.tx_bytes, prev[i].tx_bytes, dt),
+		       rate(cur.rx_bytes, prev[i].rx_bytes, dt),
+		       (unsigned long long)cur.errors,
+		       cur.in_queue_depth, cur.out_queue_depth, cur.restore_queue_depth);
+	}
+
+	printf("\nLatency (us)  p50 / p99 / p99.9 / max\n");
+	for (uint32_t i = 0; i < shm->max_devices && i < CA821X_SHM_MAX_DEVICES; i++)
+	{
+		if (ca821x_shm_read_device(&shm->devices[i], &cur) || !cur.in_use) continue;
+
+		lat_count = cur.num_latencies;
+		if (lat_count > ca821x_latency_count) lat_count = ca821x_latency_count;
+
+		printf("|%3u|", i);
+		for (int l = 0; l < lat_count; l++)
+		{
+			const struct ca821x_shm_latency *lat = &cur.latency[l];
+			printf(" %s %u/%u/%u/%u |", latency_names[l], lat->p50_us,
+			       lat->p99_us, lat->p999_us, lat->max_us);
+		}
+		printf("\n");
+		prev[i] = cur;
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct ca821x_shm_device prev[CA821X_SHM_MAX_DEVICES];
+	const struct ca821x_shm_stats *shm;
+	int pid;
+
+	pid = (argc > 1) ? atoi(argv[1]) : find_publisher();
+	if (pid <= 0)
+	{
+		fprintf(stderr, "No ca821x-posix process found. Usage: %s [pid]\n", argv[0]);
+		return -1;
+	}
+
+	shm = attach(pid);
+	if (!shm)
+	{
+		fprintf(stderr, "Could not attach to statistics of process %d\n", pid);
+		return -1;
+	}
+
+	signal(SIGINT, quit);
+	signal(SIGTERM, quit);
+
+	while (!s_quit)
+	{
+		//The publisher removes its segment on exit
+		if (kill(pid, 0) != 0 && errno == ESRCH)
+		{
+			printf("\nProcess %d has exited\n", pid);
+			break;
+		}
+		draw(shm, prev);
+		sleep(REFRESH_S);
+	}
+
+	munmap((void *)shm, sizeof(*shm));
+	return 0;
+}